@@ -0,0 +1,817 @@
+/* libomnius/libomnius.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Client library for talking to omnius, see libomnius.h.
+ *
+ * 2015 - Mike Clark
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "libomnius.h"
+#include "../omnius/unixsock.h"
+
+/* The part of a v1 message in front of the blob data */
+#define LIBOMNIUS_HEAD_LEN (sizeof(long) + sizeof(blob_header_t))
+
+
+/*
+ * CONNECTION ROUTINES
+ */
+
+/* Common setup of a connection. Replies are routed by a token derived from the calling thread. */
+void
+libomnius_init(int kind, libomnius_t *lo)
+{
+    memset(lo, 0, sizeof(libomnius_t));
+    lo->kind = kind;
+    lo->fd = -1;
+    lo->msgqid_in = -1;
+    lo->msgqid_out = -1;
+    lo->pid = getpid();
+    lo->token = MTYPE_TOKEN(syscall(SYS_gettid));
+}
+
+int
+libomnius_open_msgq(key_t msg_in_key, key_t msg_out_key, libomnius_t *lo)
+{
+    int ret = EXIT_FAILURE;
+
+    libomnius_init(LIBOMNIUS_MSGQ, lo);
+    if ((lo->msgqid_in = msgget(msg_in_key, 0)) != -1 && (lo->msgqid_out = msgget(msg_out_key, 0)) != -1)
+        ret = libomnius_hello(lo);
+    return ret;
+}
+
+int
+libomnius_open_socket(char *path, libomnius_t *lo)
+{
+    int ret = EXIT_FAILURE;
+
+    libomnius_init(LIBOMNIUS_SOCKET, lo);
+    if ((lo->fd = unixsock_connect(path ? path : UNIXSOCK_DEFAULT_PATH)) != -1) {
+        if ((ret = libomnius_hello(lo)) != EXIT_SUCCESS) {
+            close(lo->fd);
+            lo->fd = -1;
+        }
+    }
+    return ret;
+}
+
+int
+libomnius_close(libomnius_t *lo)
+{
+    int ret = libomnius_wait_all(lo);
+
+    if (lo->fd != -1) {
+        close(lo->fd);
+        lo->fd = -1;
+    }
+    return ret;
+}
+
+/*
+ * Set the coalescing window, in microseconds. Zero turns coalescing off (and sends the batch being coalesced).
+ */
+int
+libomnius_set_coalesce(libomnius_t *lo, long usec)
+{
+    int ret = EXIT_FAILURE;
+
+    if (usec >= 0) {
+        lo->coalesce_usec = usec;
+        ret = usec ? EXIT_SUCCESS : libomnius_flush(lo);
+    }
+    return ret;
+}
+
+/*
+ * Say HELLO (as v2, since the field widths may differ) and check that omnius speaks v1 with our field width.
+ */
+int
+libomnius_hello(libomnius_t *lo)
+{
+    int ret = EXIT_FAILURE;
+    msgbuf_t msg;
+    hello_t hello;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.versions = HELLO_VERSION(1) | HELLO_VERSION(BLOB_V2_VERSION);
+    hello.internal_bit = SECMEM_INTERNAL_BIT;
+    hello.max_data = MAX_BLOB_DATA_SIZE;
+
+    memset(&msg.blob.head, 0, sizeof(blob_header_t));
+    msg.mtype = MTYPE_HELLO;
+    msg.blob.head.pid = lo->pid;
+    msg.blob.head.data_len = sizeof(hello);
+    memcpy(msg.blob.body.data, &hello, sizeof(hello));
+
+    if (libomnius_call(lo, &msg) == EXIT_SUCCESS && msg.blob.head.data_len >= sizeof(hello_t)) {
+        memcpy(&lo->hello, msg.blob.body.data, sizeof(hello_t));
+        if (lo->hello.internal_bit == SECMEM_INTERNAL_BIT && (lo->hello.versions & HELLO_VERSION(1)))
+            ret = EXIT_SUCCESS;
+        else
+            errno = EPROTO;
+    }
+    return ret;
+}
+
+
+/*
+ * BLOCKING ROUTINES
+ */
+
+int
+libomnius_load(libomnius_t *lo, SECMEM_INTERNAL_T size, char **policies, size_t count)
+{
+    return libomnius_load_opts(lo, size, policies, count, NULL);
+}
+
+int
+libomnius_load_opts(libomnius_t *lo, SECMEM_INTERNAL_T size, char **policies, size_t count, load_opts_t *opts)
+{
+    int ret = EXIT_FAILURE;
+    msgbuf_t msg;
+    policy_t *policy = msg.blob.body.policy_entry;
+    SECMEM_INTERNAL_T data_len = 0;
+    size_t i, len;
+
+    memset(&msg.blob.head, 0, sizeof(blob_header_t));
+    msg.mtype = MTYPE_LOAD;
+    msg.blob.head.pid = lo->pid;
+    msg.blob.head.size = size;
+    msg.blob.head.policy_count = count;
+
+    for (i = 0; i < count; i++) {
+        len = strlen(policies[i]);
+        if (data_len + sizeof(policy_head_t) + len > MAX_BLOB_DATA_SIZE) {
+            errno = EMSGSIZE;
+            break;
+        }
+        policy->head.len = len;
+        memcpy(policy->body.regex, policies[i], len);
+        data_len += SIZEOF_POLICY(policy);
+        policy = NEXT_POLICY(policy);
+    }
+    if (i == count && opts) {
+        if (data_len + sizeof(load_opts_t) > MAX_BLOB_DATA_SIZE) {
+            errno = EMSGSIZE;
+            i = count + 1;
+        } else {
+            memcpy(msg.blob.body.data + data_len, opts, sizeof(load_opts_t));
+            data_len += sizeof(load_opts_t);
+        }
+    }
+    if (i == count) {
+        msg.blob.head.data_len = data_len;
+        ret = libomnius_call(lo, &msg);
+    }
+    return ret;
+}
+
+int
+libomnius_unload(libomnius_t *lo)
+{
+    msgbuf_t msg;
+
+    memset(&msg.blob.head, 0, sizeof(blob_header_t));
+    msg.mtype = MTYPE_UNLOAD;
+    msg.blob.head.pid = lo->pid;
+    return libomnius_call(lo, &msg);
+}
+
+int
+libomnius_resize(libomnius_t *lo, SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T *size_p)
+{
+    int ret;
+    msgbuf_t msg;
+
+    memset(&msg.blob.head, 0, sizeof(blob_header_t));
+    msg.mtype = MTYPE_RESIZE;
+    msg.blob.head.pid = lo->pid;
+    msg.blob.head.size = size;
+    ret = libomnius_call(lo, &msg);
+    if (size_p && IS_MTYPE_REPLY(msg.mtype))
+        *size_p = msg.blob.head.size;
+    return ret;
+}
+
+int
+libomnius_alloc(libomnius_t *lo, SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T policy_id, SECMEM_INTERNAL_T *addr)
+{
+    return libomnius_alloc_opts(lo, size, policy_id, NULL, addr);
+}
+
+int
+libomnius_alloc_opts(libomnius_t *lo, SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T policy_id, alloc_opts_t *opts,
+                     SECMEM_INTERNAL_T *addr)
+{
+    int ret = EXIT_FAILURE;
+    libomnius_future_t fut;
+
+    if (libomnius_async_alloc_opts(lo, &fut, size, policy_id, opts) == EXIT_SUCCESS &&
+        (ret = libomnius_wait(lo, &fut)) == EXIT_SUCCESS)
+        *addr = fut.head.addr;
+    return ret;
+}
+
+int
+libomnius_dealloc(libomnius_t *lo, SECMEM_INTERNAL_T addr)
+{
+    int ret = EXIT_FAILURE;
+    libomnius_future_t fut;
+
+    if (libomnius_async_dealloc(lo, &fut, addr) == EXIT_SUCCESS)
+        ret = libomnius_wait(lo, &fut);
+    return ret;
+}
+
+int
+libomnius_realloc(libomnius_t *lo, SECMEM_INTERNAL_T addr, SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T *addr_p)
+{
+    int ret;
+    msgbuf_t msg;
+
+    memset(&msg.blob.head, 0, sizeof(blob_header_t));
+    msg.mtype = MTYPE_REALLOC;
+    msg.blob.head.pid = lo->pid;
+    msg.blob.head.addr = addr;
+    msg.blob.head.new_size = size;
+    if ((ret = libomnius_call(lo, &msg)) == EXIT_SUCCESS)
+        *addr_p = msg.blob.head.addr;
+    return ret;
+}
+
+int
+libomnius_clone(libomnius_t *lo, SECMEM_INTERNAL_T addr, SECMEM_INTERNAL_T *addr_p)
+{
+    int ret;
+    msgbuf_t msg;
+
+    memset(&msg.blob.head, 0, sizeof(blob_header_t));
+    msg.mtype = MTYPE_CLONE;
+    msg.blob.head.pid = lo->pid;
+    msg.blob.head.addr = addr;
+    if ((ret = libomnius_call(lo, &msg)) == EXIT_SUCCESS)
+        *addr_p = msg.blob.head.addr;
+    return ret;
+}
+
+int
+libomnius_read(libomnius_t *lo, SECMEM_INTERNAL_T addr, char *buf, size_t len)
+{
+    int ret = EXIT_FAILURE;
+    libomnius_future_t fut;
+
+    if (libomnius_async_read(lo, &fut, addr, buf, len) == EXIT_SUCCESS)
+        ret = libomnius_wait(lo, &fut);
+    return ret;
+}
+
+int
+libomnius_write(libomnius_t *lo, SECMEM_INTERNAL_T addr, char *buf, size_t len)
+{
+    int ret = EXIT_FAILURE;
+    libomnius_future_t fut;
+
+    if (libomnius_async_write(lo, &fut, addr, buf, len) == EXIT_SUCCESS)
+        ret = libomnius_wait(lo, &fut);
+    return ret;
+}
+
+int
+libomnius_call(libomnius_t *lo, msgbuf_t *msg_buf)
+{
+    int ret = EXIT_FAILURE;
+    libomnius_future_t fut;
+
+    if (libomnius_async_call(lo, &fut, msg_buf, msg_buf->blob.body.data, MAX_BLOB_DATA_SIZE) == EXIT_SUCCESS) {
+        ret = libomnius_wait(lo, &fut);
+        msg_buf->mtype = fut.mtype;
+        msg_buf->blob.head = fut.head;
+    }
+    return ret;
+}
+
+
+/*
+ * LEASE ROUTINES
+ */
+
+int
+libomnius_lease(libomnius_t *lo, SECMEM_INTERNAL_T addr, libomnius_lease_t *lease)
+{
+    int ret = EXIT_FAILURE;
+    libomnius_future_t fut;
+    msgbuf_t msg;
+    void *data;
+
+    memset(lease, 0, sizeof(libomnius_lease_t));
+    lease->fd = -1;
+    memset(&msg.blob.head, 0, sizeof(blob_header_t));
+    msg.mtype = MTYPE_LEASE;
+    msg.blob.head.pid = lo->pid;
+    msg.blob.head.addr = addr;
+    if (lo->kind != LIBOMNIUS_SOCKET) {
+        errno = EOPNOTSUPP;
+    } else if (libomnius_async_call(lo, &fut, &msg, NULL, 0) == EXIT_SUCCESS &&
+               libomnius_wait(lo, &fut) == EXIT_SUCCESS && fut.fd >= 0) {
+        data = mmap(NULL, fut.head.lease_size, PROT_READ, MAP_SHARED, fut.fd, 0);
+        if (data != MAP_FAILED) {
+            lease->data = (const char *) data;
+            lease->size = fut.head.lease_size;
+            lease->addr = fut.head.addr;
+            lease->fd = fut.fd;
+            ret = EXIT_SUCCESS;
+        } else {
+            close(fut.fd);
+        }
+    }
+    return ret;
+}
+
+/* omnius revokes a lease by truncating it */
+int
+libomnius_lease_valid(libomnius_lease_t *lease)
+{
+    struct stat st;
+
+    return lease->fd >= 0 && fstat(lease->fd, &st) == 0 && st.st_size != 0;
+}
+
+int
+libomnius_lease_release(libomnius_lease_t *lease)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (lease->data && munmap((void *) lease->data, lease->size) != 0)
+        ret = EXIT_FAILURE;
+    if (lease->fd >= 0)
+        close(lease->fd);
+    memset(lease, 0, sizeof(libomnius_lease_t));
+    lease->fd = -1;
+    return ret;
+}
+
+
+/*
+ * ASYNC ROUTINES
+ */
+
+int
+libomnius_async_alloc(libomnius_t *lo, libomnius_future_t *fut, SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T policy_id)
+{
+    return libomnius_async_alloc_opts(lo, fut, size, policy_id, NULL);
+}
+
+int
+libomnius_async_alloc_opts(libomnius_t *lo, libomnius_future_t *fut, SECMEM_INTERNAL_T size,
+                           SECMEM_INTERNAL_T policy_id, alloc_opts_t *opts)
+{
+    blob_header_t head;
+
+    memset(&head, 0, sizeof(head));
+    head.size = size;
+    head.policy_id = policy_id;
+    head.data_len = opts ? sizeof(alloc_opts_t) : 0;
+    return libomnius_queue(lo, fut, MTYPE_ALLOC, &head, (char *) opts, NULL, 0);
+}
+
+int
+libomnius_async_dealloc(libomnius_t *lo, libomnius_future_t *fut, SECMEM_INTERNAL_T addr)
+{
+    blob_header_t head;
+
+    memset(&head, 0, sizeof(head));
+    head.addr = addr;
+    return libomnius_queue(lo, fut, MTYPE_DEALLOC, &head, NULL, NULL, 0);
+}
+
+int
+libomnius_async_read(libomnius_t *lo, libomnius_future_t *fut, SECMEM_INTERNAL_T addr, char *buf, size_t len)
+{
+    blob_header_t head;
+
+    memset(&head, 0, sizeof(head));
+    head.addr = addr;
+    head.data_len = len;
+    return libomnius_queue(lo, fut, MTYPE_READ, &head, NULL, buf, len);
+}
+
+int
+libomnius_async_write(libomnius_t *lo, libomnius_future_t *fut, SECMEM_INTERNAL_T addr, char *buf, size_t len)
+{
+    blob_header_t head;
+
+    memset(&head, 0, sizeof(head));
+    head.addr = addr;
+    head.data_len = len;
+    return libomnius_queue(lo, fut, MTYPE_WRITE, &head, buf, NULL, 0);
+}
+
+/*
+ * Send a request built by hand straight away (after anything being coalesced). The reply data goes to BUF.
+ */
+int
+libomnius_async_call(libomnius_t *lo, libomnius_future_t *fut, msgbuf_t *msg_buf, char *buf, size_t len)
+{
+    int ret = EXIT_FAILURE;
+
+    memset(fut, 0, sizeof(libomnius_future_t));
+    fut->ret = EXIT_FAILURE;
+    fut->fd = -1;
+    fut->mtype = msg_buf->mtype;
+    fut->buf = buf;
+    fut->len = len;
+    if (libomnius_flush(lo) == EXIT_SUCCESS)
+        ret = libomnius_send(lo, msg_buf, NULL, fut);
+    return ret;
+}
+
+int
+libomnius_wait(libomnius_t *lo, libomnius_future_t *fut)
+{
+    /* no point in coalescing any longer, someone is waiting */
+    if (fut->state == LIBOMNIUS_QUEUED)
+        libomnius_flush(lo);
+
+    /* a broken connection fails everything in flight, so this always ends */
+    while (fut->state == LIBOMNIUS_SENT)
+        libomnius_recv(lo, TRUE);
+
+    return fut->ret;
+}
+
+int
+libomnius_wait_all(libomnius_t *lo)
+{
+    int ret = libomnius_flush(lo);
+
+    while (lo->inflight_count)
+        libomnius_recv(lo, TRUE);
+    return ret;
+}
+
+int
+libomnius_poll(libomnius_t *lo)
+{
+    int ret = EXIT_SUCCESS, recv_ret = EXIT_SUCCESS;
+
+    if (libomnius_expired(lo))
+        ret = libomnius_flush(lo);
+
+    while (lo->inflight_count && (recv_ret = libomnius_recv(lo, FALSE)) == EXIT_SUCCESS) {;}
+    if (recv_ret != EXIT_SUCCESS && errno != EAGAIN && errno != EINTR)
+        ret = EXIT_FAILURE;
+    return ret;
+}
+
+/*
+ * Send the batch being coalesced. A batch of one is sent as a plain request.
+ */
+int
+libomnius_flush(libomnius_t *lo)
+{
+    int ret = EXIT_SUCCESS;
+    libomnius_future_t *chain = lo->batch_head, *fut;
+    batch_head_t entry;
+    size_t offset = 0;
+    char *data;
+
+    if (chain) {
+        lo->batch_head = lo->batch_tail = NULL;
+        if (!chain->next && batch_next(&lo->batch.blob, &offset, &entry, &data) == EXIT_SUCCESS) {
+            /* a lone request is sent as it is, with its data (the options of an ALLOC, say), unless that is only room
+             * for the reply (READ)
+             */
+            lo->tx.mtype = (long) entry.mtype;
+            lo->tx.blob.head = entry.head;
+            ret = libomnius_send(lo, &lo->tx, entry.mtype != MTYPE_READ ? data : NULL, chain);
+        } else {
+            ret = libomnius_send(lo, &lo->batch, NULL, chain);
+        }
+
+        if (ret != EXIT_SUCCESS) {
+            for (fut = chain; fut; fut = fut->next)
+                libomnius_complete(fut, fut->mtype | MTYPE_MOD_NAK, &fut->head, NULL);
+        }
+    }
+    return ret;
+}
+
+
+/*
+ * INTERNAL ROUTINES
+ */
+
+/*
+ * Queue a request: append it to the batch being coalesced if it is small enough, otherwise send it now. DATA is sent
+ * with the request, the reply data goes to BUF.
+ */
+int
+libomnius_queue(libomnius_t *lo, libomnius_future_t *fut, long mtype, blob_header_t *head, char *data, char *buf,
+                size_t len)
+{
+    int ret = EXIT_FAILURE;
+
+    memset(fut, 0, sizeof(libomnius_future_t));
+    fut->ret = EXIT_FAILURE;
+    fut->fd = -1;
+    fut->mtype = mtype;
+    fut->buf = buf;
+    fut->len = len;
+    head->pid = lo->pid;
+
+    if (head->data_len > MAX_BLOB_DATA_SIZE) {
+        errno = EMSGSIZE;
+    } else if (lo->coalesce_usec && sizeof(batch_head_t) + head->data_len <= LIBOMNIUS_COALESCE_MAX) {
+        /* COALESCE */
+        if (lo->batch_head &&
+            (libomnius_expired(lo) ||
+             lo->batch.blob.head.data_len + sizeof(batch_head_t) + head->data_len > MAX_BLOB_DATA_SIZE))
+            libomnius_flush(lo);
+
+        if (!lo->batch_head) {
+            memset(&lo->batch.blob.head, 0, sizeof(blob_header_t));
+            lo->batch.mtype = MTYPE_BATCH;
+            lo->batch.blob.head.pid = lo->pid;
+            clock_gettime(CLOCK_MONOTONIC, &lo->batch_start);
+        }
+        if ((ret = batch_append(&lo->batch.blob, mtype, 0, head, data)) == EXIT_SUCCESS) {
+            fut->state = LIBOMNIUS_QUEUED;
+            if (lo->batch_tail)
+                lo->batch_tail->next = fut;
+            else
+                lo->batch_head = fut;
+            lo->batch_tail = fut;
+        }
+    } else if (libomnius_flush(lo) == EXIT_SUCCESS) {
+        lo->tx.mtype = mtype;
+        lo->tx.blob.head = *head;
+        ret = libomnius_send(lo, &lo->tx, data, fut);
+    }
+    return ret;
+}
+
+/*
+ * Has the window of the batch being coalesced run out?
+ */
+int
+libomnius_expired(libomnius_t *lo)
+{
+    int ret = FALSE;
+    struct timespec now;
+
+    if (lo->batch_head) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ret = (now.tv_sec - lo->batch_start.tv_sec) * 1000000L +
+              (now.tv_nsec - lo->batch_start.tv_nsec) / 1000L >= lo->coalesce_usec;
+    }
+    return ret;
+}
+
+/*
+ * Send a message and track the futures in CHAIN until it is answered. The token and a request id are filled in. DATA,
+ * if not NULL, is the blob data to send (data_len bytes), and is gathered from where it is rather than copied into
+ * the message where the connection allows. A HELLO is sent as v2.
+ */
+int
+libomnius_send(libomnius_t *lo, msgbuf_t *msg_buf, char *data, libomnius_future_t *chain)
+{
+    int ret = EXIT_FAILURE, slot;
+    SECMEM_INTERNAL_T req_id;
+    msgbuf_t *wire = msg_buf;
+    libomnius_future_t *fut;
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t len;
+
+    /* wait for a free slot, see LIBOMNIUS_SLOT_BITS */
+    while (lo->inflight_count == LIBOMNIUS_MAX_INFLIGHT)
+        libomnius_recv(lo, TRUE);
+    for (slot = lo->seq & LIBOMNIUS_SLOT_MASK; lo->inflight[slot]; slot = (slot + 1) & LIBOMNIUS_SLOT_MASK) {;}
+    req_id = (++lo->seq << LIBOMNIUS_SLOT_BITS) | slot;
+
+    msg_buf->blob.head.token = lo->token;
+    msg_buf->blob.head.req_id = req_id;
+    if (msg_buf->mtype == MTYPE_HELLO) {
+        wire = &lo->tx;
+        if (msg_v2_encode(msg_buf, BLOB_V2_STATUS_REQUEST, wire) != EXIT_SUCCESS)
+            wire = NULL;
+    } else if (data && lo->kind == LIBOMNIUS_MSGQ) {
+        memcpy(msg_buf->blob.body.data, data, msg_buf->blob.head.data_len);
+        data = NULL;
+    }
+
+    if (!wire || !(len = blob_wire_size(&wire->blob))) {
+        errno = EMSGSIZE;
+    } else if (lo->kind == LIBOMNIUS_SOCKET) {
+        if (data) {
+            memset(&msg, 0, sizeof(msg));
+            iov[0].iov_base = wire;
+            iov[0].iov_len = LIBOMNIUS_HEAD_LEN;
+            iov[1].iov_base = data;
+            iov[1].iov_len = wire->blob.head.data_len;
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+            if (sendmsg(lo->fd, &msg, MSG_NOSIGNAL) == (ssize_t) (sizeof(long) + len))
+                ret = EXIT_SUCCESS;
+        } else {
+            ret = unixsock_send(lo->fd, wire);
+        }
+    } else if (msgsnd(lo->msgqid_in, wire, len, 0) != -1) {
+        ret = EXIT_SUCCESS;
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        lo->inflight[slot] = chain;
+        lo->inflight_id[slot] = req_id;
+        lo->inflight_batch[slot] = msg_buf == &lo->batch;
+        lo->inflight_count++;
+        for (fut = chain; fut; fut = fut->next)
+            fut->state = LIBOMNIUS_SENT;
+    }
+    return ret;
+}
+
+/*
+ * Receive one reply and finish the futures it answers. Fails with errno EAGAIN if BLOCK is not set and there is
+ * nothing to receive. A broken connection (or a malformed reply, which may have been anyone's) fails everything.
+ */
+int
+libomnius_recv(libomnius_t *lo, int block)
+{
+    int ret = EXIT_FAILURE, slot, oldest = -1;
+    libomnius_future_t *target = NULL, *chain, *fut, *next;
+    msgbuf_t *reply = &lo->rx;
+    SECMEM_INTERNAL_T req_id;
+    struct iovec iov[3];
+    struct msghdr msg;
+    char control[UNIXSOCK_CONTROL_LEN];
+    int passed_fd = -1;
+    batch_head_t entry;
+    size_t offset = 0, part;
+    ssize_t len;
+    uint8_t status;
+    long mtype;
+    char *data;
+
+    memset(&lo->rx, 0, LIBOMNIUS_HEAD_LEN);
+    if (lo->kind == LIBOMNIUS_SOCKET) {
+        /*
+         * Aim the data at the buffer of the oldest READ, see BUFFERS. If the reply turns out to be for some other
+         * request, the message is put back together in RX.
+         */
+        for (slot = 0; slot < LIBOMNIUS_MAX_INFLIGHT; slot++) {
+            if (lo->inflight[slot] && (oldest < 0 || lo->inflight_id[slot] < lo->inflight_id[oldest]))
+                oldest = slot;
+        }
+        if (oldest >= 0 && !lo->inflight_batch[oldest] && !lo->inflight[oldest]->next &&
+            lo->inflight[oldest]->mtype == MTYPE_READ && lo->inflight[oldest]->buf && lo->inflight[oldest]->len)
+            target = lo->inflight[oldest];
+
+        memset(&msg, 0, sizeof(msg));
+        iov[0].iov_base = &lo->rx;
+        iov[0].iov_len = LIBOMNIUS_HEAD_LEN;
+        msg.msg_iovlen = 1;
+        if (target) {
+            iov[1].iov_base = target->buf;
+            iov[1].iov_len = target->len;
+            msg.msg_iovlen++;
+        }
+        iov[msg.msg_iovlen].iov_base = (char *) &lo->rx + LIBOMNIUS_HEAD_LEN;
+        iov[msg.msg_iovlen].iov_len = sizeof(msgbuf_t) - LIBOMNIUS_HEAD_LEN;
+        msg.msg_iovlen++;
+        msg.msg_iov = iov;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if ((len = recvmsg(lo->fd, &msg, MSG_CMSG_CLOEXEC | (block ? 0 : MSG_DONTWAIT))) > 0)
+            passed_fd = unixsock_passed_fd(&msg);
+        if (len == 0) {
+            errno = ECONNRESET;
+            len = -1;
+        } else if (len > 0 && ((msg.msg_flags & MSG_TRUNC) || (size_t) len > sizeof(msgbuf_t))) {
+            errno = EBADMSG;
+            len = -1;
+        } else if (target && (size_t) len > LIBOMNIUS_HEAD_LEN &&
+                   (IS_BLOB_V2(&lo->rx.blob) || lo->rx.blob.head.req_id != lo->inflight_id[oldest])) {
+            part = (size_t) len - LIBOMNIUS_HEAD_LEN < target->len ? (size_t) len - LIBOMNIUS_HEAD_LEN : target->len;
+            memmove((char *) &lo->rx + LIBOMNIUS_HEAD_LEN + part, (char *) &lo->rx + LIBOMNIUS_HEAD_LEN,
+                    (size_t) len - LIBOMNIUS_HEAD_LEN - part);
+            memcpy((char *) &lo->rx + LIBOMNIUS_HEAD_LEN, target->buf, part);
+            target = NULL;
+        }
+    } else if ((len = msgrcv(lo->msgqid_out, &lo->rx, sizeof(msgbuf_t) - sizeof(long), lo->token,
+                             block ? 0 : IPC_NOWAIT)) != -1) {
+        len += sizeof(long);
+    } else if (errno == ENOMSG) {
+        errno = EAGAIN;
+    }
+
+    if (len > 0) {
+        if (!blob_wire_size(&lo->rx.blob) || blob_wire_size(&lo->rx.blob) != (size_t) len - sizeof(long)) {
+            errno = EBADMSG;
+        } else if (IS_BLOB_V2(&lo->rx.blob)) {
+            if (msg_v2_decode(&lo->rx, &lo->v2, &status) == EXIT_SUCCESS) {
+                reply = &lo->v2;
+                ret = EXIT_SUCCESS;
+            } else {
+                errno = EBADMSG;
+            }
+        } else {
+            ret = EXIT_SUCCESS;
+        }
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        /* a reply that matches nothing in flight is stale, and dropped */
+        mtype = MSG_MTYPE(reply);
+        req_id = reply->blob.head.req_id;
+        slot = req_id & LIBOMNIUS_SLOT_MASK;
+        if ((chain = lo->inflight[slot]) && lo->inflight_id[slot] == req_id) {
+            lo->inflight[slot] = NULL;
+            lo->inflight_count--;
+
+            if (lo->inflight_batch[slot] && STRIP_MTYPE_MOD(mtype) == MTYPE_BATCH && IS_ACK(mtype)) {
+                for (fut = chain; fut; fut = next) {
+                    next = fut->next;
+                    if (batch_next(&reply->blob, &offset, &entry, &data) == EXIT_SUCCESS)
+                        libomnius_complete(fut, (long) entry.mtype, &entry.head, data);
+                    else
+                        libomnius_complete(fut, fut->mtype | MTYPE_MOD_NAK, &reply->blob.head, NULL);
+                }
+            } else {
+                for (fut = chain; fut; fut = next) {
+                    next = fut->next;
+                    if (lo->inflight_batch[slot])
+                        libomnius_complete(fut, fut->mtype | MTYPE_MOD_NAK, &reply->blob.head, NULL);
+                    else
+                        libomnius_complete(fut, mtype, &reply->blob.head, fut == target ? NULL : reply->blob.body.data);
+                }
+                /* a file descriptor only comes with an ACK'd LEASE */
+                if (passed_fd >= 0 && STRIP_MTYPE_MOD(chain->mtype) == MTYPE_LEASE && chain->ret == EXIT_SUCCESS) {
+                    chain->fd = passed_fd;
+                    passed_fd = -1;
+                }
+            }
+        }
+    } else if (errno != EAGAIN && errno != EINTR) {
+        libomnius_fail_all(lo);
+    }
+    if (passed_fd >= 0)
+        close(passed_fd);
+    return ret;
+}
+
+/*
+ * Finish a future with a reply. DATA is NULL if the reply data is already in the future's buffer (or there is none).
+ */
+void
+libomnius_complete(libomnius_future_t *fut, long mtype, blob_header_t *head, char *data)
+{
+    fut->mtype = mtype;
+    fut->head = *head;
+    fut->ret = IS_ACK(mtype) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (fut->ret != EXIT_SUCCESS)
+        fut->head.data_len = 0;
+    if (data && fut->buf)
+        memcpy(fut->buf, data, head->data_len < fut->len ? head->data_len : fut->len);
+    fut->state = LIBOMNIUS_DONE;
+}
+
+/*
+ * NAK everything in flight or being coalesced, once the connection is broken.
+ */
+void
+libomnius_fail_all(libomnius_t *lo)
+{
+    int slot, err = errno;
+    libomnius_future_t *fut, *next;
+
+    for (slot = 0; slot < LIBOMNIUS_MAX_INFLIGHT; slot++) {
+        for (fut = lo->inflight[slot]; fut; fut = next) {
+            next = fut->next;
+            libomnius_complete(fut, fut->mtype | MTYPE_MOD_NAK, &fut->head, NULL);
+        }
+        lo->inflight[slot] = NULL;
+    }
+    lo->inflight_count = 0;
+
+    for (fut = lo->batch_head; fut; fut = next) {
+        next = fut->next;
+        libomnius_complete(fut, fut->mtype | MTYPE_MOD_NAK, &fut->head, NULL);
+    }
+    lo->batch_head = lo->batch_tail = NULL;
+    errno = err;
+}
@@ -0,0 +1,288 @@
+/* libomnius/libomnius.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Client library for talking to omnius.
+ *
+ * A client opens a connection (libomnius_t) over omnius' message queues or its unix socket, and then uses one of two
+ * layers on top of it:
+ *
+ *  BLOCKING - libomnius_load, libomnius_alloc, libomnius_read, ... send one request and wait for its reply.
+ *             libomnius_call does the same for any msgbuf_t built by hand.
+ *
+ *  ASYNC    - libomnius_async_* queue a request and return straight away. Each request is tracked by a caller owned
+ *             completion handle (libomnius_future_t) that is finished once its reply arrives; libomnius_wait blocks on
+ *             one and libomnius_poll makes progress without blocking. Up to LIBOMNIUS_MAX_INFLIGHT messages are kept
+ *             in flight, replies are matched to their handles by request id (see blob_header_t).
+ *
+ * COALESCING
+ *
+ * When a coalescing window is set (libomnius_set_coalesce), small async requests are not sent on their own but appended
+ * to a BATCH that is sent once the window since its first entry has run out, once it is full, or as soon as a caller
+ * waits on one of its entries. The library has no timer of its own: an expired window is noticed by the next libomnius
+ * call, so a client that queues and then goes off to do something else should libomnius_flush. A batch that ends up
+ * with a single entry is sent as a plain request. Requests are always sent in the order they are made, coalesced or not.
+ *
+ * BUFFERS
+ *
+ * Read data is delivered into the buffer the caller hands in with the request, which belongs to the library until the
+ * handle is finished (its content is undefined until then). On the socket a reply is received straight into the buffer
+ * of the oldest outstanding READ, which is the one omnius answers next unless it is busy with other requests, so the
+ * data is not copied again once it leaves the kernel. Data sent (WRITE) is taken when the request is made, the caller
+ * may reuse its buffer as soon as the call returns.
+ *
+ * Requests are sent in the v1 wire format (the HELLO made when connecting checks that omnius' field width is ours),
+ * and are limited to MAX_BLOB_DATA_SIZE bytes of data; larger objects have to be moved with the STREAM messages.
+ *
+ * A libomnius_t must only be used by one thread at a time. Replies are routed by a token derived from the thread that
+ * opened the connection, so on the message queues every thread should open its own.
+ *
+ * LEASES
+ *
+ * An object whose policy has reached a read-only state can be leased (see omnius/lease.h): it is mapped read-only into
+ * the client, which then reads it in place without any messages. omnius may revoke the lease at any time (the object
+ * is deallocated, or a W is denied), after which touching the mapping raises SIGBUS; libomnius_lease_valid tells
+ * whether the lease still stands. The mapping is the client's until libomnius_lease_release, even if revoked. omnius
+ * passes the lease as a file descriptor, so leases can only be taken on a socket connection.
+ *
+ * Unless said otherwise, the routines return EXIT_SUCCESS or EXIT_FAILURE. A NAK'd request fails with errno unchanged,
+ * a failed connection fails with errno set by the system call that failed.
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef LIBOMNIUS_H
+#define LIBOMNIUS_H
+
+#include <time.h>
+#include "../omnius/global.h"
+#include "../omnius/comm.h"
+
+/* Connection kinds */
+#define LIBOMNIUS_MSGQ   0
+#define LIBOMNIUS_SOCKET 1
+
+/* Messages in flight at once, a power of two. The low bits of a request id are the slot it is tracked in. */
+#define LIBOMNIUS_SLOT_BITS 6
+#define LIBOMNIUS_MAX_INFLIGHT (1 << LIBOMNIUS_SLOT_BITS)
+#define LIBOMNIUS_SLOT_MASK (LIBOMNIUS_MAX_INFLIGHT - 1)
+
+/* The largest request (batch entry head plus data) that is coalesced */
+#define LIBOMNIUS_COALESCE_MAX 512
+
+/* Future states */
+#define LIBOMNIUS_IDLE   0
+#define LIBOMNIUS_QUEUED 1  /* waiting in the batch being coalesced */
+#define LIBOMNIUS_SENT   2
+#define LIBOMNIUS_DONE   3
+
+#define LIBOMNIUS_IS_DONE(_pfut) ((_pfut)->state == LIBOMNIUS_DONE)
+
+/*
+ * A completion handle. Until it is done MTYPE is the request's, afterwards it is the ACK/NAK'd reply mtype, HEAD the
+ * reply header (e.g. the addr of an ALLOC) and RET EXIT_SUCCESS if the request was ACK'd.
+ */
+typedef struct libomnius_future_t
+{
+    struct libomnius_future_t *next;    /* the next future answered by the same message */
+    int state;
+    int ret;
+    long mtype;
+    blob_header_t head;
+    char *buf;                          /* reply data goes here, up to LEN bytes */
+    size_t len;
+    int fd;                             /* a file descriptor passed with the reply (LEASE), -1 for none */
+} libomnius_future_t;
+
+typedef struct libomnius_t
+{
+    int kind;
+    int fd;                             /* socket */
+    int msgqid_in;                      /* message queues, relative to omnius */
+    int msgqid_out;
+    pid_t pid;
+    long token;
+    hello_t hello;                      /* omnius' HELLO reply */
+
+    /* Messages in flight, by request id slot. SEQ orders them, the oldest has the lowest. */
+    SECMEM_INTERNAL_T seq;
+    size_t inflight_count;
+    libomnius_future_t *inflight[LIBOMNIUS_MAX_INFLIGHT];
+    SECMEM_INTERNAL_T inflight_id[LIBOMNIUS_MAX_INFLIGHT];
+    int inflight_batch[LIBOMNIUS_MAX_INFLIGHT];
+
+    /* Coalescing */
+    long coalesce_usec;
+    struct timespec batch_start;
+    libomnius_future_t *batch_head;
+    libomnius_future_t *batch_tail;
+    msgbuf_t batch;
+
+    msgbuf_t tx;
+    msgbuf_t rx;
+    msgbuf_t v2;                        /* v2 replies are decoded here */
+} libomnius_t;
+
+/* A read lease. DATA maps SIZE bytes of the object at ADDR. */
+typedef struct libomnius_lease_t
+{
+    const char *data;
+    size_t size;
+    SECMEM_INTERNAL_T addr;
+    int fd;
+} libomnius_lease_t;
+
+
+/*
+ * CONNECTION ROUTINES
+ *
+ * libomnius_open_msgq connects over omnius' message queues (keys as passed to omnius), libomnius_open_socket over its
+ * unix socket (NULL for UNIXSOCK_DEFAULT_PATH). Both say HELLO and fail if omnius' field width is not ours.
+ * libomnius_close waits for everything still in flight before closing.
+ */
+int
+libomnius_open_msgq(key_t, key_t, libomnius_t *);
+
+int
+libomnius_open_socket(char *, libomnius_t *);
+
+int
+libomnius_close(libomnius_t *);
+
+int
+libomnius_set_coalesce(libomnius_t *, long);
+
+
+/*
+ * BLOCKING ROUTINES
+ *
+ * libomnius_load takes the policies as regex strings, libomnius_load_opts also sends load options (see LOAD OPTIONS in
+ * omnius/comm.h), e.g. the placement strategy, as libomnius_alloc_opts does alloc options (e.g. the alignment).
+ * libomnius_resize grows or shrinks the region to SIZE bytes, and leaves the size it ends up with (even if NAK'd) in
+ * *SIZE_P unless that is NULL. libomnius_realloc grows or shrinks the object at ADDR to SIZE bytes, keeping its data and
+ * FSM state, and leaves its address in *ADDR_P (see REALLOC in omnius/comm.h), as libomnius_clone does for a
+ * copy-on-write clone of the object at ADDR (see CLONE). libomnius_read and libomnius_write move LEN bytes at ADDR.
+ * libomnius_call sends a request built by hand (the token and request id are filled in, the pid is left as it is) and
+ * leaves the reply in its place.
+ */
+int
+libomnius_load(libomnius_t *, SECMEM_INTERNAL_T, char **, size_t);
+
+int
+libomnius_load_opts(libomnius_t *, SECMEM_INTERNAL_T, char **, size_t, load_opts_t *);
+
+int
+libomnius_unload(libomnius_t *);
+
+int
+libomnius_resize(libomnius_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T *);
+
+int
+libomnius_alloc(libomnius_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T *);
+
+int
+libomnius_alloc_opts(libomnius_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, alloc_opts_t *, SECMEM_INTERNAL_T *);
+
+int
+libomnius_dealloc(libomnius_t *, SECMEM_INTERNAL_T);
+
+int
+libomnius_realloc(libomnius_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T *);
+
+int
+libomnius_clone(libomnius_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T *);
+
+int
+libomnius_read(libomnius_t *, SECMEM_INTERNAL_T, char *, size_t);
+
+int
+libomnius_write(libomnius_t *, SECMEM_INTERNAL_T, char *, size_t);
+
+int
+libomnius_call(libomnius_t *, msgbuf_t *);
+
+
+/*
+ * LEASE ROUTINES
+ *
+ * libomnius_lease leases the object containing ADDR, which is sent straight away (leases are never coalesced).
+ * libomnius_lease_valid returns TRUE while the lease stands.
+ */
+int
+libomnius_lease(libomnius_t *, SECMEM_INTERNAL_T, libomnius_lease_t *);
+
+int
+libomnius_lease_valid(libomnius_lease_t *);
+
+int
+libomnius_lease_release(libomnius_lease_t *);
+
+
+/*
+ * ASYNC ROUTINES
+ *
+ * The libomnius_async_* routines queue a request against a caller owned future, which must stay put until it is done.
+ * They only fail if the request is invalid or the connection is broken; the outcome of the request itself is in the
+ * future. libomnius_wait blocks until a future is done and returns its RET. libomnius_wait_all waits for everything
+ * queued so far. libomnius_poll handles whatever replies have arrived, and sends the batch if its window ran out.
+ * libomnius_flush sends the batch now.
+ */
+int
+libomnius_async_alloc(libomnius_t *, libomnius_future_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T);
+
+int
+libomnius_async_alloc_opts(libomnius_t *, libomnius_future_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, alloc_opts_t *);
+
+int
+libomnius_async_dealloc(libomnius_t *, libomnius_future_t *, SECMEM_INTERNAL_T);
+
+int
+libomnius_async_read(libomnius_t *, libomnius_future_t *, SECMEM_INTERNAL_T, char *, size_t);
+
+int
+libomnius_async_write(libomnius_t *, libomnius_future_t *, SECMEM_INTERNAL_T, char *, size_t);
+
+int
+libomnius_async_call(libomnius_t *, libomnius_future_t *, msgbuf_t *, char *, size_t);
+
+int
+libomnius_wait(libomnius_t *, libomnius_future_t *);
+
+int
+libomnius_wait_all(libomnius_t *);
+
+int
+libomnius_poll(libomnius_t *);
+
+int
+libomnius_flush(libomnius_t *);
+
+
+/*
+ * INTERNAL ROUTINES
+ */
+void
+libomnius_init(int, libomnius_t *);
+
+int
+libomnius_hello(libomnius_t *);
+
+int
+libomnius_queue(libomnius_t *, libomnius_future_t *, long, blob_header_t *, char *, char *, size_t);
+
+int
+libomnius_send(libomnius_t *, msgbuf_t *, char *, libomnius_future_t *);
+
+int
+libomnius_recv(libomnius_t *, int);
+
+int
+libomnius_expired(libomnius_t *);
+
+void
+libomnius_complete(libomnius_future_t *, long, blob_header_t *, char *);
+
+void
+libomnius_fail_all(libomnius_t *);
+
+#endif /* LIBOMNIUS_H */
@@ -12,6 +12,7 @@
 #include <sys/msg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "../omnius/global.h"
 #include "omnius-cli.h"
 #include "../omnius/memory.h"
@@ -319,6 +320,7 @@ int
 cli(int msgqid_in, int msgqid_out)
 {
     char log_buf[MAX_HUMANIZE_LEN];
+    SECMEM_INTERNAL_T req_id = 0;
 
     int terminate = 0;
     while(!terminate)
@@ -380,9 +382,12 @@ cli(int msgqid_in, int msgqid_out)
         }
         if (ret == EXIT_SUCCESS)
         {
+            /* route the reply back to us alone, see MTYPE_TOKEN_MIN */
+            in_buf.blob.head.token = MTYPE_TOKEN(getpid());
+            in_buf.blob.head.req_id = ++req_id;
 
             if ((SIZEOF_BLOB(&out_buf.blob) <= MAX_MTEXT_SIZE) && (msgsnd(msgqid_in, &in_buf, SIZEOF_BLOB(&in_buf.blob), 0) != -1)) {
-                if ((msgrcv(msgqid_out, &out_buf, MAX_MTEXT_SIZE, 0, 0) != 1) && (SIZEOF_BLOB(&out_buf.blob) <= MAX_MTEXT_SIZE)) {
+                if ((msgrcv(msgqid_out, &out_buf, MAX_MTEXT_SIZE, MTYPE_TOKEN(getpid()), 0) != 1) && (SIZEOF_BLOB(&out_buf.blob) <= MAX_MTEXT_SIZE)) {
                     humanize_blob(&out_buf, log_buf, sizeof(log_buf));
                     fprintf(g_logfile, "%s", log_buf);
                 }
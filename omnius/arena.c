@@ -0,0 +1,98 @@
+/* omnius/arena.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * See arena.h.
+ *
+ * All of these routines return EXIT_SUCCESS or EXIT_FAILURE.
+ *
+ * 2015 - Mike Clark
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+/* Map an arena of SIZE bytes, its pages are only committed once they are touched */
+int
+arena_init(arena_t *arena, SECMEM_INTERNAL_T size)
+{
+    int ret = EXIT_FAILURE;
+    char *map;
+
+    memset(arena, 0, sizeof(arena_t));
+    if (size && (map = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) != MAP_FAILED) {
+        if (memory_load(size, &arena->head, &arena->index) == EXIT_SUCCESS &&
+            pthread_mutex_init(&arena->lock, NULL) == 0) {
+            arena->base = map;
+            arena->size = size;
+            ret = EXIT_SUCCESS;
+        } else {
+            if (arena->head)
+                memory_unload(arena->head, &arena->index);
+            munmap(map, size);
+        }
+    }
+    return ret;
+}
+
+/* Unmap an arena, every process using it must have been unloaded */
+int
+arena_fini(arena_t *arena)
+{
+    int ret = EXIT_FAILURE;
+
+    if (arena->base) {
+        ret = memory_unload(arena->head, &arena->index);
+        ret |= munmap(arena->base, arena->size) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        pthread_mutex_destroy(&arena->lock);
+        arena->base = NULL;
+    }
+    return ret;
+}
+
+/* Take a chunk of SIZE bytes from ARENA, aligned to ALIGN (see memory_alloc), placed in CHUNK_P. Its bytes are zero. */
+int
+arena_alloc(arena_t *arena, SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T align, secmem_obj_t **chunk_p)
+{
+    int ret = EXIT_FAILURE;
+
+    pthread_mutex_lock(&arena->lock);
+    if ((ret = memory_alloc(size, align, NULL, chunk_p, &arena->head, &arena->index)) == EXIT_SUCCESS) {
+        arena->used += size;
+        arena->chunks++;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return ret;
+}
+
+/* Grow or shrink CHUNK of ARENA to SIZE bytes where it is, see memory_realloc. The bytes it gives up must be zero. */
+int
+arena_realloc(arena_t *arena, secmem_obj_t *chunk, SECMEM_INTERNAL_T size)
+{
+    int ret = EXIT_FAILURE;
+    SECMEM_INTERNAL_T old_size = chunk->size;
+
+    pthread_mutex_lock(&arena->lock);
+    if ((ret = memory_realloc(chunk, size, &arena->index)) == EXIT_SUCCESS)
+        arena->used = arena->used - old_size + size;
+    pthread_mutex_unlock(&arena->lock);
+    return ret;
+}
+
+/* Give CHUNK back to ARENA, the caller is expected to have zeroed it */
+int
+arena_free(arena_t *arena, secmem_obj_t *chunk)
+{
+    int ret = EXIT_FAILURE;
+
+    pthread_mutex_lock(&arena->lock);
+    arena->used -= chunk->size;
+    arena->chunks--;
+    ret = memory_dealloc(chunk, &arena->index);
+    pthread_mutex_unlock(&arena->lock);
+    return ret;
+}
@@ -0,0 +1,54 @@
+/* omnius/arena.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * The global arena.
+ *
+ * omnius can be started with one arena (see -a), a single anonymous mapping that the objects of every process that
+ * loads into it (see LOAD OPTIONS in comm.h) are carved from. Such a process has no region of its own: its mem_size is
+ * a quota on the space it may take, and its objects are still placed in a secmem vm region of that size by its
+ * strategy, which is now only bookkeeping. Each object (or slab) gets a chunk of the arena of its size, which backs its
+ * bytes wherever it is placed in the region (see process_data); so a process only ever takes up what it has allocated,
+ * and the space it is not using serves the others.
+ *
+ * The chunks are placed the same way objects are in a region (see memory_alloc), the arena keeps the same node list
+ * and index. Every worker allocates from it, so it is guarded by a mutex. Free space in the arena is zero: its pages come
+ * zeroed, and a chunk is zeroed by its process before it is freed.
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef SECMEM_ARENA_H
+#define SECMEM_ARENA_H
+
+#include <pthread.h>
+#include "global.h"
+#include "memory.h"
+
+typedef struct arena_t
+{
+    char *base;
+    SECMEM_INTERNAL_T size;
+    SECMEM_INTERNAL_T used;     /* bytes in chunks */
+    SECMEM_INTERNAL_T chunks;
+    secmem_obj_t *head;
+    memory_index_t index;
+    pthread_mutex_t lock;
+} arena_t;
+
+int
+arena_init(arena_t *, SECMEM_INTERNAL_T);
+
+int
+arena_fini(arena_t *);
+
+int
+arena_alloc(arena_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, secmem_obj_t **);
+
+int
+arena_realloc(arena_t *, secmem_obj_t *, SECMEM_INTERNAL_T);
+
+int
+arena_free(arena_t *, secmem_obj_t *);
+
+#endif /* SECMEM_ARENA_H */
@@ -0,0 +1,241 @@
+/* omnius/buddy.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * See buddy.h. The routines mirror memory_load, memory_alloc and memory_dealloc, and keep the node list and the memory
+ * index the same way.
+ *
+ * All of these routines return EXIT_SUCCESS or EXIT_FAILURE.
+ *
+ * 2015 - Mike Clark
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "buddy.h"
+
+/* Load a region of SIZE as the blocks of its binary decomposition, largest first */
+int
+buddy_load(SECMEM_INTERNAL_T size, secmem_obj_t **head, memory_index_t *index)
+{
+    int ret = EXIT_SUCCESS;
+    secmem_obj_t *node, *tail = NULL;
+    SECMEM_INTERNAL_T block, offset = 0;
+
+    memset(index, 0, sizeof(memory_index_t));
+    *head = NULL;
+    while (ret == EXIT_SUCCESS && offset < size) {
+        block = (SECMEM_INTERNAL_T) 1 << (63 - __builtin_clzll((unsigned long long) (size - offset)));
+        if ((node = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t))) != NULL) {
+            node->offset = offset;
+            node->size = block;
+            node->prev = tail;
+            if (tail)
+                tail->next = node;
+            else
+                *head = node;
+            tail = node;
+            memory_index_insert(node, index);
+            memory_free_insert(node, index);
+            offset += block;
+        } else {
+            ret = EXIT_FAILURE;
+        }
+    }
+    if (ret != EXIT_SUCCESS && *head) {
+        memory_unload(*head, index);
+        *head = NULL;
+    }
+    return ret;
+}
+
+/*
+ * Grow or shrink a region from OLD_SIZE to NEW_SIZE bytes at its end, see memory_resize. The blocks added are all
+ * allocated before any is linked in, so growing either happens in full or not at all. Shrinking needs every block
+ * past NEW_SIZE to be free; the block NEW_SIZE falls inside is split until it falls between two.
+ */
+int
+buddy_resize(SECMEM_INTERNAL_T old_size, SECMEM_INTERNAL_T new_size, secmem_obj_t **head_p, memory_index_t *index)
+{
+    int ret = EXIT_SUCCESS;
+    int i, count = 0;
+    secmem_obj_t *tail = NULL, *node, *added[2 * SECMEM_INTERNAL_BIT];
+    SECMEM_INTERNAL_T offset, block;
+
+    if (memory_index_floor(old_size - 1, &tail, index) != EXIT_SUCCESS)
+        ret = EXIT_FAILURE;
+
+    if (ret == EXIT_SUCCESS && new_size > old_size) {
+        /* each block is as large as the alignment of its offset, and what is left, allow */
+        for (offset = old_size; ret == EXIT_SUCCESS && offset < new_size; offset += block) {
+            for (block = offset & -offset; block > new_size - offset; block >>= 1)
+                ;
+            if (count < 2 * SECMEM_INTERNAL_BIT && (node = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t)))) {
+                node->offset = offset;
+                node->size = block;
+                added[count++] = node;
+            } else {
+                ret = EXIT_FAILURE;
+            }
+        }
+        /* link them in as used, then free each in turn so it merges with whatever it can */
+        for (i = 0; i < count; i++) {
+            if (ret == EXIT_SUCCESS) {
+                added[i]->used = TRUE;
+                added[i]->prev = tail;
+                tail->next = added[i];
+                memory_index_insert(added[i], index);
+                tail = added[i];
+            } else {
+                free(added[i]);
+            }
+        }
+        for (i = 0; ret == EXIT_SUCCESS && i < count; i++)
+            buddy_dealloc(added[i], index);
+    } else if (ret == EXIT_SUCCESS && new_size < old_size) {
+        for (node = tail; node && node->offset + node->size > new_size; node = node->prev)
+            if (node->used || !new_size)
+                ret = EXIT_FAILURE;
+        while (ret == EXIT_SUCCESS && tail->offset + tail->size > new_size) {
+            memory_free_remove(tail, index);
+            if (tail->offset >= new_size) {
+                memory_index_remove(tail, index);
+                node = tail->prev;
+                node->next = NULL;
+                free(tail);
+                tail = node;
+            } else if ((ret = buddy_split(tail, index)) == EXIT_SUCCESS) {
+                memory_free_insert(tail, index);
+                tail = tail->next;
+            } else {
+                memory_free_insert(tail, index);
+            }
+        }
+    }
+    return ret;
+}
+
+/* Halve a free block (taken off the free lists), the upper half becomes a free block of its own */
+int
+buddy_split(secmem_obj_t *node, memory_index_t *index)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *upper = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t));
+
+    if (upper) {
+        node->size >>= 1;
+        upper->offset = node->offset + node->size;
+        upper->size = node->size;
+        upper->prev = node;
+        upper->next = node->next;
+        if (node->next)
+            node->next->prev = upper;
+        node->next = upper;
+        memory_index_insert(upper, index);
+        memory_free_insert(upper, index);
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Allocate a block for SIZE bytes, see memory_alloc for the parameters. The block is always the lower half of any
+ * block split, so the head of the list never changes. A block is aligned to its size, so one at least ALIGN large is
+ * aligned to ALIGN.
+ */
+int
+buddy_alloc(SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T align, fsm_descriptor_t *fsm_desc, secmem_obj_t **node_p,
+            secmem_obj_t **head_p, memory_index_t *index)
+{
+    int ret = EXIT_FAILURE;
+    SECMEM_INTERNAL_T block = (SECMEM_INTERNAL_T) 1 << MEMORY_BUDDY_MIN_SHIFT;
+    secmem_obj_t *node = NULL;
+
+    while ((block < size || block < align) && block << 1)
+        block <<= 1;
+    if (size <= block && (node = memory_free_find(block, index))) {
+        memory_free_remove(node, index);
+        ret = EXIT_SUCCESS;
+        while (ret == EXIT_SUCCESS && node->size > block)
+            ret = buddy_split(node, index);
+        if (ret == EXIT_SUCCESS) {
+            node->used = TRUE;
+            node->align = align ? align : 1;
+        } else {
+            memory_free_insert(node, index);
+            node = NULL;
+        }
+    }
+
+    *node_p = node;
+    return ret;
+}
+
+/*
+ * Grow or shrink the used block NODE to hold SIZE bytes where it is, see memory_realloc. It grows by merging with its
+ * buddies, as long as it is the lower half each time and the upper one is free and whole; all of them are checked
+ * before any is merged. It shrinks by halving for as long as the lower half still holds SIZE and its alignment.
+ */
+int
+buddy_realloc(secmem_obj_t *node, SECMEM_INTERNAL_T size, memory_index_t *index)
+{
+    int ret = EXIT_FAILURE;
+    SECMEM_INTERNAL_T block = node->size;
+    secmem_obj_t *buddy = node->next;
+
+    while (block < size && !(node->offset & block) && buddy && !buddy->used && buddy->size == block &&
+           buddy->offset == node->offset + block) {
+        block <<= 1;
+        buddy = buddy->next;
+    }
+    if (block >= size) {
+        while (node->size < block) {
+            buddy = node->next;
+            memory_free_remove(buddy, index);
+            node->size <<= 1;
+            node->next = buddy->next;
+            if (buddy->next)
+                buddy->next->prev = node;
+            memory_index_remove(buddy, index);
+            free(buddy);
+        }
+        /* a failed split leaves the block larger than it has to be, which is all */
+        while (node->size >> 1 >= size && node->size >> 1 >= node->align &&
+               node->size >> 1 >= (SECMEM_INTERNAL_T) 1 << MEMORY_BUDDY_MIN_SHIFT &&
+               buddy_split(node, index) == EXIT_SUCCESS)
+            ;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/* Free a block, merging it with its buddy for as long as that is free and whole */
+int
+buddy_dealloc(secmem_obj_t *node, memory_index_t *index)
+{
+    secmem_obj_t *buddy, *upper;
+
+    node->used = FALSE;
+    for (;;) {
+        /* the buddy is the next block if this one is the lower half, the previous one otherwise */
+        buddy = (node->offset & node->size) ? node->prev : node->next;
+        if (!buddy || buddy->used || buddy->size != node->size || buddy->offset != (node->offset ^ node->size))
+            break;
+        memory_free_remove(buddy, index);
+        if (buddy->offset < node->offset) {
+            upper = node;
+            node = buddy;
+        } else {
+            upper = buddy;
+        }
+        node->size <<= 1;
+        node->next = upper->next;
+        if (upper->next)
+            upper->next->prev = node;
+        memory_index_remove(upper, index);
+        free(upper);
+    }
+    memory_free_insert(node, index);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+/* omnius/buddy.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Binary buddy placement strategy (see memory_strategy_t).
+ *
+ * The region is kept in blocks whose size is a power of two and whose offset is a multiple of it. An allocation is
+ * rounded up to a power of two (MEMORY_BUDDY_MIN_SHIFT at least), and the smallest free block that holds it is halved
+ * until it fits; a freed block is merged with its buddy (the other half of the block it was split from) for as long as
+ * that is free too. Both take O(log n) steps, and the waste is bounded by the rounding. A used block is reallocated in
+ * place the same way, by merging with its free buddies or by halving, if it can be.
+ *
+ * The free blocks of each size are kept on the free lists of the memory index, every power of two from
+ * MEMORY_SL_COUNT up has a list of its own there. A region whose size is not a power of two starts as the blocks of
+ * its binary decomposition; the smallest of those may be too small to ever be allocated. Space added at the end of a
+ * region is split into the largest blocks its offsets are aligned to, which merge with their buddies as usual.
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef SECMEM_BUDDY_H
+#define SECMEM_BUDDY_H
+
+#include "global.h"
+#include "memory.h"
+
+#define MEMORY_BUDDY_MIN_SHIFT 4 /* keep 1 << MEMORY_BUDDY_MIN_SHIFT at least MEMORY_SL_COUNT */
+
+int
+buddy_load(SECMEM_INTERNAL_T, secmem_obj_t **, memory_index_t *);
+
+int
+buddy_alloc(SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, fsm_descriptor_t *, secmem_obj_t **, secmem_obj_t **, memory_index_t *);
+
+int
+buddy_dealloc(secmem_obj_t *, memory_index_t *);
+
+int
+buddy_realloc(secmem_obj_t *, SECMEM_INTERNAL_T, memory_index_t *);
+
+int
+buddy_resize(SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, secmem_obj_t **, memory_index_t *);
+
+int
+buddy_split(secmem_obj_t *, memory_index_t *);
+
+#endif /* SECMEM_BUDDY_H */
@@ -8,6 +8,8 @@
  * 2015 - Mike Clark
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "comm.h"
 
 /*
@@ -17,10 +19,11 @@ size_t
 humanize_blob(msgbuf_t *msg_buf, char *out, size_t out_size)
 {
     size_t len = 0;
-    if (IS_MTYPE_REPLY(msg_buf->mtype)) {
+    long mtype = MSG_MTYPE(msg_buf);
+    if (IS_MTYPE_REPLY(mtype)) {
 
         /* REPLIES - strip off the ack/nak flag */
-        switch (STRIP_MTYPE_MOD(msg_buf->mtype)) {
+        switch (STRIP_MTYPE_MOD(mtype)) {
             case MTYPE_LOAD:
                 len = (size_t) snprintf(out, out_size, "Loaded pid %d\n", msg_buf->blob.head.pid);
                 break;
@@ -30,8 +33,8 @@ humanize_blob(msgbuf_t *msg_buf, char *out, size_t out_size)
             case MTYPE_ALLOC:
                 /* the semantics of this message change if memory allocation failed */
 		len = (size_t) snprintf(out, out_size, "Allocated from pid %d @ secmem %s 0x%lx\n", msg_buf->blob.head.pid,
-                                         IS_ACK(msg_buf->mtype) ? "address" : "size",
-                                         IS_ACK(msg_buf->mtype) ? msg_buf->blob.head.addr : msg_buf->blob.head.size);
+                                         IS_ACK(mtype) ? "address" : "size",
+                                         IS_ACK(mtype) ? msg_buf->blob.head.addr : msg_buf->blob.head.size);
                 break;
             case MTYPE_DEALLOC:
                 len = (size_t) snprintf(out, out_size, "Deallocated from pid %d\n", msg_buf->blob.head.pid);
@@ -45,6 +48,54 @@ humanize_blob(msgbuf_t *msg_buf, char *out, size_t out_size)
             case MTYPE_VIEW:
                 len = (size_t) snprintf(out, out_size, "Viewed message pid %d\n", msg_buf->blob.head.pid);
                 break;
+            case MTYPE_ATTACH:
+                len = (size_t) snprintf(out, out_size, "Attached ring for pid %d, doorbell shmid %zu\n", msg_buf->blob.head.pid,
+                                        (size_t) msg_buf->blob.head.shmid);
+                break;
+            case MTYPE_DETACH:
+                len = (size_t) snprintf(out, out_size, "Detached ring for pid %d\n", msg_buf->blob.head.pid);
+                break;
+            case MTYPE_BATCH:
+                len = (size_t) snprintf(out, out_size, "Batch of %zu operations for pid %d\n", (size_t) msg_buf->blob.head.op_count,
+                                        msg_buf->blob.head.pid);
+                break;
+            case MTYPE_STREAM_OPEN:
+                len = (size_t) snprintf(out, out_size, "Opened stream from pid %d @ secmem address 0x%lx, chunk size 0x%lx\n",
+                                        msg_buf->blob.head.pid, (size_t) msg_buf->blob.head.addr, (size_t) msg_buf->blob.head.chunk_size);
+                break;
+            case MTYPE_STREAM_READ:
+                len = (size_t) snprintf(out, out_size, "Streamed from pid %d\n", msg_buf->blob.head.pid);
+                break;
+            case MTYPE_STREAM_WRITE:
+                len = (size_t) snprintf(out, out_size, "Streamed to pid %d\n", msg_buf->blob.head.pid);
+                break;
+            case MTYPE_HELLO:
+                len = (size_t) snprintf(out, out_size, "Hello from omnius\n");
+                break;
+            case MTYPE_READV:
+                len = (size_t) snprintf(out, out_size, "Vector read of %zu objects from pid %d\n", (size_t) msg_buf->blob.head.op_count,
+                                        msg_buf->blob.head.pid);
+                break;
+            case MTYPE_WRITEV:
+                len = (size_t) snprintf(out, out_size, "Vector write of %zu objects to pid %d\n", (size_t) msg_buf->blob.head.op_count,
+                                        msg_buf->blob.head.pid);
+                break;
+            case MTYPE_LEASE:
+                len = (size_t) snprintf(out, out_size, "Leased 0x%lx bytes from pid %d @ secmem address 0x%lx\n", (size_t) msg_buf->blob.head.lease_size,
+                                        msg_buf->blob.head.pid, (size_t) msg_buf->blob.head.addr);
+                break;
+            case MTYPE_RESIZE:
+                len = (size_t) snprintf(out, out_size, "Resized pid %d to 0x%lx bytes\n", msg_buf->blob.head.pid,
+                                        (size_t) msg_buf->blob.head.size);
+                break;
+            case MTYPE_REALLOC:
+                len = (size_t) snprintf(out, out_size, "Reallocated for pid %d @ secmem address 0x%lx\n", msg_buf->blob.head.pid,
+                                        (size_t) msg_buf->blob.head.addr);
+                break;
+            case MTYPE_CLONE:
+                len = (size_t) snprintf(out, out_size, "Cloned for pid %d @ secmem address 0x%lx\n", msg_buf->blob.head.pid,
+                                        (size_t) msg_buf->blob.head.addr);
+                break;
             case MTYPE_TERMINATE:
                 len = (size_t) snprintf(out, out_size, "Terminated message\n");
                 break;
@@ -52,13 +103,13 @@ humanize_blob(msgbuf_t *msg_buf, char *out, size_t out_size)
                 len = (size_t) snprintf(out, out_size, "NIL message\n");
                 break;
             default:
-                len = (size_t) snprintf(out, out_size, "UNKNOWN message type (%d) ", (int) msg_buf->mtype);
+                len = (size_t) snprintf(out, out_size, "UNKNOWN message type (%d) ", (int) mtype);
                 break;
         }
-        len += snprintf(out + len, out_size - len, (IS_ACK(msg_buf->mtype) ? "ACK\n" : "NAK\n"));
+        len += snprintf(out + len, out_size - len, (IS_ACK(mtype) ? "ACK\n" : "NAK\n"));
     } else {
         /* REQUESTS */
-        switch (msg_buf->mtype) {
+        switch (mtype) {
             case MTYPE_LOAD:
                 len = (size_t) snprintf(out, out_size, "Loading %zu policies for pid %d with %zu bytes of secmem memory in total.\n",
                                                (size_t) msg_buf->blob.head.policy_count, msg_buf->blob.head.pid, (size_t) msg_buf->blob.head.size);
@@ -85,6 +136,57 @@ humanize_blob(msgbuf_t *msg_buf, char *out, size_t out_size)
             case MTYPE_VIEW:
                 len = (size_t) snprintf(out, out_size, "VIEW message.\n");
                 break;
+            case MTYPE_ATTACH:
+                len = (size_t) snprintf(out, out_size, "Attaching ring shmid %zu for pid %d.\n", (size_t) msg_buf->blob.head.shmid,
+                               msg_buf->blob.head.pid);
+                break;
+            case MTYPE_DETACH:
+                len = (size_t) snprintf(out, out_size, "Detaching ring shmid %zu for pid %d.\n", (size_t) msg_buf->blob.head.shmid,
+                               msg_buf->blob.head.pid);
+                break;
+            case MTYPE_BATCH:
+                len = (size_t) snprintf(out, out_size, "Batch of %zu operations for pid %d.\n", (size_t) msg_buf->blob.head.op_count,
+                               msg_buf->blob.head.pid);
+                break;
+            case MTYPE_STREAM_OPEN:
+                len = (size_t) snprintf(out, out_size, "Opening %c stream from pid %d @ secmem address 0x%lx\n", (char) msg_buf->blob.head.mode,
+                               msg_buf->blob.head.pid, (size_t) msg_buf->blob.head.addr);
+                break;
+            case MTYPE_STREAM_READ:
+                len = (size_t) snprintf(out, out_size, "Streaming %lx bytes from pid %d @ secmem address 0x%lx + 0x%lx\n", (size_t) msg_buf->blob.head.data_len,
+                               msg_buf->blob.head.pid, (size_t) msg_buf->blob.head.addr, (size_t) msg_buf->blob.head.offset);
+                break;
+            case MTYPE_STREAM_WRITE:
+                len = (size_t) snprintf(out, out_size, "Streaming %lx bytes to pid %d @ secmem address 0x%lx + 0x%lx\n", (size_t) msg_buf->blob.head.data_len,
+                               msg_buf->blob.head.pid, (size_t) msg_buf->blob.head.addr, (size_t) msg_buf->blob.head.offset);
+                break;
+            case MTYPE_HELLO:
+                len = (size_t) snprintf(out, out_size, "Hello from pid %d\n", msg_buf->blob.head.pid);
+                break;
+            case MTYPE_READV:
+                len = (size_t) snprintf(out, out_size, "Vector read of %zu objects from pid %d.\n", (size_t) msg_buf->blob.head.op_count,
+                               msg_buf->blob.head.pid);
+                break;
+            case MTYPE_WRITEV:
+                len = (size_t) snprintf(out, out_size, "Vector write of %zu objects to pid %d.\n", (size_t) msg_buf->blob.head.op_count,
+                               msg_buf->blob.head.pid);
+                break;
+            case MTYPE_LEASE:
+                len = (size_t) snprintf(out, out_size, "Leasing from pid %d @ secmem address 0x%lx.\n", msg_buf->blob.head.pid,
+                               (size_t) msg_buf->blob.head.addr);
+                break;
+            case MTYPE_RESIZE:
+                len = (size_t) snprintf(out, out_size, "Resizing pid %d to 0x%lx bytes.\n", msg_buf->blob.head.pid,
+                               (size_t) msg_buf->blob.head.size);
+                break;
+            case MTYPE_REALLOC:
+                len = (size_t) snprintf(out, out_size, "Reallocating from pid %d @ secmem address 0x%lx to 0x%lx bytes.\n",
+                               msg_buf->blob.head.pid, (size_t) msg_buf->blob.head.addr, (size_t) msg_buf->blob.head.new_size);
+                break;
+            case MTYPE_CLONE:
+                len = (size_t) snprintf(out, out_size, "Cloning from pid %d @ secmem address 0x%lx.\n", msg_buf->blob.head.pid,
+                               (size_t) msg_buf->blob.head.addr);
+                break;
             case MTYPE_TERMINATE:
                 len = (size_t) snprintf(out, out_size, "TERMINATION message.\n");
                 break;
@@ -92,13 +194,15 @@ humanize_blob(msgbuf_t *msg_buf, char *out, size_t out_size)
                 len = (size_t) snprintf(out, out_size, "NIL message.\n");
                 break;
             default:
-                len = (size_t) snprintf(out, out_size, "UNKNOWN message type (%d).\n", (int) msg_buf->mtype);
+                len = (size_t) snprintf(out, out_size, "UNKNOWN message type (%d).\n", (int) mtype);
                 break;
         }
     }
     
+    if (msg_buf->blob.head.req_id)
+        len += snprintf(out + len, out_size - len, "Request id 0x%lx\n", (size_t) msg_buf->blob.head.req_id);
     len += snprintf(out + len, out_size - len,"Data:\n");
-    if (IS_MTYPE_VIEW_ACK(msg_buf->mtype)) {
+    if (IS_MTYPE_VIEW_ACK(mtype)) {
         len = len; /* TODO finish implementing this: print_view(out_buf); */
     } else {
         char eol = '\t';
@@ -112,6 +216,289 @@ humanize_blob(msgbuf_t *msg_buf, char *out, size_t out_size)
     return len;
 }
 
+/*
+ * The number of bytes of the blob in use, whichever wire version it is in.
+ */
+size_t
+blob_wire_size(blob_t *blob)
+{
+    size_t len = 0;
+    blob_v2_head_t *v2 = (blob_v2_head_t *) blob;
+
+    if (IS_BLOB_V2(blob)) {
+        if (v2->len >= sizeof(blob_v2_head_t) && v2->len <= MAX_MTEXT_SIZE)
+            len = v2->len;
+    } else if (blob->head.data_len <= MAX_BLOB_DATA_SIZE) {
+        len = SIZEOF_BLOB(blob);
+    }
+    return len;
+}
+
+/*
+ * Write VALUE as a LEB128 varint: seven bits per byte, least significant first, the high bit set on all but the last.
+ */
+size_t
+varint_put(uint64_t value, unsigned char *out)
+{
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        out[len++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (unsigned char) value;
+    return len;
+}
+
+size_t
+varint_get(unsigned char *in, size_t avail, uint64_t *value)
+{
+    size_t len = 0;
+    unsigned int shift = 0;
+
+    *value = 0;
+    while (len < avail && len < MAX_VARINT_SIZE) {
+        *value |= (uint64_t) (in[len] & 0x7f) << shift;
+        if (!(in[len++] & 0x80))
+            return len;
+        shift += 7;
+    }
+    return 0;
+}
+
+/*
+ * Encode a native message as v2 into WIRE. See V2 WIRE FORMAT in comm.h.
+ */
+int
+msg_v2_encode(msgbuf_t *msg_buf, uint8_t status, msgbuf_t *wire)
+{
+    int ret = EXIT_FAILURE;
+    long mtype = MSG_MTYPE(msg_buf);
+    blob_header_t *head = &msg_buf->blob.head;
+    blob_v2_head_t *v2 = (blob_v2_head_t *) &wire->blob;
+    unsigned char *out = (unsigned char *) (v2 + 1);
+    SECMEM_INTERNAL_T field[BLOB_V2_FIELD_COUNT];
+    int i;
+
+    if (head->data_len > MAX_BLOB_DATA_SIZE)
+        return ret;
+
+    field[0] = (SECMEM_INTERNAL_T) head->pid;
+    field[1] = head->field2;
+    field[2] = head->field3;
+    field[3] = head->data_len;
+    /* a routed reply carries reply_mtype here, which v2 has no use for */
+    field[4] = IS_TOKEN(msg_buf->mtype) ? 0 : head->field5;
+    field[5] = head->field6;
+
+    memset(v2, 0, sizeof(*v2));
+    v2->magic = BLOB_V2_MAGIC;
+    v2->version = BLOB_V2_VERSION;
+    v2->opcode = (uint8_t) STRIP_MTYPE_MOD(mtype);
+    if (status)
+        v2->status = status;
+    else if (IS_ACK(mtype))
+        v2->status = BLOB_V2_STATUS_ACK;
+    else if (IS_NAK(mtype))
+        v2->status = BLOB_V2_STATUS_NAK;
+    else
+        v2->status = BLOB_V2_STATUS_REQUEST;
+
+    for (i = 0; i < BLOB_V2_FIELD_COUNT; i++) {
+        if (field[i]) {
+            v2->fields |= 1 << i;
+            out += varint_put((uint64_t) field[i], out);
+        }
+    }
+    memcpy(out, msg_buf->blob.body.data, head->data_len);
+    out += head->data_len;
+    v2->len = (uint16_t) (out - (unsigned char *) v2);
+
+    wire->mtype = IS_TOKEN(msg_buf->mtype) ? msg_buf->mtype : MTYPE_V2;
+    ret = EXIT_SUCCESS;
+    return ret;
+}
+
+/*
+ * Decode a v2 message in WIRE into a native one. See V2 WIRE FORMAT in comm.h.
+ */
+int
+msg_v2_decode(msgbuf_t *wire, msgbuf_t *msg_buf, uint8_t *status)
+{
+    blob_v2_head_t v2;
+    blob_header_t *head = &msg_buf->blob.head;
+    unsigned char *in = (unsigned char *) &wire->blob + sizeof(blob_v2_head_t);
+    size_t n, avail;
+    uint64_t field[BLOB_V2_FIELD_COUNT];
+    int i;
+
+    memset(head, 0, sizeof(*head));
+    memcpy(&v2, &wire->blob, sizeof(v2));
+    msg_buf->mtype = v2.opcode;
+    *status = BLOB_V2_STATUS_MALFORMED;
+
+    if (!IS_BLOB_V2(&v2) || v2.len < sizeof(v2) || v2.len > MAX_MTEXT_SIZE)
+        return EXIT_FAILURE;
+    if (v2.version != BLOB_V2_VERSION) {
+        *status = BLOB_V2_STATUS_VERSION;
+        return EXIT_FAILURE;
+    }
+
+    avail = v2.len - sizeof(v2);
+    for (i = 0; i < BLOB_V2_FIELD_COUNT; i++) {
+        field[i] = 0;
+        if (v2.fields & (1 << i)) {
+            if (!(n = varint_get(in, avail, &field[i])))
+                return EXIT_FAILURE;
+            in += n;
+            avail -= n;
+        }
+    }
+
+    /* what routes the reply goes in first, so that even a failure can be answered */
+    if (field[4] <= (uint64_t) (SECMEM_INTERNAL_T) -1)
+        head->field5 = (SECMEM_INTERNAL_T) field[4];
+    if (field[5] <= (uint64_t) (SECMEM_INTERNAL_T) -1)
+        head->field6 = (SECMEM_INTERNAL_T) field[5];
+    if (field[3] > MAX_BLOB_DATA_SIZE || field[3] != avail)
+        return EXIT_FAILURE;
+
+    *status = BLOB_V2_STATUS_RANGE;
+    if (field[0] > INT32_MAX)
+        return EXIT_FAILURE;
+    for (i = 1; i < BLOB_V2_FIELD_COUNT; i++) {
+        if (field[i] > (uint64_t) (SECMEM_INTERNAL_T) -1)
+            return EXIT_FAILURE;
+    }
+
+    head->pid = (pid_t) field[0];
+    head->field2 = (SECMEM_INTERNAL_T) field[1];
+    head->field3 = (SECMEM_INTERNAL_T) field[2];
+    head->data_len = (SECMEM_INTERNAL_T) field[3];
+    memcpy(msg_buf->blob.body.data, in, head->data_len);
+
+    if (v2.status == BLOB_V2_STATUS_ACK)
+        msg_buf->mtype |= MTYPE_MOD_ACK;
+    else if (v2.status != BLOB_V2_STATUS_REQUEST)
+        msg_buf->mtype |= MTYPE_MOD_NAK;
+    *status = v2.status;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Append an entry to a BATCH blob. Fails if there is no room left in the blob data.
+ */
+int
+batch_append(blob_t *blob, SECMEM_INTERNAL_T mtype, SECMEM_INTERNAL_T flags, blob_header_t *head, char *data)
+{
+    int ret = EXIT_FAILURE;
+    batch_head_t entry;
+
+    if (head->data_len <= MAX_BLOB_DATA_SIZE &&
+        blob->head.data_len + sizeof(batch_head_t) + head->data_len <= MAX_BLOB_DATA_SIZE) {
+        entry.mtype = mtype;
+        entry.flags = flags;
+        entry.head = *head;
+        memcpy(blob->body.data + blob->head.data_len, &entry, sizeof(entry));
+        if (data)
+            memcpy(blob->body.data + blob->head.data_len + sizeof(entry), data, head->data_len);
+        else
+            memset(blob->body.data + blob->head.data_len + sizeof(entry), 0, head->data_len);
+        blob->head.data_len += SIZEOF_BATCH_ENTRY(&entry);
+        blob->head.op_count++;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Get the entry of a BATCH blob at *OFFSET, and advance the offset past it. Fails once the entries run out (or if the
+ * blob is malformed).
+ */
+int
+batch_next(blob_t *blob, size_t *offset, batch_head_t *entry, char **data)
+{
+    int ret = EXIT_FAILURE;
+
+    if (*offset + sizeof(batch_head_t) <= blob->head.data_len && blob->head.data_len <= MAX_BLOB_DATA_SIZE) {
+        memcpy(entry, blob->body.data + *offset, sizeof(batch_head_t));
+        if (entry->head.data_len <= blob->head.data_len - *offset - sizeof(batch_head_t)) {
+            *data = blob->body.data + *offset + sizeof(batch_head_t);
+            *offset += SIZEOF_BATCH_ENTRY(entry);
+            ret = EXIT_SUCCESS;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Validate the vec_entry_t array of a READV or WRITEV blob, see VECTOR STRUCTURES.
+ */
+int
+vec_check(blob_t *blob, size_t *data_size)
+{
+    int ret = EXIT_FAILURE;
+    size_t i, array_size, sum = 0;
+    vec_entry_t entry;
+
+    if (blob->head.op_count > 0 && blob->head.op_count <= MAX_BLOB_DATA_SIZE / sizeof(vec_entry_t) &&
+        blob->head.data_len <= MAX_BLOB_DATA_SIZE) {
+        array_size = blob->head.op_count * sizeof(vec_entry_t);
+        for (i = 0; i < blob->head.op_count && sum <= MAX_BLOB_DATA_SIZE; i++) {
+            memcpy(&entry, blob->body.data + i * sizeof(vec_entry_t), sizeof(entry));
+            sum += entry.len <= MAX_BLOB_DATA_SIZE ? entry.len : MAX_BLOB_DATA_SIZE + 1;
+        }
+        if (array_size <= blob->head.data_len && array_size + sum <= MAX_BLOB_DATA_SIZE) {
+            *data_size = sum;
+            ret = EXIT_SUCCESS;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Validate the policies of a LOAD blob and pick up its load options, see LOAD OPTIONS.
+ */
+int
+load_check(blob_t *blob, load_opts_t *opts)
+{
+    int ret = EXIT_FAILURE;
+    size_t i, offset = 0;
+    policy_t *policy = blob->body.policy_entry;
+
+    memset(opts, 0, sizeof(load_opts_t));
+    if (blob->head.data_len <= MAX_BLOB_DATA_SIZE) {
+        for (i = 0; i < blob->head.policy_count; i++) {
+            if (blob->head.data_len - offset < sizeof(policy_head_t) ||
+                policy->head.len > blob->head.data_len - offset - sizeof(policy_head_t))
+                break;
+            offset += SIZEOF_POLICY(policy);
+            policy = NEXT_POLICY(policy);
+        }
+        if (i == blob->head.policy_count) {
+            memcpy(opts, blob->body.data + offset, MIN(blob->head.data_len - offset, sizeof(load_opts_t)));
+            ret = EXIT_SUCCESS;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Pick up the alloc options of an ALLOC blob, see ALLOC OPTIONS.
+ */
+int
+alloc_check(blob_t *blob, alloc_opts_t *opts)
+{
+    int ret = EXIT_FAILURE;
+
+    memset(opts, 0, sizeof(alloc_opts_t));
+    if (blob->head.data_len <= MAX_BLOB_DATA_SIZE) {
+        memcpy(opts, blob->body.data, MIN(blob->head.data_len, sizeof(alloc_opts_t)));
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
 /*
  * Return -1 on error, otherwise the message queue id is returned.
  */
@@ -31,12 +31,29 @@
 #define MTYPE_WRITE 	0x06
 #define MTYPE_VIEW 	    0x07
 #define MTYPE_TERMINATE 0x08
-#define MTYPE_COUNT 	0x09
+#define MTYPE_ATTACH 	0x09
+#define MTYPE_DETACH 	0x0A
+#define MTYPE_BATCH 	0x0B
+#define MTYPE_STREAM_OPEN 	0x0C
+#define MTYPE_STREAM_READ 	0x0D
+#define MTYPE_STREAM_WRITE 	0x0E
+#define MTYPE_HELLO 	0x0F
+/* the bases after HELLO keep the modifier bits clear, so they start at 0x40; 0x10 to 0x3F are not used */
+#define MTYPE_READV 	0x40
+#define MTYPE_WRITEV 	0x41
+#define MTYPE_LEASE 	0x42
+#define MTYPE_RESIZE 	0x43
+#define MTYPE_REALLOC 	0x44
+#define MTYPE_CLONE 	0x45
+#define MTYPE_COUNT 	0x46
 
 /*MTYPE modifiers */
 #define MTYPE_MOD_ACK 	0x10
 #define MTYPE_MOD_NAK 	0x20
 
+/* The mtype a v2 request is sent with (and an untokened v2 reply comes back with), see V2 WIRE FORMAT below */
+#define MTYPE_V2 	0x4000
+
 /*
  * Helper macros, with self-explanatory identifiers.
  */
@@ -46,6 +63,22 @@
 #define IS_ACK(_mtype) ((_mtype) & MTYPE_MOD_ACK)
 #define IS_NAK(_mtype) ((_mtype) & MTYPE_MOD_NAK)
 
+/*
+ * Reply routing.
+ *
+ * A request with a non-zero token (see blob_header_t) has its reply sent with mtype = token, so a client can pick only
+ * its own replies off the shared outgoing queue with msgrcv(..., token, 0). The ACK/NAK'd mtype of such a reply is
+ * carried in the reply header (reply_mtype) instead. Tokens must be at least MTYPE_TOKEN_MIN so they never collide with
+ * an untokened reply; MTYPE_TOKEN derives one from a pid. Clients that do not use tokens should receive with
+ * msgtyp = MTYPE_UNTOKENED so that they do not steal anyone else's replies.
+ */
+#define MTYPE_TOKEN_MIN 0x10000
+#define MTYPE_TOKEN(_pid) ((long) MTYPE_TOKEN_MIN + (long) (_pid))
+#define MTYPE_UNTOKENED (-(MTYPE_TOKEN_MIN - 1))
+#define IS_TOKEN(_token) ((_token) >= MTYPE_TOKEN_MIN)
+/* The mtype of a message with any token routing undone */
+#define MSG_MTYPE(_pmsg) (IS_TOKEN((_pmsg)->mtype) ? (long) (_pmsg)->blob.head.reply_mtype : (_pmsg)->mtype)
+
 
 
 /*
@@ -53,13 +86,21 @@
  * as the structs embedded within.
  *
  * Read/Write operations are the only routines that  have a chance of filling the blob data section. The
- * MAX_BLOB_DATA_SIZE macro effectively becomes the limitation on RW data transfers.
+ * MAX_BLOB_DATA_SIZE macro effectively becomes the limitation on RW data transfers, larger objects have to be moved
+ * with the STREAM messages. It can be raised at build time (both peers must agree), but a message can never be larger
+ * than the kernel's msgmax, which omnius takes into account when it hands out the stream chunk size.
  * The 'LG' size is used by the clear-message queue program so that it can grab erronously sized packets larger than
  * the default
  */
+#ifndef MAX_BLOB_DATA_SIZE
 #define MAX_BLOB_DATA_SIZE 4096
-#define MAX_MTEXT_SIZE  (sizeof(blob_header_t) + MAX_BLOB_DATA_SIZE)
-#define MAX_MTEXT_LG_SIZE (sizeof(blob_header_t) + MAX_BLOB_DATA_SIZE)
+#endif /* MAX_BLOB_DATA_SIZE */
+#define MAX_MTEXT_V1_SIZE (sizeof(blob_header_t) + MAX_BLOB_DATA_SIZE)
+#define MAX_MTEXT_V2_SIZE (MAX_BLOB_V2_HEAD_SIZE + MAX_BLOB_DATA_SIZE)
+#define MAX_MTEXT_SIZE  (MAX_MTEXT_V1_SIZE > MAX_MTEXT_V2_SIZE ? MAX_MTEXT_V1_SIZE : MAX_MTEXT_V2_SIZE)
+#define MAX_MTEXT_LG_SIZE MAX_MTEXT_SIZE
+/* The largest header of either wire version */
+#define MAX_BLOB_HEAD_SIZE (MAX_MTEXT_SIZE - MAX_BLOB_DATA_SIZE)
 #define SIZEOF_BLOB(_pobj) (sizeof(blob_header_t) + (_pobj)->head.data_len)
 #define SIZEOF_POLICY(_pobj) (sizeof(policy_head_t) + (_pobj)->head.len)
 #define NEXT_POLICY(_pobj) ((policy_t *)((char *)(_pobj) + sizeof(policy_head_t) + (_pobj)->head.len))
@@ -103,6 +144,75 @@ typedef struct policy_t
     policy_body_t body;
 } policy_t;
 
+/*
+ * LOAD OPTIONS
+ * A LOAD may carry a load_opts_t after its policies (data_len covers it). omnius takes as much of it as is there, the
+ * fields that are missing, or a LOAD without one, mean the defaults (0).
+ *
+ * strategy - how the objects of the process are placed in its region (see memory_strategy_t):
+ *      LOAD_STRATEGY_FIT   - segregated good-fit, small objects in slabs (default)
+ *      LOAD_STRATEGY_BUDDY - binary buddy; sizes are rounded up to a power of two (at least 1 << MEMORY_BUDDY_MIN_SHIFT)
+ *
+ * backing - how the pages of the region are backed, any of (0 for plain pages, committed as they are first touched):
+ *      LOAD_BACKING_THP      - transparent huge pages, the region is aligned to PROCESS_HUGE_PAGE_SIZE for them
+ *      LOAD_BACKING_HUGETLB  - explicit huge pages from the hugetlb pool, LOAD_BACKING_THP if the pool has too few
+ *      LOAD_BACKING_POPULATE - every page is faulted in by the LOAD, so no request takes a first-touch fault
+ *      LOAD_BACKING_LOCK     - populated and mlock'd, so it is never swapped, and left out of core dumps. The LOAD fails
+ *                              if it cannot be locked (see RLIMIT_MEMLOCK).
+ *      Freed pages of a plain region are given back to the system, those of any other are kept.
+ *
+ * handles - TRUE for objects to be addressed by handle rather than by offset (LOAD_STRATEGY_FIT only). The addr an
+ *      ALLOC returns is then a handle, whose low LOAD_HANDLE_OFFSET_BITS are zero; a byte inside the object is addressed
+ *      by adding its offset to the handle, in every message that takes an addr. omnius is then free to move objects,
+ *      and compacts the region between requests (see PROCESS HANDLES in process.h). No object may be larger than
+ *      1 << LOAD_HANDLE_OFFSET_BITS.
+ *
+ * arena - TRUE for the objects to be taken from omnius' global arena (see arena.h) rather than a region of the process'
+ *      own. The size of the LOAD is then a quota: the process can have at most that many bytes allocated, but only
+ *      takes up what it has. Addresses are the same either way. The LOAD fails if omnius runs without an arena, and an
+ *      arena process cannot ask for a backing, the arena is backed by plain pages.
+ *
+ * idle - the milliseconds an object may go untouched before omnius compresses it, giving up its space until it is
+ *      next touched (see PROCESS COMPRESSION in process.h); 0 for never. Only for plain pages (no backing): the pages
+ *      of any other region are kept, so there would be nothing to give up.
+ */
+#define LOAD_STRATEGY_FIT   0
+#define LOAD_STRATEGY_BUDDY 1
+#define LOAD_STRATEGY_COUNT 2
+
+#define LOAD_BACKING_THP      0x1
+#define LOAD_BACKING_HUGETLB  0x2
+#define LOAD_BACKING_POPULATE 0x4
+#define LOAD_BACKING_LOCK     0x8
+#define LOAD_BACKING_BITS 4
+
+#define LOAD_HANDLE_OFFSET_BITS (SECMEM_INTERNAL_BIT * 5 / 8)
+
+typedef struct load_opts_t
+{
+    SECMEM_INTERNAL_T strategy;
+    SECMEM_INTERNAL_T backing;
+    SECMEM_INTERNAL_T handles;
+    SECMEM_INTERNAL_T arena;
+    SECMEM_INTERNAL_T idle;
+} load_opts_t;
+
+/*
+ * ALLOC OPTIONS
+ * An ALLOC may carry an alloc_opts_t as its data (data_len covers it), the same way as a LOAD its load options.
+ *
+ * align - the power of two the object must start at a multiple of, up to ALLOC_ALIGN_MAX (0 or 1 for any). The regions
+ *      (and the arena) start on a page boundary, so the object's bytes are aligned in omnius too. An aligned object is
+ *      never put in a slab, and in a process with handles it is only moved to offsets that keep it aligned. With
+ *      LOAD_STRATEGY_BUDDY the object takes a block at least ALIGN large.
+ */
+#define ALLOC_ALIGN_MAX 4096
+
+typedef struct alloc_opts_t
+{
+    SECMEM_INTERNAL_T align;
+} alloc_opts_t;
+
 /*`
  * BLOB STUCTURES
  *
@@ -112,11 +222,15 @@ typedef struct policy_t
  * MAX_BLOB_DATA_SIZE, which is calculated by subtracting the blob header size (fixed) from the maximum size of the
  * MTEXT msgbuf_t field. (since the blob is the mtext section).
  *
- * The header uses unions to partition the struct into 4 fields. Each field has multiple aliases that can be used
+ * The header uses unions to partition the struct into 6 fields. Each field has multiple aliases that can be used
  * depending on the type of messsage determined by msgbuf_t's MTYPE field. All members are of identical size to the
  * other members of that union (field), this minimizes the chance of errors parsing the message, however this is simply
  * an ad-hoc, POCish way to communicate with no regard to the safety or welfare of others. BE WARNED!
  *
+ * The last two fields are common to every request: the token the reply is routed by (0 for none, see MTYPE_TOKEN_MIN)
+ * and a request id, which omnius echoes untouched in the reply so that a client with many requests in flight can match
+ * replies to requests.
+ *
  * Blob Types
  * 
  * LOAD
@@ -124,7 +238,7 @@ typedef struct policy_t
  * 	size
  * 	policy_count
  * 	data_len
- * 	data (policy_t[])
+ * 	data (policy_t[], then optionally load_opts_t)
  * 
  * UNLOAD
  * 	pid
@@ -133,6 +247,8 @@ typedef struct policy_t
  * 	pid
  * 	size
  * 	policy_id
+ * 	data_len
+ * 	data (optionally alloc_opts_t)
  * 	
  * FREE
  * 	pid
@@ -149,6 +265,98 @@ typedef struct policy_t
  *	addr
  * 
  *	data	
+ *
+ * ATTACH (see ring.h)
+ *	pid (must be the pid that created the ring pair segment)
+ *	shmid (request: the client's ring pair segment, reply: omnius' doorbell segment)
+ *
+ * DETACH
+ *	pid (must be the pid that attached it)
+ *	shmid
+ *
+ * STREAM_OPEN
+ *	pid
+ *	addr
+ *	mode (request: READ_CHAR or WRITE_CHAR)
+ *	chunk_size (reply: the largest data_len omnius accepts for this stream)
+ *
+ * STREAM_READ
+ *	pid
+ *	addr
+ *	offset
+ *	data_len
+ *
+ * STREAM_WRITE
+ *	pid
+ *	addr
+ *	offset
+ *	data_len
+ *	data
+ *
+ * The addr of a READ or WRITE (or of a READV/WRITEV entry) may point anywhere inside an allocated object, so that a
+ * field can be accessed without moving the whole object: data_len bytes from addr are moved, provided they do not run
+ * past the end of the object, and the object's FSM steps once as for any access. DEALLOC and STREAM_OPEN take the
+ * address the object starts at.
+ *
+ * A stream is one logical read or write of an object that is larger than a single message can carry. STREAM_OPEN
+ * feeds the object's FSM a single R or W; the object is then moved with STREAM_READ or STREAM_WRITE chunks of at most
+ * chunk_size bytes, at consecutive offsets starting from zero. The stream closes once the last byte of the object is
+ * moved, or when the object is accessed in any other way.
+ *
+ * Objects of up to MEMORY_SLAB_MAX bytes are kept in slabs (see memory.h); they fit a single message, and cannot be
+ * streamed or leased.
+ *
+ * BATCH (see BATCH STRUCTURES below)
+ *	pid
+ *	op_count
+ *	data_len
+ *	data (batch entries)
+ *
+ * READV, WRITEV (see VECTOR STRUCTURES below)
+ *	pid
+ *	op_count
+ *	data_len
+ *	data (vec_entry_t[], then the data written for WRITEV)
+ *
+ * LEASE (see lease.h)
+ *	pid
+ *	addr (request: anywhere inside the object, reply: the address the object starts at)
+ *	lease_size (reply: the size of the object)
+ *
+ * A LEASE is only ACK'd for an object whose FSM is in a read-only state, one where a W is denied and a R leads to
+ * another read-only state. It does not step the FSM. The reply passes the file descriptor of the lease (SCM_RIGHTS),
+ * so a LEASE is only taken over the unix socket, from a connection made by the pid it is for. Once leased, the object
+ * can be read straight from a mapping of the file until the lease is revoked, on DEALLOC, REALLOC, UNLOAD, or a denied
+ * W.
+ *
+ * RESIZE
+ *	pid
+ *	size (request: the size the region should have, reply: the size it has)
+ *
+ * Grows or shrinks the region of a process at its end, keeping every object where it is. A region only shrinks as far
+ * as the free space at its end goes; a RESIZE that cannot be done in full is NAK'd, and the reply tells the size the
+ * region was left with.
+ *
+ * REALLOC
+ *	pid
+ *	addr (request: the address the object starts at, reply: the address it has now)
+ *	new_size (the size it should have)
+ *
+ * Grows or shrinks an object in one request, instead of an ALLOC, READ, WRITE and DEALLOC. Its bytes are kept up to the
+ * smaller of the two sizes, the ones it gains are zero, and the ones past the new size are zeroed. Its FSM is not
+ * stepped, it carries on in the state it was in. The object stays where it is if the space after it allows, and is
+ * moved otherwise; with handles its handle does not change either way. A small object in a slab stays in its slot while
+ * it fits. The object keeps its alignment. A NAK'd REALLOC leaves the object as it was, save for a lease being revoked
+ * or a stream closed, as any REALLOC does.
+ *
+ * CLONE
+ *	pid
+ *	addr (request: the address the object starts at, reply: the address of the clone)
+ *
+ * Creates a new object of the same size, alignment and policy as an existing one, with the same bytes and its FSM in
+ * the same state. Neither FSM is stepped. The clone shares the bytes of its source until either of them is written, so
+ * a CLONE copies nothing however large the object is, and the clone's memory is only committed once it is written.
+ * The first write (or REALLOC) to either side makes the one copy. A small object in a slab is copied into a new slot.
  * 	
  * 	
  * 	 	
@@ -176,6 +384,13 @@ typedef struct blob_header_t {
         SECMEM_INTERNAL_T field3;
         SECMEM_INTERNAL_T policy_count; /* load */
         SECMEM_INTERNAL_T policy_id;    /* alloc */
+        SECMEM_INTERNAL_T shmid;        /* attach, detach */
+        SECMEM_INTERNAL_T op_count;     /* batch, readv, writev */
+        SECMEM_INTERNAL_T mode;         /* stream_open */
+        SECMEM_INTERNAL_T chunk_size;   /* stream_open (reply) */
+        SECMEM_INTERNAL_T offset;       /* stream_read, stream_write */
+        SECMEM_INTERNAL_T lease_size;   /* lease (reply) */
+        SECMEM_INTERNAL_T new_size;     /* realloc */
     };
 
     /* Field 4 */
@@ -183,6 +398,19 @@ typedef struct blob_header_t {
         SECMEM_INTERNAL_T field4;
         SECMEM_INTERNAL_T data_len; /* ALL */
     };
+
+    /* Field 5 */
+    union {
+        SECMEM_INTERNAL_T field5;
+        SECMEM_INTERNAL_T token;        /* ALL (request) */
+        SECMEM_INTERNAL_T reply_mtype;  /* ALL (reply, when routed by token) */
+    };
+
+    /* Field 6 */
+    union {
+        SECMEM_INTERNAL_T field6;
+        SECMEM_INTERNAL_T req_id;   /* ALL */
+    };
 } blob_header_t;
 
 typedef struct blob_data_t {
@@ -200,6 +428,138 @@ typedef struct blob_t
 
 
 
+/*
+ * BATCH STRUCTURES
+ *
+ * A BATCH message carries OP_COUNT sub-requests packed back to back in the blob data. Each entry is a batch_head_t
+ * followed by head.data_len bytes of data, exactly as that request would be laid out on its own (so a READ entry
+ * reserves room for the data it reads). Entries are not aligned, use memcpy to get at the heads.
+ *
+ * omnius runs the entries in order and replaces each one with its reply: the mtype OR'd with an ACK or NAK, the reply
+ * head, and the reply data. The BATCH itself is only NAK'd if it is malformed, in which case nothing is run.
+ *
+ * Flags:
+ *  LAST_ADDR - the entry's addr is relative to the address returned by the last successful ALLOC in this batch, so
+ *              that an allocation can be followed by accesses to it in the same message.
+ *  ABORT     - if this entry is NAK'd, the remaining entries are NAK'd without being run.
+ *
+ * BATCH, ATTACH, DETACH and TERMINATE cannot be batched, and every entry must be for the pid of the BATCH itself. Nor
+ * can READV or LEASE, whose requests have no room for the data they reply with.
+ */
+#define BATCH_FLAG_LAST_ADDR 0x01
+#define BATCH_FLAG_ABORT     0x02
+#define SIZEOF_BATCH_ENTRY(_phead) (sizeof(batch_head_t) + (_phead)->head.data_len)
+
+typedef struct batch_head_t
+{
+    SECMEM_INTERNAL_T mtype;
+    SECMEM_INTERNAL_T flags;
+    blob_header_t head;
+} batch_head_t;
+
+
+/*
+ * VECTOR STRUCTURES
+ *
+ * READV and WRITEV access OP_COUNT objects of one pid in a single message, saving a round trip per object. The blob
+ * data starts with an array of OP_COUNT vec_entry_t, one per object. A WRITEV follows it with the data to write to each
+ * object, packed back to back in the same order; a READV request carries nothing else, but the array and the data it
+ * reads must still fit in MAX_BLOB_DATA_SIZE. Entries are not aligned, use memcpy to get at them.
+ *
+ * Each object is accessed on its own, exactly as a READ or WRITE of it would be: its FSM steps once, and a failed entry
+ * does not stop the others. In the reply, each entry's STATUS is EXIT_SUCCESS or EXIT_FAILURE. A READV reply is
+ * followed by the data read, packed in order, where a failed entry has its LEN set to zero so that it takes no room.
+ * A WRITEV reply is the array alone. The READV/WRITEV itself is only NAK'd if it is malformed (or its pid is not
+ * loaded), in which case nothing is run.
+ */
+typedef struct vec_entry_t
+{
+    SECMEM_INTERNAL_T addr;
+    SECMEM_INTERNAL_T len;
+    SECMEM_INTERNAL_T status;   /* reply */
+} vec_entry_t;
+
+
+/*
+ * HELLO STRUCTURES
+ *
+ * A HELLO carries a hello_t in its data, both ways. The client describes itself and omnius replies with its own
+ * description, in which VERSIONS is narrowed to the wire versions both sides speak. Every field is 32 bits wide
+ * whatever SECMEM_INTERNAL_BIT is, so a client can learn omnius' field width (and therefore whether v1 messages, or
+ * bodies laid out natively such as BATCH entries, can be exchanged) before relying on it. Send the HELLO as v2 if the
+ * widths may differ.
+ */
+#define HELLO_VERSION(_v) (1u << (_v))
+
+typedef struct hello_t
+{
+    uint32_t versions;      /* HELLO_VERSION() bits of the wire versions spoken */
+    uint32_t internal_bit;  /* SECMEM_INTERNAL_BIT */
+    uint32_t max_data;      /* MAX_BLOB_DATA_SIZE */
+    uint32_t stream_chunk;  /* reply: the chunk size STREAM_OPEN hands out */
+} hello_t;
+
+
+/*
+ * V2 WIRE FORMAT
+ *
+ * The v1 wire format is the blob_t above: every message carries the whole blob_header_t, whose size depends on
+ * SECMEM_INTERNAL_BIT. A v2 message carries the same information in a compact, width independent encoding instead:
+ *
+ *  blob_v2_head_t
+ *  the header fields flagged in FIELDS, in blob_header_t order, each as a varint (LEB128)
+ *  data_len bytes of data (when BLOB_V2_FIELD_DATA_LEN is flagged)
+ *
+ * Fields that are zero are left out, so a NIL or DEALLOC is a handful of bytes. The v2 head starts where the pid of a
+ * v1 blob would, and its (negative) magic number can never be a valid pid, so a receiver tells the versions apart from
+ * the message itself.
+ *
+ * A request is sent with mtype = MTYPE_V2; its reply comes back with the same mtype, or with mtype = token if the
+ * request had one (reply_mtype is not used, OPCODE and STATUS say it all). The data is passed through untouched, so
+ * bodies with a native layout (policies, BATCH entries) still have to match omnius' field width.
+ *
+ * A field value that does not fit the receiver's SECMEM_INTERNAL_T (a 64-bit address sent to a 32-bit build, say)
+ * fails with BLOB_V2_STATUS_RANGE rather than being truncated.
+ *
+ * msg_v2_encode and msg_v2_decode convert between a native msgbuf_t and its v2 form, see below.
+ */
+#define BLOB_V2_MAGIC ((int32_t) 0x806f6d32)
+#define BLOB_V2_VERSION 2
+
+/* STATUS */
+#define BLOB_V2_STATUS_REQUEST   0
+#define BLOB_V2_STATUS_ACK       1
+#define BLOB_V2_STATUS_NAK       2
+#define BLOB_V2_STATUS_MALFORMED 3
+#define BLOB_V2_STATUS_RANGE     4
+#define BLOB_V2_STATUS_VERSION   5
+
+/* FIELDS */
+#define BLOB_V2_FIELD_PID      0x01
+#define BLOB_V2_FIELD_2        0x02
+#define BLOB_V2_FIELD_3        0x04
+#define BLOB_V2_FIELD_DATA_LEN 0x08
+#define BLOB_V2_FIELD_5        0x10
+#define BLOB_V2_FIELD_6        0x20
+#define BLOB_V2_FIELD_COUNT    6
+
+#define MAX_VARINT_SIZE 10
+#define MAX_BLOB_V2_HEAD_SIZE (sizeof(blob_v2_head_t) + BLOB_V2_FIELD_COUNT * MAX_VARINT_SIZE)
+
+#define IS_BLOB_V2(_pblob) (((blob_v2_head_t *) (_pblob))->magic == BLOB_V2_MAGIC)
+
+typedef struct blob_v2_head_t
+{
+    int32_t magic;      /* BLOB_V2_MAGIC */
+    uint8_t version;    /* BLOB_V2_VERSION */
+    uint8_t opcode;     /* MTYPE base */
+    uint8_t status;     /* BLOB_V2_STATUS_* */
+    uint8_t fields;     /* BLOB_V2_FIELD_* bits of the fields that follow */
+    uint16_t len;       /* the length of the whole message, this head included */
+    uint16_t flags;     /* reserved, zero */
+} blob_v2_head_t;
+
+
 /*
  * MSGBUF STUCTURES
  *
@@ -208,7 +568,7 @@ typedef struct blob_t
  * read, write, terminate, view).
  * The second fieldfield can either be treated as an opaque array of type char, or it can be
  * interpreted as type blob_t. Both interpretations are of the same fixed maximum size (MAX_MTEXT_SIZE) so they can be
- * implemented using a union.
+ * implemented using a union. The buffer is large enough for a message in either wire version.
  *
  * A second large msgbuf_LG_t is used by a message buffer clearing utility. It has a larger mtext buffer so that it can clear
  * (possibly) errornous IPC messages that are too large for the regular msgbuf_t to hold. This type should NOT be used
@@ -245,6 +605,84 @@ size_t
 humanize_blob(msgbuf_t *, char *, size_t);
 
 
+/*
+ * BLOB_WIRE_SIZE ROUTINE
+ *
+ * The number of bytes of a blob in use on the wire, for either version. Returns 0 if the blob claims to be larger than
+ * a message can be.
+ */
+size_t
+blob_wire_size(blob_t *);
+
+
+/*
+ * VARINT_PUT, VARINT_GET, MSG_V2_ENCODE, MSG_V2_DECODE ROUTINES
+ *
+ * varint_put writes a value as a LEB128 varint and returns its length. varint_get reads one from at most AVAIL bytes
+ * and returns its length, or 0 if it is truncated or too long.
+ *
+ * msg_v2_encode converts a native message (a request, or a reply as omnius_reply leaves it) into its v2 form in a
+ * separate buffer. A non-zero STATUS overrides the status derived from the mtype's ACK/NAK modifier.
+ *
+ * msg_v2_decode converts a v2 message into a native one, with the mtype set to the opcode (OR'd with ACK or NAK for a
+ * reply). On failure the BLOB_V2_STATUS_* reason is stored in *STATUS, and whatever could be decoded (e.g. the token
+ * and request id) is left in the native message so that the failure can still be answered.
+ */
+size_t
+varint_put(uint64_t, unsigned char *);
+
+size_t
+varint_get(unsigned char *, size_t, uint64_t *);
+
+int
+msg_v2_encode(msgbuf_t *, uint8_t, msgbuf_t *);
+
+int
+msg_v2_decode(msgbuf_t *, msgbuf_t *, uint8_t *);
+
+
+/*
+ * BATCH_APPEND, BATCH_NEXT ROUTINES
+ *
+ * Helpers to build a BATCH blob and to walk the entries of its reply.
+ * batch_append adds one entry (head and data_len bytes of data, data may be NULL) and bumps op_count and data_len.
+ * batch_next copies the entry head at *offset out, points the last argument at its data and advances *offset.
+ */
+int
+batch_append(blob_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, blob_header_t *, char *);
+
+int
+batch_next(blob_t *, size_t *, batch_head_t *, char **);
+
+
+/*
+ * VEC_CHECK ROUTINE
+ *
+ * Check the vec_entry_t array of a READV or WRITEV blob and store the sum of its entry lengths in *DATA_SIZE. Fails if
+ * the array does not fit in the blob data, or if the array and the data it describes do not fit in a message.
+ */
+int
+vec_check(blob_t *, size_t *);
+
+
+/*
+ * LOAD_CHECK ROUTINE
+ *
+ * Check that the policies of a LOAD blob fit in its data, and copy the load options that follow them (see LOAD
+ * OPTIONS) to *OPTS, defaults for any that are not there.
+ */
+int
+load_check(blob_t *, load_opts_t *);
+
+/*
+ * ALLOC_CHECK ROUTINE
+ *
+ * Copy the alloc options of an ALLOC blob (see ALLOC OPTIONS) to *OPTS, defaults for any that are not there.
+ */
+int
+alloc_check(blob_t *, alloc_opts_t *);
+
+
 /*
  * IPC_CONNECT, IPC_DISCONNECT ROUTINES
  *
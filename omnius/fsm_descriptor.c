@@ -6,18 +6,23 @@
  *
  * These routines expect the caller to allocate and deallocate the input fsm_descriptor reference parameter.
  * The load routine allocates the space for the comment field of the fsm_descriptor, and a subroutine it calls also
- * allocates space for the alpha_map and jmp_tbl.
+ * allocates space for the alpha_map and jmp_tbl. The analysis of the states (read_only) is allocated by the load as
+ * well.
  * The unload routine free's all the memory allocated by the load routine (and it's children).
  *
  * All of these routines return EXIT_SUCCESS or EXIT_FAILURE.
  *
+ * The regex compiler keeps static state, so compiles are serialized.
+ *
  * 2015 - Mike Clark
  */
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "fsm_descriptor.h"
 #include "regex_parse/regex_parse.h"
 
+pthread_mutex_t g_compile_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /*
@@ -41,10 +46,17 @@ fsm_descriptor_load(char *regex, size_t len, fsm_descriptor_t *fsm_desc)
             /* in case the above did not write the entire string if it was > comment_len. Null terminate. */
             buffer[buffer_len] = '\0';
             SYMBOL_T symbol_count;
-            /* This routine will populate the symbol_count, alpha_map, and jmp_tbl */
-            ret = compile_regex(buffer, &symbol_count, &fsm_desc->alpha_map, &fsm_desc->jmp_tbl);
+            STATE_T state_count = 0;
+            /* This routine will populate the symbol_count, state_count, alpha_map, and jmp_tbl */
+            pthread_mutex_lock(&g_compile_lock);
+            ret = compile_regex(buffer, &symbol_count, &state_count, &fsm_desc->alpha_map, &fsm_desc->jmp_tbl);
+            pthread_mutex_unlock(&g_compile_lock);
             fsm_desc->symbol_count = symbol_count;
+            fsm_desc->state_count = state_count;
             fsm_desc->comment = buffer;
+            fsm_desc->read_only = NULL;
+            if (ret == EXIT_SUCCESS)
+                ret = fsm_descriptor_analyze(fsm_desc);
         }
     }
     return ret;
@@ -57,7 +69,7 @@ fsm_descriptor_unload(fsm_descriptor_t *fsm_desc)
     int ret = EXIT_FAILURE;
 
     /*  ref_count should be zero at this point */
-    if (fsm_desc->ref_count == 0)
+    if (ATOMIC_LOAD(&fsm_desc->ref_count) == 0)
     {
         if (fsm_desc->comment)
             free(fsm_desc->comment);
@@ -65,6 +77,47 @@ fsm_descriptor_unload(fsm_descriptor_t *fsm_desc)
             free(fsm_desc->jmp_tbl);
         if (fsm_desc->alpha_map)
             free(fsm_desc->alpha_map);
+        if (fsm_desc->read_only)
+            free(fsm_desc->read_only);
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Find the read-only absorbing states of an FSM: the states where a WRITE leads to the NULL state and a READ leads to
+ * another read-only state (often the same one). Once an object is in one of these its content can never change again
+ * (short of a DEALLOC), so it is safe to hand out read-only copies of it (see lease.c). The DFA is not minimized, so
+ * a self loop is not required; instead every state that denies a WRITE is taken, and the ones whose READ leads out of
+ * the set are dropped until none are left to drop. A policy without a R symbol has none.
+ */
+int
+fsm_descriptor_analyze(fsm_descriptor_t *fsm_desc)
+{
+    int ret = EXIT_FAILURE;
+
+    fsm_desc->read_only = (char *) calloc(fsm_desc->state_count, sizeof(char));
+    if (fsm_desc->read_only) {
+        SYMBOL_T r = fsm_desc->alpha_map[FSM_READ_SYMBOL];
+        SYMBOL_T w = fsm_desc->alpha_map[FSM_WRITE_SYMBOL];
+        STATE_T state, *row;
+        char changed = TRUE;
+
+        /* the NULL state is never read-only, nothing can be done in it */
+        for (state = FSM_START_STATE; r != FSM_NULL_STATE && state < fsm_desc->state_count; ++state) {
+            row = &fsm_desc->jmp_tbl[state * fsm_desc->symbol_count];
+            fsm_desc->read_only[state] = row[w] == FSM_NULL_STATE && row[r] != FSM_NULL_STATE;
+        }
+        while (changed) {
+            changed = FALSE;
+            for (state = FSM_START_STATE; state < fsm_desc->state_count; ++state) {
+                row = &fsm_desc->jmp_tbl[state * fsm_desc->symbol_count];
+                if (fsm_desc->read_only[state] && !fsm_desc->read_only[row[r]]) {
+                    fsm_desc->read_only[state] = FALSE;
+                    changed = TRUE;
+                }
+            }
+        }
         ret = EXIT_SUCCESS;
     }
     return ret;
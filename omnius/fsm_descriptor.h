@@ -43,16 +43,25 @@
  */
 typedef struct fsm_descriptor_t
 {
-    int ref_count; /* TODO use macro for something that acts atomically */
+    int ref_count; /* only ever changed with ATOMIC_INC/ATOMIC_DEC */
     SYMBOL_T symbol_count; /*  number of symbols in the alphabet (including NULL=0) */
+    STATE_T state_count; /* number of states (including NULL=0) */
     char *comment; /* null-terminated */
     SYMBOL_T *alpha_map; /* Mapping from external input char -> internal FSM input symbol [0,|symbols|] */
     STATE_T *jmp_tbl; /* pointer to the state jmp table that describes this FSM */
+    char *read_only; /* per state, TRUE if it is read-only absorbing (R stays read-only, W leads to the NULL state) */
 } fsm_descriptor_t;
 
+/* External input symbols the read-only analysis looks at */
+#define FSM_READ_SYMBOL  'R'
+#define FSM_WRITE_SYMBOL 'W'
+
+#define FSM_IS_READ_ONLY(_pfsm_desc, _state) ((_pfsm_desc)->read_only[(_state)])
+
 
 
 int fsm_descriptor_load(char *, size_t, fsm_descriptor_t *);
 int fsm_descriptor_unload(fsm_descriptor_t *);
+int fsm_descriptor_analyze(fsm_descriptor_t *);
 
 #endif /* SECMEM_FSM_DESCRIPTOR_H */
@@ -34,10 +34,25 @@
 #define OMNIUS_DEFAULT_MSG_IN 0xdead1
 #define OMNIUS_DEFAULT_MSG_OUT 0xdead2
 
+/* Atomic operations (GCC builtins) for counters and pointers shared between omnius' threads */
+#define ATOMIC_INC(_p) __sync_add_and_fetch((_p), 1)
+#define ATOMIC_DEC(_p) __sync_sub_and_fetch((_p), 1)
+#define ATOMIC_ADD(_p, _v) __sync_add_and_fetch((_p), (_v))
+#define ATOMIC_SUB(_p, _v) __sync_sub_and_fetch((_p), (_v))
+#define ATOMIC_LOAD(_p) __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define ATOMIC_CAS(_p, _old, _new) __sync_bool_compare_and_swap((_p), (_old), (_new))
+#define ATOMIC_XCHG(_p, _v) __atomic_exchange_n((_p), (_v), __ATOMIC_ACQ_REL)
+
 #ifndef FALSE
     #define FALSE 0
 #endif /* FALSE */
 #ifndef TRUE
     #define TRUE 1
 #endif /* TRUE */
+#ifndef MAX
+    #define MAX(_a, _b) ((_a) > (_b) ? (_a) : (_b))
+#endif /* MAX */
+#ifndef MIN
+    #define MIN(_a, _b) ((_a) < (_b) ? (_a) : (_b))
+#endif /* MIN */
 #endif /* SECMEM_GLOBAL_H */
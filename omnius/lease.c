@@ -0,0 +1,76 @@
+/* omnius/lease.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * See lease.h. A node holds at most one lease, its lease_id is 0 while it holds none and lease_fd is omnius' descriptor
+ * of the lease file. Leases are only handled by the worker that owns the node's process, the id counter is the only
+ * state shared between workers.
+ *
+ * All of these routines return EXIT_SUCCESS or EXIT_FAILURE.
+ *
+ * 2015 - Mike Clark
+ */
+#define _GNU_SOURCE /* memfd_create, F_ADD_SEALS */
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "global.h"
+#include "lease.h"
+
+SECMEM_INTERNAL_T g_lease_seq = 0;
+
+/*
+ * Lease NODE, copying its content from SRC. A node that already holds a lease keeps it, the content is the same.
+ */
+int
+lease_grant(secmem_obj_t *node, char *src)
+{
+    int ret = EXIT_FAILURE;
+    int fd;
+
+    if (node->lease_id)
+        return EXIT_SUCCESS;
+
+    if ((fd = memfd_create(LEASE_FILE_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING)) >= 0) {
+        if (ftruncate(fd, (off_t) node->size) == 0 &&
+            pwrite(fd, src, node->size, 0) == (ssize_t) node->size &&
+            fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SEAL) == 0) {
+            node->lease_id = ATOMIC_INC(&g_lease_seq);
+            node->lease_fd = fd;
+            ret = EXIT_SUCCESS;
+        } else {
+            close(fd);
+        }
+    }
+    return ret;
+}
+
+/* Revoke the lease NODE holds, if any. Mappings of it fault from here on. */
+int
+lease_revoke(secmem_obj_t *node)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (node->lease_id) {
+        if (ftruncate(node->lease_fd, 0) != 0)
+            ret = EXIT_FAILURE;
+        close(node->lease_fd);
+        node->lease_id = 0;
+        node->lease_fd = -1;
+    }
+    return ret;
+}
+
+/* Revoke the lease of NODE once its FSM has left the read-only state the lease was granted in. */
+int
+lease_check(secmem_obj_t *node)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (node->lease_id && !FSM_IS_READ_ONLY(node->ragasm.fsm_desc, node->ragasm.curr_state))
+        ret = lease_revoke(node);
+    return ret;
+}
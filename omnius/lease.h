@@ -0,0 +1,46 @@
+/* omnius/lease.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Read leases.
+ *
+ * An object whose FSM has reached a read-only absorbing state (see fsm_descriptor_analyze) can never be written again,
+ * and every further READ is allowed and keeps it in a read-only state. Such an object can be handed to its process as
+ * a read-only shared memory mapping (a lease), so that the process reads it in place instead of sending a READ per
+ * access.
+ *
+ * A lease is an anonymous shared memory file (memfd) holding a copy of the object's bytes. It has no name, so no other
+ * process can find it: its file descriptor is passed to the process over its unix socket connection with SCM_RIGHTS,
+ * and only once the kernel has vouched that the peer is the pid the lease is for (see omnius_complete). A LEASE over
+ * a transport that cannot pass file descriptors is refused. The file is sealed against writes and growth, so the
+ * process can only map it PROT_READ; it is not sealed against shrinking, and the seals themselves are sealed. A copy
+ * is safe since the bytes cannot change while the lease stands.
+ *
+ * omnius keeps its own descriptor of the file and revokes the lease by truncating it to zero: from then on any access
+ * through an existing mapping faults (SIGBUS), and a client checks that its lease still stands with fstat
+ * (st_size != 0).
+ *
+ * A lease is revoked when its object is deallocated or reallocated, when its process unloads, and when the object
+ * leaves the read-only states (which can only be into the NULL state).
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef SECMEM_LEASE_H
+#define SECMEM_LEASE_H
+
+#include "global.h"
+#include "memory.h"
+
+#define LEASE_FILE_NAME "omnius-lease"
+
+int
+lease_grant(secmem_obj_t *, char *);
+
+int
+lease_revoke(secmem_obj_t *);
+
+int
+lease_check(secmem_obj_t *);
+
+#endif /* SECMEM_LEASE_H */
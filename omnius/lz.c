@@ -0,0 +1,149 @@
+/* omnius/lz.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * See lz.h. The compressor keeps the last position each hash of LZ_MIN_MATCH bytes was seen at, and takes the match
+ * found there if it is one (greedily, without looking for a longer one). The further it gets from the last match, the
+ * more positions it skips, so data that does not compress is passed over quickly.
+ *
+ * All of these routines return EXIT_SUCCESS or EXIT_FAILURE.
+ *
+ * 2015 - Mike Clark
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+
+/* Write the bytes that continue a length of N (a nibble of 15) at OUT, returns where they end */
+char *
+lz_put_length(char *out, size_t n)
+{
+    if (n >= 15) {
+        for (n -= 15; n >= 255; n -= 255)
+            *out++ = (char) 255;
+        *out++ = (char) n;
+    }
+    return out;
+}
+
+/* Add the bytes that continue a length (a nibble of 15) from *P_P, which is moved past them, to *N_P */
+int
+lz_get_length(const unsigned char **p_p, const unsigned char *end, size_t *n_p)
+{
+    int ret = EXIT_FAILURE;
+    unsigned char b = 255;
+
+    while (b == 255 && *p_p < end) {
+        b = *(*p_p)++;
+        *n_p += b;
+    }
+    if (b != 255)
+        ret = EXIT_SUCCESS;
+    return ret;
+}
+
+/*
+ * Compress LEN bytes from SRC into DST, which has room for CAP bytes, the compressed size placed in LEN_P. Fails if it
+ * does not fit, which is how a caller that wants a given ratio asks for it.
+ */
+int
+lz_compress(const char *src, size_t len, char *dst, size_t cap, size_t *len_p)
+{
+    int ret = EXIT_FAILURE;
+    size_t table[1 << LZ_HASH_BITS], lit, match;
+    const char *anchor = src, *p = src, *end = src + len, *ref;
+    char *out = dst, *out_end = dst + cap;
+    uint32_t seq;
+    int room = TRUE;
+
+    memset(table, 0, sizeof(table));
+    while (room && len >= LZ_MIN_MATCH && p <= end - LZ_MIN_MATCH) {
+        memcpy(&seq, p, sizeof(seq));
+        seq = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        ref = src + table[seq];
+        table[seq] = p - src;
+        if (ref >= p || p - ref > LZ_MAX_OFFSET || memcmp(ref, p, LZ_MIN_MATCH)) {
+            p += 1 + ((p - anchor) >> 6);
+            continue;
+        }
+        for (match = LZ_MIN_MATCH; p + match < end && ref[match] == p[match]; match++)
+            ;
+        lit = p - anchor;
+        /* the token, the literals and their length, the offset and the match length */
+        if ((size_t) (out_end - out) < 1 + lit / 255 + 1 + lit + 2 + (match - LZ_MIN_MATCH) / 255 + 1) {
+            room = FALSE;
+        } else {
+            *out++ = (char) ((MIN(lit, 15) << 4) | MIN(match - LZ_MIN_MATCH, 15));
+            out = lz_put_length(out, lit);
+            memcpy(out, anchor, lit);
+            out += lit;
+            *out++ = (char) ((p - ref) & 0xff);
+            *out++ = (char) ((p - ref) >> 8);
+            out = lz_put_length(out, match - LZ_MIN_MATCH);
+            p += match;
+            anchor = p;
+        }
+    }
+
+    /* the rest is literals */
+    lit = end - anchor;
+    if (room && (size_t) (out_end - out) >= 1 + lit / 255 + 1 + lit) {
+        *out++ = (char) (MIN(lit, 15) << 4);
+        out = lz_put_length(out, lit);
+        memcpy(out, anchor, lit);
+        out += lit;
+        *len_p = out - dst;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/* Decompress the LEN bytes from SRC into DST, which they must fill exactly DST_LEN bytes of */
+int
+lz_decompress(const char *src, size_t len, char *dst, size_t dst_len)
+{
+    int ret = EXIT_SUCCESS;
+    const unsigned char *p = (const unsigned char *) src, *end = p + len;
+    char *out = dst, *out_end = dst + dst_len;
+    size_t lit, match, offset;
+    unsigned char token;
+
+    while (ret == EXIT_SUCCESS && p < end) {
+        token = *p++;
+        lit = token >> 4;
+        match = token & 15;
+        if ((lit == 15 && lz_get_length(&p, end, &lit) != EXIT_SUCCESS) ||
+            lit > (size_t) (end - p) || lit > (size_t) (out_end - out)) {
+            ret = EXIT_FAILURE;
+        } else {
+            memcpy(out, p, lit);
+            out += lit;
+            p += lit;
+            /* the last sequence has no match */
+            if (p == end)
+                break;
+            if (end - p < 2) {
+                ret = EXIT_FAILURE;
+            } else {
+                offset = p[0] | (size_t) p[1] << 8;
+                p += 2;
+                if ((match == 15 && lz_get_length(&p, end, &match) != EXIT_SUCCESS) ||
+                    !offset || offset > (size_t) (out - dst) || match + LZ_MIN_MATCH > (size_t) (out_end - out)) {
+                    ret = EXIT_FAILURE;
+                } else if (offset >= match + LZ_MIN_MATCH) {
+                    memcpy(out, out - offset, match + LZ_MIN_MATCH);
+                    out += match + LZ_MIN_MATCH;
+                } else {
+                    /* the match overlaps what it produces, a run */
+                    for (match += LZ_MIN_MATCH; match; match--, out++)
+                        *out = *(out - offset);
+                }
+            }
+        }
+    }
+    if (out != out_end)
+        ret = EXIT_FAILURE;
+    return ret;
+}
@@ -0,0 +1,43 @@
+/* omnius/lz.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * A small LZ77 codec, for the objects omnius compresses while they are idle (see PROCESS COMPRESSION in process.h).
+ *
+ * It is byte oriented and built for speed rather than ratio, in the manner of LZ4: matches are found through a hash
+ * of the next LZ_MIN_MATCH bytes, and the output is a series of sequences, each a run of literals and then a match:
+ *
+ *      token       - the literal count in the high nibble, the match length less LZ_MIN_MATCH in the low one; a
+ *                    nibble of 15 is continued by bytes that are added on, up to one below 255
+ *      literals    - the literal count bytes, copied as they are
+ *      offset      - how far back the match starts, 2 bytes little endian (1 to LZ_MAX_OFFSET)
+ *
+ * The last sequence is literals only, and ends the input. The output carries no length of its own, the decoder is
+ * told how long the input is and how much it is to produce, and fails unless it is exactly that.
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef SECMEM_LZ_H
+#define SECMEM_LZ_H
+
+#include <stddef.h>
+#include "global.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+int
+lz_compress(const char *, size_t, char *, size_t, size_t *);
+
+int
+lz_decompress(const char *, size_t, char *, size_t);
+
+char *
+lz_put_length(char *, size_t);
+
+int
+lz_get_length(const unsigned char **, const unsigned char *, size_t *);
+
+#endif /* SECMEM_LZ_H */
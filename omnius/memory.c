@@ -16,15 +16,18 @@
 #include <string.h>
 #include "memory.h"
 
-/* This will allocate one new memory object and point the head to it,
+/* This will allocate one new memory object and point the head to it, and start the INDEX with it.
  * The size should be the entire memory size requested by the process.
  */
 int
-memory_load(SECMEM_INTERNAL_T size, secmem_obj_t **head)
+memory_load(SECMEM_INTERNAL_T size, secmem_obj_t **head, memory_index_t *index)
 {
     int ret = EXIT_FAILURE;
+    memset(index, 0, sizeof(memory_index_t));
     if ((*head = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t))) != NULL) {
         (*head)->size = size;
+        memory_index_insert(*head, index);
+        memory_free_insert(*head, index);
         ret = EXIT_SUCCESS;
     }
     return ret;
@@ -35,14 +38,22 @@ memory_load(SECMEM_INTERNAL_T size, secmem_obj_t **head)
  * the all memory objects must be destroyed.
  */
 int
-memory_unload(secmem_obj_t *head)
+memory_unload(secmem_obj_t *head, memory_index_t *index)
 {
     secmem_obj_t *h;
-    int ret = EXIT_SUCCESS;
+    int i, ret = EXIT_SUCCESS;
 
+    memset(index, 0, sizeof(memory_index_t));
     while (head) {
-        if (head->used)
+        if (head->used && head->ragasm.is_loaded)
             ret |= ragasm_unload(&head->ragasm); /* accumulate errors - only works cause failure != 0 */
+        if (head->slab) {
+            /* drop the references of the slots still in use */
+            for (i = 0; i < head->slab->slot_count; i++)
+                if (head->slab->used & ((uint64_t) 1 << i))
+                    ATOMIC_DEC(&head->slab->fsm_desc->ref_count);
+            free(head->slab);
+        }
         h = head->next;
         free(head);
         head = h;
@@ -52,11 +63,16 @@ memory_unload(secmem_obj_t *head)
 }
 
 /*
- * This routine is used to allocate a new memory object of a given size for a given process using a first-fit method.
+ * This routine is used to allocate a new memory object of a given size for a given process. The free lists of the index
+ * give an unused node at least SIZE large in constant time (good-fit, see memory_free_find); the new object is carved
+ * from the front of it, or from the first offset in it that is a multiple of ALIGN. The bytes skipped to get there are
+ * split off into an unused node of their own, so they can still be allocated.
  *
  * PARAMETERS
  * size - size of allocation in bytes
  *
+ * align - the power of two the offset of the object must be a multiple of, 0 or 1 for any offset
+ *
  * dsm_desc - the fsm description whose policy will apply to the allocation. A ragel will be generated to realize
  *              FSM instance by maintaining state and computing transitions on input symbols fed to it
  *              (i.e. 'R' read, and 'W' write)
@@ -68,67 +84,103 @@ memory_unload(secmem_obj_t *head)
  *          double-indirection so that we can modify the head pointer in case we allocate a new memory object as the
  *          head of the list and need ti change the head pointer.
  *
+ * index - the index of the list, the new node is added to it and the free lists are kept up to date.
+ *
  *  RETURN
  *  EXIT_SUCCESS on success, otherwise failure.
  *
  *  NOTES
- *
+ *  The good fit for SIZE may have no room for the padding up to the next multiple of ALIGN; a node of SIZE + ALIGN - 1
+ *  bytes always has, so that is looked for instead.
  */
 int
-memory_alloc(SECMEM_INTERNAL_T size, fsm_descriptor_t *fsm_desc, secmem_obj_t **node_p, secmem_obj_t **head_p) {
+memory_alloc(SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T align, fsm_descriptor_t *fsm_desc, secmem_obj_t **node_p,
+             secmem_obj_t **head_p, memory_index_t *index) {
     int ret = EXIT_FAILURE;
-    secmem_obj_t *new_node = NULL;
-    secmem_obj_t *head = *head_p;
-    while (head) {
-        if (!head->used && size <= head->size) {
-            if (head->size != size) {
-                new_node = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t));
-                if (new_node) {
-                    /* Fix new node */
-                    new_node->offset = head->offset;
-                    new_node->size = size;
-                    new_node->prev = head->prev;
-                    new_node->next = head;
-                    /*new_node->ragasm is allocated and setup by the caller in the layer above */
-
-                    /* Fix old node (ahead now)*/
-                    head->offset += size;
-                    head->size -= size;
-                    head->prev = new_node;
-
-                    /* Fix node behind and test to see if the allocation was the first node, if so, point the memory
-                     * node list head to it. ASSUMES that the only node with a NULL prev pointer is the head
-                     */
-                    if (new_node->prev) {
-                        new_node->prev->next = new_node;
-                    } else {
-                        *head_p = new_node;
-                    }
-                    new_node->used = TRUE;
-                    ret = EXIT_SUCCESS;
-                } /* else ret = EXIT_FAILURE */
+    secmem_obj_t *new_node = NULL, *pad_node = NULL;
+    secmem_obj_t *head = memory_free_find(size, index);
+    SECMEM_INTERNAL_T pad;
+
+    align = align ? align : 1;
+    if (head && MEMORY_ALIGN_PAD(head->offset, align) > head->size - size)
+        head = size + align - 1 > size ? memory_free_find(size + align - 1, index) : NULL;
+    if (head) {
+        /* the nodes needed are allocated up front, so that a failure leaves the free node as it was */
+        pad = MEMORY_ALIGN_PAD(head->offset, align);
+        if (pad)
+            pad_node = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t));
+        if (head->size - pad != size)
+            new_node = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t));
+        else
+            /* if the candidate size is equal to what is needed, just set it to used, no need to carve it up */
+            new_node = head;
+        if ((!pad || pad_node) && new_node) {
+            if (pad)
+                memory_split(head, pad, FALSE, pad_node, head_p, index);
+            if (new_node != head) {
+                memory_split(head, size, TRUE, new_node, head_p, index);
             } else {
-                /* if candidate size is equal to the memory node we are looking at,
-                * just set it to used, no need to do carve up the candidate node..
-                */
-                new_node = head;
-                new_node->used = TRUE;
-                ret = EXIT_SUCCESS;
+                memory_free_remove(head, index);
+                head->used = TRUE;
             }
-            break;
+            new_node->align = align;
+            ret = EXIT_SUCCESS;
+        } else {
+            if (new_node != head)
+                free(new_node);
+            free(pad_node);
+            new_node = NULL;
         } /* else ret = EXIT_FAILURE */
-        head = head->next;
-    }
+    } /* else ret = EXIT_FAILURE */
 
     /* return a pointer to the new (or changed) node, on failure this will be NULL and ret==EXIT_FAILURE */
     *node_p = new_node;
     return ret;
 }
 
+/*
+ * Split the first SIZE bytes (less than its size) off the unused node HEAD into NEW_NODE, which is caller allocated.
+ * NEW_NODE is set USED, or put on the free lists with HEAD if not. See memory_alloc for HEAD_P and INDEX.
+ */
+void
+memory_split(secmem_obj_t *head, SECMEM_INTERNAL_T size, char used, secmem_obj_t *new_node, secmem_obj_t **head_p,
+             memory_index_t *index)
+{
+    /* Fix new node */
+    new_node->offset = head->offset;
+    new_node->size = size;
+    new_node->prev = head->prev;
+    new_node->next = head;
+    /*new_node->ragasm is allocated and setup by the caller in the layer above */
+
+    /* Fix old node (ahead now). Its offset moves up, but not past the next node, so it keeps its
+     * place in the index. Its size changes, so it may belong in another free list.
+     */
+    memory_free_remove(head, index);
+    head->offset += size;
+    head->size -= size;
+    head->prev = new_node;
+    memory_free_insert(head, index);
+    memory_index_insert(new_node, index);
+
+    /* Fix node behind and test to see if the allocation was the first node, if so, point the memory
+     * node list head to it. ASSUMES that the only node with a NULL prev pointer is the head
+     */
+    if (new_node->prev) {
+        new_node->prev->next = new_node;
+    } else {
+        *head_p = new_node;
+    }
+    new_node->used = used;
+    if (!used)
+        memory_free_insert(new_node, index);
+}
+
 /*
  * This routine will deallocate a given memory object (node).
  * It will group the newly unused node with any adjacent unallocated nodes to
- * form one new node, freeing as needed.
+ * form one new node, freeing as needed. The nodes freed are taken out of the INDEX, and the resulting node is put on a
+ * free list.
  *
  * ragasm obj is assumed to be already unloaded/deallocated.
  * When grouping the newly deallocated node with adjacent unused nodes,
@@ -138,41 +190,186 @@ memory_alloc(SECMEM_INTERNAL_T size, fsm_descriptor_t *fsm_desc, secmem_obj_t **
  * it is mapped into, therefore we pass it in as a parameter.
  */
 int
-memory_dealloc(secmem_obj_t *node)
+memory_dealloc(secmem_obj_t *node, memory_index_t *index)
 {
     int ret = EXIT_FAILURE;
-    secmem_obj_t *tmp_node = node, *prev_node = node->prev , *next_node = node->next;
+    secmem_obj_t *prev_node = node->prev , *next_node = node->next;
 
     /* group with previous node, ony if not used */
     if (prev_node && !prev_node->used) {
+        memory_free_remove(prev_node, index);
         prev_node->size += node->size;
-        prev_node->next  = node->next;
+        prev_node->next  = next_node;
+        if (next_node)
+            next_node->prev = prev_node;
+        memory_index_remove(node, index);
+        free(node);
         node = prev_node;
     }
 
     /* group with next node, ony if not used */
     if (next_node && !next_node->used) {
+        memory_free_remove(next_node, index);
         node->size += next_node->size;
+        node->next = next_node->next;
         if (next_node->next)
             next_node->next->prev = node;
-        /* this relation is used as a predicate below to determine
-         * whether or not we need to free the next node when we are finished
-         * */
-        node->next = next_node->next;
-    }
-
-    /* Test if the original node was grouped into the previous node */
-    if (node == prev_node)
-        free(tmp_node);
-    /* Test if the next node was grouped into the  original/prev node*/
-    if (next_node && next_node->next == node->next)
+        memory_index_remove(next_node, index);
         free(next_node);
+    }
 
     node->used = FALSE;
+    memory_free_insert(node, index);
     ret = EXIT_SUCCESS;
     return ret;
 }
 
+/*
+ * Grow or shrink the used NODE to SIZE bytes where it is. It grows into the unused node after it, if that has room, and
+ * shrinks by handing the bytes at its end to the unused node after it (or to a new one). Fails, leaving everything as it
+ * was, if it cannot be done in place. The bytes given up are not zeroed, that is left to the caller.
+ */
+int
+memory_realloc(secmem_obj_t *node, SECMEM_INTERNAL_T size, memory_index_t *index)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *next_node = node->next, *tail;
+
+    if (size == node->size) {
+        ret = EXIT_SUCCESS;
+    } else if (size > node->size) {
+        if (next_node && !next_node->used && next_node->size >= size - node->size) {
+            memory_free_remove(next_node, index);
+            if (next_node->size == size - node->size) {
+                node->next = next_node->next;
+                if (next_node->next)
+                    next_node->next->prev = node;
+                memory_index_remove(next_node, index);
+                free(next_node);
+            } else {
+                /* its offset moves up, but not past the node after it, so it keeps its place in the index */
+                next_node->offset += size - node->size;
+                next_node->size -= size - node->size;
+                memory_free_insert(next_node, index);
+            }
+            node->size = size;
+            ret = EXIT_SUCCESS;
+        }
+    } else if (next_node && !next_node->used) {
+        /* its offset moves down, but not past NODE, so it keeps its place in the index */
+        memory_free_remove(next_node, index);
+        next_node->offset -= node->size - size;
+        next_node->size += node->size - size;
+        memory_free_insert(next_node, index);
+        node->size = size;
+        ret = EXIT_SUCCESS;
+    } else if ((tail = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t))) != NULL) {
+        tail->offset = node->offset + size;
+        tail->size = node->size - size;
+        tail->prev = node;
+        tail->next = next_node;
+        if (next_node)
+            next_node->prev = tail;
+        node->next = tail;
+        node->size = size;
+        memory_index_insert(tail, index);
+        memory_free_insert(tail, index);
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Grow or shrink a region from OLD_SIZE to NEW_SIZE bytes, at its end. Growing extends the unused node at the end, or
+ * appends one if the last node is used; shrinking takes the bytes off the unused node at the end, and fails if there
+ * are not that many there. Nothing is copied, no object moves. HEAD_P is unused, the head never changes.
+ */
+int
+memory_resize(SECMEM_INTERNAL_T old_size, SECMEM_INTERNAL_T new_size, secmem_obj_t **head_p, memory_index_t *index)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *tail = NULL, *node;
+
+    if (memory_index_floor(old_size - 1, &tail, index) != EXIT_SUCCESS || new_size == old_size) {
+        ret = tail ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (new_size > old_size) {
+        if (!tail->used) {
+            memory_free_remove(tail, index);
+            tail->size += new_size - old_size;
+            memory_free_insert(tail, index);
+            ret = EXIT_SUCCESS;
+        } else if ((node = (secmem_obj_t *) calloc(1, sizeof(secmem_obj_t))) != NULL) {
+            node->offset = old_size;
+            node->size = new_size - old_size;
+            node->prev = tail;
+            tail->next = node;
+            memory_index_insert(node, index);
+            memory_free_insert(node, index);
+            ret = EXIT_SUCCESS;
+        }
+    } else if (!tail->used && tail->size > old_size - new_size) {
+        memory_free_remove(tail, index);
+        tail->size -= old_size - new_size;
+        memory_free_insert(tail, index);
+        ret = EXIT_SUCCESS;
+    } else if (!tail->used && tail->size == old_size - new_size && tail->prev) {
+        memory_free_remove(tail, index);
+        memory_index_remove(tail, index);
+        tail->prev->next = NULL;
+        free(tail);
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Slide the used node after the unused node FREE_NODE down over it: the two swap places in the list and the index, so
+ * the used node starts where FREE_NODE did, and FREE_NODE is merged with the unused node after it, if there is one.
+ * Only the nodes move, the bytes are moved by the caller (see process_compact). HEAD_P is updated if the used node
+ * becomes the head.
+ */
+int
+memory_slide(secmem_obj_t *free_node, secmem_obj_t **head_p, memory_index_t *index)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *node = free_node->next, *next_node;
+
+    if (!free_node->used && node && node->used) {
+        memory_free_remove(free_node, index);
+        memory_index_remove(free_node, index);
+        memory_index_remove(node, index);
+        node->offset = free_node->offset;
+        free_node->offset = node->offset + node->size;
+
+        /* prev <-> free_node <-> node <-> next becomes prev <-> node <-> free_node <-> next */
+        node->prev = free_node->prev;
+        if (node->prev)
+            node->prev->next = node;
+        else
+            *head_p = node;
+        free_node->next = node->next;
+        if (free_node->next)
+            free_node->next->prev = free_node;
+        node->next = free_node;
+        free_node->prev = node;
+        memory_index_insert(node, index);
+        memory_index_insert(free_node, index);
+
+        if ((next_node = free_node->next) && !next_node->used) {
+            memory_free_remove(next_node, index);
+            free_node->size += next_node->size;
+            free_node->next = next_node->next;
+            if (next_node->next)
+                next_node->next->prev = free_node;
+            memory_index_remove(next_node, index);
+            free(next_node);
+        }
+        memory_free_insert(free_node, index);
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
 /*
  * Reading is carried out at the layer above (process), these routines are
  * stubs in case needed in the future.
@@ -197,16 +394,385 @@ memory_write(SECMEM_INTERNAL_T addr, secmem_obj_t *head)
 
 /* Get a memory object associated with a secmem vm address*/
 int
-memory_get_obj_by_addr(SECMEM_INTERNAL_T addr, secmem_obj_t  **node_p, secmem_obj_t *head)
+memory_get_obj_by_addr(SECMEM_INTERNAL_T addr, secmem_obj_t  **node_p, memory_index_t *index)
 {
     int ret = EXIT_FAILURE;
-    while (head && head->offset <= addr) {
-        if (head->offset == addr) {
-            *node_p = head;
-            ret = EXIT_SUCCESS;
-            break;
+    secmem_obj_t *node;
+    if (memory_index_floor(addr, &node, index) == EXIT_SUCCESS && node->offset == addr) {
+        *node_p = node;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/* Get the memory object a secmem vm address falls within, the address need not be the start of the object */
+int
+memory_get_obj_containing(SECMEM_INTERNAL_T addr, secmem_obj_t  **node_p, memory_index_t *index)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *node;
+    if (memory_index_floor(addr, &node, index) == EXIT_SUCCESS && addr - node->offset < node->size) {
+        *node_p = node;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+
+/*
+ * INDEX ROUTINES
+ *
+ * A plain AVL tree. The _at routines work on a subtree and return its (new) root.
+ */
+
+/* Height of a subtree, an empty one has none */
+int
+memory_index_height(secmem_obj_t *node)
+{
+    return node ? node->height : 0;
+}
+
+secmem_obj_t *
+memory_index_rotate_left(secmem_obj_t *node)
+{
+    secmem_obj_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    node->height = 1 + MAX(memory_index_height(node->left), memory_index_height(node->right));
+    right->height = 1 + MAX(memory_index_height(right->left), memory_index_height(right->right));
+    return right;
+}
+
+secmem_obj_t *
+memory_index_rotate_right(secmem_obj_t *node)
+{
+    secmem_obj_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    node->height = 1 + MAX(memory_index_height(node->left), memory_index_height(node->right));
+    left->height = 1 + MAX(memory_index_height(left->left), memory_index_height(left->right));
+    return left;
+}
+
+/* Restore the balance of a subtree whose children differ in height by two at most */
+secmem_obj_t *
+memory_index_balance(secmem_obj_t *node)
+{
+    int balance = memory_index_height(node->left) - memory_index_height(node->right);
+
+    if (balance > 1) {
+        if (memory_index_height(node->left->left) < memory_index_height(node->left->right))
+            node->left = memory_index_rotate_left(node->left);
+        node = memory_index_rotate_right(node);
+    } else if (balance < -1) {
+        if (memory_index_height(node->right->right) < memory_index_height(node->right->left))
+            node->right = memory_index_rotate_right(node->right);
+        node = memory_index_rotate_left(node);
+    } else {
+        node->height = 1 + MAX(memory_index_height(node->left), memory_index_height(node->right));
+    }
+    return node;
+}
+
+secmem_obj_t *
+memory_index_insert_at(secmem_obj_t *root, secmem_obj_t *node)
+{
+    if (!root)
+        return node;
+    if (node->offset < root->offset)
+        root->left = memory_index_insert_at(root->left, node);
+    else
+        root->right = memory_index_insert_at(root->right, node);
+    return memory_index_balance(root);
+}
+
+/* Take the node at OFFSET out of a subtree, its place is taken by its successor */
+secmem_obj_t *
+memory_index_remove_at(secmem_obj_t *root, SECMEM_INTERNAL_T offset)
+{
+    secmem_obj_t *successor;
+
+    if (!root)
+        return NULL;
+    if (offset < root->offset) {
+        root->left = memory_index_remove_at(root->left, offset);
+    } else if (offset > root->offset) {
+        root->right = memory_index_remove_at(root->right, offset);
+    } else if (!root->left || !root->right) {
+        return root->left ? root->left : root->right;
+    } else {
+        for (successor = root->right; successor->left; successor = successor->left)
+            ;
+        successor->right = memory_index_remove_at(root->right, successor->offset);
+        successor->left = root->left;
+        root = successor;
+    }
+    return memory_index_balance(root);
+}
+
+void
+memory_index_insert(secmem_obj_t *node, memory_index_t *index)
+{
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    index->root = memory_index_insert_at(index->root, node);
+}
+
+void
+memory_index_remove(secmem_obj_t *node, memory_index_t *index)
+{
+    if (index->last_hit == node)
+        index->last_hit = NULL;
+    index->root = memory_index_remove_at(index->root, node->offset);
+}
+
+/* Find the node with the greatest offset not above ADDR, trying the last one found first */
+int
+memory_index_floor(SECMEM_INTERNAL_T addr, secmem_obj_t **node_p, memory_index_t *index)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *node = index->last_hit, *floor = NULL;
+
+    if (node && node->offset <= addr && addr - node->offset < node->size) {
+        floor = node;
+    } else {
+        for (node = index->root; node; ) {
+            if (node->offset <= addr) {
+                floor = node;
+                node = node->right;
+            } else {
+                node = node->left;
+            }
+        }
+    }
+    if (floor) {
+        index->last_hit = floor;
+        *node_p = floor;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+
+/*
+ * FREE LIST ROUTINES
+ */
+
+/* The free list (first level FL, second level SL) that holds objects of SIZE */
+void
+memory_free_mapping(SECMEM_INTERNAL_T size, int *fl, int *sl)
+{
+    int msb;
+
+    if (size < MEMORY_SL_COUNT) {
+        *fl = 0;
+        *sl = (int) size;
+    } else {
+        msb = 63 - __builtin_clzll((unsigned long long) size);
+        *fl = msb - MEMORY_SL_BITS + 1;
+        *sl = (int) (size >> (msb - MEMORY_SL_BITS)) - MEMORY_SL_COUNT;
+    }
+}
+
+void
+memory_free_insert(secmem_obj_t *node, memory_index_t *index)
+{
+    int fl, sl;
+
+    memory_free_mapping(node->size, &fl, &sl);
+    node->free_prev = NULL;
+    node->free_next = index->free[fl][sl];
+    if (node->free_next)
+        node->free_next->free_prev = node;
+    index->free[fl][sl] = node;
+    index->fl_bitmap |= (uint64_t) 1 << fl;
+    index->sl_bitmap[fl] |= (uint32_t) 1 << sl;
+}
+
+void
+memory_free_remove(secmem_obj_t *node, memory_index_t *index)
+{
+    int fl, sl;
+
+    memory_free_mapping(node->size, &fl, &sl);
+    if (node->free_prev)
+        node->free_prev->free_next = node->free_next;
+    else
+        index->free[fl][sl] = node->free_next;
+    if (node->free_next)
+        node->free_next->free_prev = node->free_prev;
+    node->free_prev = NULL;
+    node->free_next = NULL;
+    if (!index->free[fl][sl]) {
+        index->sl_bitmap[fl] &= ~((uint32_t) 1 << sl);
+        if (!index->sl_bitmap[fl])
+            index->fl_bitmap &= ~((uint64_t) 1 << fl);
+    }
+}
+
+/*
+ * Find an unused node of at least SIZE. The size is rounded up to the next list boundary first, so that any node on
+ * the list found is large enough; a request that does not fit a list of its own exactly may therefore pass over a node
+ * that would just have fitted, for the sake of constant time. Returns NULL if there is none.
+ */
+secmem_obj_t *
+memory_free_find(SECMEM_INTERNAL_T size, memory_index_t *index)
+{
+    secmem_obj_t *node = NULL;
+    SECMEM_INTERNAL_T round = 0;
+    uint64_t fl_map;
+    uint32_t sl_map;
+    int fl, sl, msb;
+
+    if (size >= MEMORY_SL_COUNT) {
+        msb = 63 - __builtin_clzll((unsigned long long) size);
+        round = ((SECMEM_INTERNAL_T) 1 << (msb - MEMORY_SL_BITS)) - 1;
+    }
+    if (size > 0 && size + round >= size) {
+        memory_free_mapping(size + round, &fl, &sl);
+        sl_map = index->sl_bitmap[fl] & (~(uint32_t) 0 << sl);
+        if (!sl_map) {
+            /* nothing in this level, take the smallest list of the next non-empty one */
+            fl_map = fl + 1 < MEMORY_FL_COUNT ? index->fl_bitmap & (~(uint64_t) 0 << (fl + 1)) : 0;
+            if (fl_map) {
+                fl = __builtin_ctzll(fl_map);
+                sl_map = index->sl_bitmap[fl];
+            }
+        }
+        if (sl_map) {
+            sl = __builtin_ctz(sl_map);
+            node = index->free[fl][sl];
         }
-        head = head->next;
+    }
+    return node;
+}
+
+
+/*
+ * SLAB ROUTINES
+ */
+
+/* The slab size class of SIZE, -1 if it is too large for a slab */
+int
+memory_slab_class(SECMEM_INTERNAL_T size)
+{
+    int class = 0;
+
+    if (size == 0 || size > MEMORY_SLAB_MAX)
+        return -1;
+    while (((SECMEM_INTERNAL_T) 1 << (MEMORY_SLAB_MIN_SHIFT + class)) < size)
+        class++;
+    return class;
+}
+
+/* Put a slab on the list of its class */
+void
+memory_slab_link(memory_slab_t *slab, memory_index_t *index)
+{
+    int class = memory_slab_class(slab->slot_size);
+
+    slab->prev = NULL;
+    slab->next = index->slab[class];
+    if (slab->next)
+        slab->next->prev = slab;
+    index->slab[class] = slab;
+}
+
+void
+memory_slab_unlink(memory_slab_t *slab, memory_index_t *index)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        index->slab[memory_slab_class(slab->slot_size)] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+/*
+ * Allocate a slot for an object of SIZE under the policy FSM_DESC, from a slab of its class with a free slot or from
+ * a new slab allocated from the region (see memory_alloc for HEAD_P and INDEX). The slot's address is placed in ADDR_P
+ * and its FSM is in the start state.
+ */
+int
+memory_slab_alloc(SECMEM_INTERNAL_T size, fsm_descriptor_t *fsm_desc, SECMEM_INTERNAL_T *addr_p, secmem_obj_t **head_p,
+                  memory_index_t *index)
+{
+    int ret = EXIT_FAILURE, class = memory_slab_class(size), slot;
+    memory_slab_t *slab;
+    secmem_obj_t *node;
+
+    if (class < 0)
+        return EXIT_FAILURE;
+
+    for (slab = index->slab[class]; slab && slab->fsm_desc != fsm_desc; slab = slab->next)
+        ;
+    if (!slab && (slab = (memory_slab_t *) calloc(1, sizeof(memory_slab_t)))) {
+        slab->fsm_desc = fsm_desc;
+        slab->slot_size = (SECMEM_INTERNAL_T) 1 << (MEMORY_SLAB_MIN_SHIFT + class);
+        slab->slot_count = (int) (MEMORY_SLAB_SIZE / slab->slot_size);
+        if (memory_alloc(MEMORY_SLAB_SIZE, 0, fsm_desc, &node, head_p, index) == EXIT_SUCCESS) {
+            slab->node = node;
+            node->slab = slab;
+            memory_slab_link(slab, index);
+        } else {
+            free(slab);
+            slab = NULL;
+        }
+    }
+
+    if (slab) {
+        slot = __builtin_ctzll(~slab->used);
+        slab->used |= (uint64_t) 1 << slot;
+        slab->state[slot] = FSM_START_STATE;
+        ATOMIC_INC(&fsm_desc->ref_count);
+        if (MEMORY_SLAB_FULL(slab))
+            memory_slab_unlink(slab, index);
+        *addr_p = slab->node->offset + slot * slab->slot_size;
+        ret = EXIT_SUCCESS;
     }
     return ret;
-}
\ No newline at end of file
+}
+
+/*
+ * Free SLOT of SLAB. A full slab goes back on the list of its class, and an empty one is given back to the region
+ * (the caller is expected to have zeroed the slot, so the whole slab is zero by then).
+ */
+int
+memory_slab_dealloc(memory_slab_t *slab, int slot, memory_index_t *index)
+{
+    int ret = EXIT_SUCCESS;
+    secmem_obj_t *node = slab->node;
+
+    if (MEMORY_SLAB_FULL(slab))
+        memory_slab_link(slab, index);
+    slab->used &= ~((uint64_t) 1 << slot);
+    slab->state[slot] = FSM_NULL_STATE;
+    ATOMIC_DEC(&slab->fsm_desc->ref_count);
+
+    if (!slab->used) {
+        memory_slab_unlink(slab, index);
+        node->slab = NULL;
+        free(slab);
+        ret = memory_dealloc(node, index);
+    }
+    return ret;
+}
+
+/* Get the slot of SLAB a secmem vm address falls within, the slot must be in use */
+int
+memory_slab_slot(SECMEM_INTERNAL_T addr, memory_slab_t *slab, int *slot_p)
+{
+    int ret = EXIT_FAILURE;
+    SECMEM_INTERNAL_T slot = (addr - slab->node->offset) / slab->slot_size;
+
+    if (addr >= slab->node->offset && slot < (SECMEM_INTERNAL_T) slab->slot_count &&
+        (slab->used & ((uint64_t) 1 << slot))) {
+        *slot_p = (int) slot;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
@@ -36,9 +36,22 @@
  *  size (in bytes) of the region,
  *  pointers (prev/next) to traverse the memory nodes,
  *  a flag to indicate if the memory is in use (allocated) with respect to the secmem vm,
- *  a ragasm object which manages the FSM which expresses the policy applied to this memory object.
+ *  a ragasm object which manages the FSM which expresses the policy applied to this memory object,
+ *  the state of an open stream (see STREAM_OPEN in comm.h): its mode and the offset of the next chunk,
+ *  the read lease held on the object, if any (see lease.h): its id (0 for none) and omnius' descriptor of its file,
+ *  its place in the index of the process' memory objects (see memory_index_t), and in a free list while unused,
+ *  the slab it holds, if it is one (see memory_slab_t),
+ *  the handle it is known by in a process that uses handles (see PROCESS HANDLES in process.h), 0 for none,
+ *  the chunk of the global arena that holds its bytes, in a process that uses the arena (see arena.h), NULL otherwise,
+ *  whether it has been deallocated and is waiting for the scrubber (see scrub.h),
+ *  the alignment it was allocated with (see ALLOC OPTIONS in comm.h), its offset is kept a multiple of it,
+ *  the object it shares its bytes with, if it is a clone, and its place among the clones of that object (see PROCESS
+ *  CLONES in process.h),
+ *  when it was last touched, and its compressed bytes while it is compressed (see PROCESS COMPRESSION in process.h).
  *
  */
+struct memory_slab_t;
+
 typedef struct secmem_obj_t
 {
     SECMEM_INTERNAL_T offset;
@@ -47,23 +60,148 @@ typedef struct secmem_obj_t
     struct secmem_obj_t *next;
     char used;
     ragasm_t ragasm;
+    char stream_mode;
+    SECMEM_INTERNAL_T stream_pos;
+    SECMEM_INTERNAL_T lease_id;
+    int lease_fd;
+    struct secmem_obj_t *left;
+    struct secmem_obj_t *right;
+    int height;
+    struct secmem_obj_t *free_prev;
+    struct secmem_obj_t *free_next;
+    struct memory_slab_t *slab;
+    SECMEM_INTERNAL_T handle;
+    struct secmem_obj_t *chunk;
+    char scrub;
+    SECMEM_INTERNAL_T align;
+    struct secmem_obj_t *cow_src;   /* the source of a clone, NULL for any other object */
+    struct secmem_obj_t *cow_prev;  /* the source or the previous clone, for a clone */
+    struct secmem_obj_t *cow_next;  /* the next clone of the same source, or the first one for a source */
+    SECMEM_INTERNAL_T atime;        /* msec, see process_now */
+    char *lz_data;                  /* the compressed bytes, NULL unless it is compressed */
+    SECMEM_INTERNAL_T lz_size;
+    char lz_skip;                   /* TRUE if it did not compress, until it is next written */
 } secmem_obj_t;
 
+/* Bytes from OFFSET up to the next multiple of ALIGN, a power of two */
+#define MEMORY_ALIGN_PAD(_offset, _align) ((SECMEM_INTERNAL_T) -(_offset) & ((SECMEM_INTERNAL_T) (_align) - 1))
+
+/*
+ * Small objects are not given a memory object each, they are slots of a slab. A slab is a (used) memory object of
+ * MEMORY_SLAB_SIZE bytes split into slots of one size class, all under the same policy. What a slot needs is kept out
+ * of band here: a bit in USED, and the state of its FSM (a single STATE_T instead of a ragasm_t). Slots take a
+ * reference on the fsm descriptor each, as a ragasm does.
+ *
+ * The size classes are the powers of two from 1 << MEMORY_SLAB_MIN_SHIFT up to MEMORY_SLAB_MAX. Slabs with free slots
+ * are kept on a list per class in the memory index; an empty slab is given back to the region at once. When there is
+ * no room left in the region for a new slab, a small object is given a memory object of its own after all.
+ *
+ * A slot can be read and written like any object (at any address inside it), but it cannot be streamed or leased.
+ */
+#define MEMORY_SLAB_SLOTS 64 /* bits in USED, the most slots a slab can have */
+#define MEMORY_SLAB_MIN_SHIFT 3
+#define MEMORY_SLAB_CLASS_COUNT 4
+#define MEMORY_SLAB_MAX (1 << (MEMORY_SLAB_MIN_SHIFT + MEMORY_SLAB_CLASS_COUNT - 1))
+#define MEMORY_SLAB_SIZE 512 /* at most MEMORY_SLAB_SLOTS slots of the smallest class */
+#define MEMORY_SLAB_FULL(_pslab) ((_pslab)->used == (((_pslab)->slot_count == MEMORY_SLAB_SLOTS) ? \
+                                                     ~(uint64_t) 0 : ((uint64_t) 1 << (_pslab)->slot_count) - 1))
+
+typedef struct memory_slab_t
+{
+    secmem_obj_t *node;             /* the memory object the slots are in */
+    struct memory_slab_t *prev;     /* slabs of the same class with free slots */
+    struct memory_slab_t *next;
+    fsm_descriptor_t *fsm_desc;
+    SECMEM_INTERNAL_T slot_size;
+    int slot_count;
+    uint64_t used;
+    STATE_T state[MEMORY_SLAB_SLOTS];
+} memory_slab_t;
+
+/*
+ * Free lists are segregated by size in two levels (TLSF): the first level is the power of two below the size, the
+ * second splits each power of two into MEMORY_SL_COUNT equal ranges. Sizes below MEMORY_SL_COUNT have a list each.
+ */
+#define MEMORY_SL_BITS 4
+#define MEMORY_SL_COUNT (1 << MEMORY_SL_BITS)
+#define MEMORY_FL_COUNT (SECMEM_INTERNAL_BIT - MEMORY_SL_BITS + 1)
+
+/*
+ * An ordered index over all the memory objects (used or not) of a process, so that the object an address falls in is
+ * found without walking the list. It is an AVL tree keyed by offset, threaded through the objects themselves (left,
+ * right, height) so that it costs no allocations of its own. Since objects never overlap, the object containing an
+ * address is the one with the greatest offset not above it.
+ *
+ * LAST_HIT is the object the last lookup found; a process tends to access the same object several times in a row, in
+ * which case the tree is not searched at all. The index is only ever used by the worker that owns the process.
+ *
+ * The unused objects are also indexed by size, in the free lists (FREE). A bit is set in FL_BITMAP for each first level
+ * with a non-empty list, and in SL_BITMAP[fl] for each non-empty list of that level, so the smallest list that holds a
+ * fitting object is found with a couple of bit scans and an allocation never looks at more than one object.
+ *
+ * SLAB holds the slabs with free slots, by size class.
+ */
+typedef struct memory_index_t
+{
+    secmem_obj_t *root;
+    secmem_obj_t *last_hit;
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[MEMORY_FL_COUNT];
+    secmem_obj_t *free[MEMORY_FL_COUNT][MEMORY_SL_COUNT];
+    memory_slab_t *slab[MEMORY_SLAB_CLASS_COUNT];
+} memory_index_t;
+
+/*
+ * A placement strategy: how the objects of a process are laid out in its region. Each process uses one, chosen when
+ * it loads (see LOAD OPTIONS in comm.h), through which it loads its region and allocates and deallocates objects.
+ * They all keep the same node list and index (used for lookups and the free lists), so everything else is the same
+ * whichever is used. ALLOC places an object at an offset that is a multiple of the alignment it is given. REALLOC grows
+ * or shrinks an object where it is, or fails if it cannot (see REALLOC in comm.h). SLABS tells whether small objects
+ * are put in slabs, which are carved with memory_alloc. RESIZE grows or shrinks the region at its end (see RESIZE in
+ * comm.h).
+ */
+typedef struct memory_strategy_t
+{
+    const char *name;
+    int (*load) (SECMEM_INTERNAL_T, secmem_obj_t **, memory_index_t *);
+    int (*alloc) (SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, fsm_descriptor_t *, secmem_obj_t **, secmem_obj_t **,
+                  memory_index_t *);
+    int (*dealloc) (secmem_obj_t *, memory_index_t *);
+    int (*realloc) (secmem_obj_t *, SECMEM_INTERNAL_T, memory_index_t *);
+    int (*resize) (SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, secmem_obj_t **, memory_index_t *);
+    char slabs;
+} memory_strategy_t;
+
+
+int
+memory_get_obj_by_addr(SECMEM_INTERNAL_T, secmem_obj_t  **, memory_index_t *);
 
 int
-memory_get_obj_by_addr(SECMEM_INTERNAL_T, secmem_obj_t  **, secmem_obj_t *);
+memory_get_obj_containing(SECMEM_INTERNAL_T, secmem_obj_t  **, memory_index_t *);
 
 int
-memory_load(SECMEM_INTERNAL_T, secmem_obj_t **);
+memory_load(SECMEM_INTERNAL_T, secmem_obj_t **, memory_index_t *);
 
 int
-memory_unload(secmem_obj_t *);
+memory_unload(secmem_obj_t *, memory_index_t *);
 
 int
-memory_alloc(SECMEM_INTERNAL_T, fsm_descriptor_t *, secmem_obj_t **, secmem_obj_t **);
+memory_alloc(SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, fsm_descriptor_t *, secmem_obj_t **, secmem_obj_t **, memory_index_t *);
+
+void
+memory_split(secmem_obj_t *, SECMEM_INTERNAL_T, char, secmem_obj_t *, secmem_obj_t **, memory_index_t *);
 
 int
-memory_dealloc(secmem_obj_t *);
+memory_dealloc(secmem_obj_t *, memory_index_t *);
+
+int
+memory_realloc(secmem_obj_t *, SECMEM_INTERNAL_T, memory_index_t *);
+
+int
+memory_resize(SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, secmem_obj_t **, memory_index_t *);
+
+int
+memory_slide(secmem_obj_t *, secmem_obj_t **, memory_index_t *);
 
 int
 memory_read(SECMEM_INTERNAL_T, char *, secmem_obj_t *);
@@ -71,4 +209,64 @@ memory_read(SECMEM_INTERNAL_T, char *, secmem_obj_t *);
 int
 memory_write(SECMEM_INTERNAL_T, secmem_obj_t *);
 
+/* Index (AVL tree) routines, see memory_index_t */
+int
+memory_index_height(secmem_obj_t *);
+
+secmem_obj_t *
+memory_index_rotate_left(secmem_obj_t *);
+
+secmem_obj_t *
+memory_index_rotate_right(secmem_obj_t *);
+
+secmem_obj_t *
+memory_index_balance(secmem_obj_t *);
+
+secmem_obj_t *
+memory_index_insert_at(secmem_obj_t *, secmem_obj_t *);
+
+secmem_obj_t *
+memory_index_remove_at(secmem_obj_t *, SECMEM_INTERNAL_T);
+
+void
+memory_index_insert(secmem_obj_t *, memory_index_t *);
+
+void
+memory_index_remove(secmem_obj_t *, memory_index_t *);
+
+int
+memory_index_floor(SECMEM_INTERNAL_T, secmem_obj_t **, memory_index_t *);
+
+/* Free list routines, see memory_index_t */
+void
+memory_free_mapping(SECMEM_INTERNAL_T, int *, int *);
+
+void
+memory_free_insert(secmem_obj_t *, memory_index_t *);
+
+void
+memory_free_remove(secmem_obj_t *, memory_index_t *);
+
+secmem_obj_t *
+memory_free_find(SECMEM_INTERNAL_T, memory_index_t *);
+
+/* Slab routines, see memory_slab_t */
+int
+memory_slab_class(SECMEM_INTERNAL_T);
+
+int
+memory_slab_alloc(SECMEM_INTERNAL_T, fsm_descriptor_t *, SECMEM_INTERNAL_T *, secmem_obj_t **, memory_index_t *);
+
+int
+memory_slab_dealloc(memory_slab_t *, int, memory_index_t *);
+
+int
+memory_slab_slot(SECMEM_INTERNAL_T, memory_slab_t *, int *);
+
+void
+memory_slab_link(memory_slab_t *, memory_index_t *);
+
+void
+memory_slab_unlink(memory_slab_t *, memory_index_t *);
+
 #endif /* SECMEM_MEMORY_H */
@@ -7,11 +7,14 @@
  *
  * 2015 - Mike Clark
  */
+#define _GNU_SOURCE /* struct msginfo */
 #include <stdlib.h>
 #include <string.h>
 #include <sys/msg.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
 #include "global.h"
 #include "omnius.h"
 #include "process.h"
@@ -43,6 +46,26 @@ secmem_process_t *g_pid_lookup[MAX_PID];
  */
 int (*g_dispatch[MTYPE_COUNT]) (blob_t *);
 
+/* Largest chunk accepted by the STREAM messages, see stream_chunk_size() */
+SECMEM_INTERNAL_T g_stream_chunk;
+
+/* The transports requests arrive on, indexed by kind (see transport.h). The message queue is always open; the socket
+ * only when a path was given. Set g_terminate to leave omnius_listen().
+ */
+transport_t g_transports[TRANSPORT_COUNT];
+char *g_socket_path;
+int g_terminate;
+
+/* Size of the global arena processes may load into (see arena.h), none if 0 */
+SECMEM_INTERNAL_T g_arena_size;
+
+/* Loaded processes that compress their idle objects (see omnius_sweep) */
+SECMEM_INTERNAL_T g_lz_procs;
+
+/* Worker threads requests are sharded across by pid, see omnius_shard(). None by default. */
+omnius_worker_t g_workers[OMNIUS_MAX_WORKERS];
+int g_worker_count;
+
 /* Catch user interrupt and shutdown gracefully */
 struct sigaction g_int_act, g_int_oldact;
 
@@ -53,16 +76,21 @@ int
 omnius_load(blob_t *blob) {
     int ret = EXIT_FAILURE;
 
-    if (!g_pid_lookup[blob->head.pid]) {
+    if (!ATOMIC_LOAD(&g_pid_lookup[blob->head.pid])) {
          /* create a proc based on pid */
         secmem_process_t *proc = (secmem_process_t *) calloc(1, sizeof(secmem_process_t));
         if (proc) {
             if ((ret = process_load(blob, proc)) == EXIT_SUCCESS) {
                 /* If we are successful, add the process object to a global lookup table for future reference, otherwise free mem */
-                g_pid_lookup[blob->head.pid] = proc;
-            } else {
-                free(proc);
+                if (!ATOMIC_CAS(&g_pid_lookup[blob->head.pid], NULL, proc)) {
+                    process_unload(blob, proc);
+                    ret = EXIT_FAILURE;
+                } else if (proc->lz_idle) {
+                    ATOMIC_INC(&g_lz_procs);
+                }
             }
+            if (ret != EXIT_SUCCESS)
+                free(proc);
         }
     }
 
@@ -76,15 +104,15 @@ int
 omnius_unload(blob_t *blob) {
     int ret = EXIT_FAILURE;
 
-    /* find the proc based on pid */
-    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    /* find the proc based on pid, and take it out of the lookup table */
+    secmem_process_t *proc = ATOMIC_XCHG(&g_pid_lookup[blob->head.pid], NULL);
     if (proc) {
+        if (proc->lz_idle)
+            ATOMIC_DEC(&g_lz_procs);
         ret = process_unload(blob, proc);
         free(proc);
     }
 
-    g_pid_lookup[blob->head.pid] = NULL;
-
     return ret;
 }
 
@@ -115,12 +143,61 @@ omnius_dealloc(blob_t *blob) {
 
     /* find the proc based on pid */
     secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
 
     /* validate and process*/
-    if (proc &&  blob->head.addr >= 0 && blob->head.addr < proc->mem_size) {
+    if (proc && process_translate(proc, &blob->head.addr) == EXIT_SUCCESS &&
+        blob->head.addr >= 0 && blob->head.addr < proc->mem_size) {
         ret = process_dealloc(blob, proc);
     }
 
+    /* the reply carries the addr as it was asked for, not what it stood for */
+    blob->head.addr = addr;
+    return ret;
+}
+
+/*
+ *  This is the entry point for reallocating secure memory, see REALLOC in comm.h.
+ */
+int
+omnius_realloc(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
+
+    /* validate and process */
+    if (proc && blob->head.new_size > 0 && blob->head.new_size <= proc->mem_size &&
+        process_translate(proc, &blob->head.addr) == EXIT_SUCCESS && blob->head.addr < proc->mem_size) {
+        ret = process_realloc(blob, proc);
+    }
+
+    /* a NAK carries the addr as it was asked for */
+    if (ret != EXIT_SUCCESS)
+        blob->head.addr = addr;
+    return ret;
+}
+
+/*
+ *  This is the entry point for cloning secure memory, see CLONE in comm.h.
+ */
+int
+omnius_clone(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
+
+    /* validate and process */
+    if (proc && process_translate(proc, &blob->head.addr) == EXIT_SUCCESS && blob->head.addr < proc->mem_size) {
+        ret = process_clone(blob, proc);
+    }
+
+    /* a NAK carries the addr as it was asked for */
+    if (ret != EXIT_SUCCESS)
+        blob->head.addr = addr;
     return ret;
 }
 
@@ -133,13 +210,17 @@ omnius_read(blob_t *blob) {
 
     /* find the proc based on pid */
     secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
 
     /* validate and process*/
-    if (proc &&  blob->head.addr >= 0 && blob->head.addr < proc->mem_size && blob->head.data_len > 0) {
+    if (proc && process_translate(proc, &blob->head.addr) == EXIT_SUCCESS &&
+        blob->head.addr >= 0 && blob->head.addr < proc->mem_size && blob->head.data_len > 0) {
         /* assuming success, the process routine will stuff the data read into the data field of the blob
          * */
         ret = process_read(blob, proc);
     }
+    /* the reply carries the addr as it was asked for, not what it stood for */
+    blob->head.addr = addr;
     return ret;
 }
 
@@ -152,11 +233,176 @@ omnius_write(blob_t *blob) {
 
     /* find the proc based on pid */
     secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
 
     /* validate */
-    if (proc &&  blob->head.addr >= 0 && blob->head.addr < proc->mem_size && blob->head.data_len > 0) {
+    if (proc && process_translate(proc, &blob->head.addr) == EXIT_SUCCESS &&
+        blob->head.addr >= 0 && blob->head.addr < proc->mem_size && blob->head.data_len > 0) {
         ret = process_write(blob, proc);
     }
+    /* the reply carries the addr as it was asked for, not what it stood for */
+    blob->head.addr = addr;
+    return ret;
+}
+
+/*
+ *  This is the entry point for opening a read or write stream over a secure memory object.
+ *  The reply tells the client how large its chunks may be.
+ */
+int
+omnius_stream_open(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
+
+    /* validate and process*/
+    if (proc && process_translate(proc, &blob->head.addr) == EXIT_SUCCESS &&
+        blob->head.addr < proc->mem_size) {
+        ret = process_stream_open(blob, proc);
+    }
+    blob->head.chunk_size = ret == EXIT_SUCCESS ? g_stream_chunk : 0;
+    /* the reply carries the addr as it was asked for, not what it stood for */
+    blob->head.addr = addr;
+    return ret;
+}
+
+/*
+ *  This is the entry point for reading the next chunk of a stream.
+ */
+int
+omnius_stream_read(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
+
+    /* validate and process*/
+    if (proc && process_translate(proc, &blob->head.addr) == EXIT_SUCCESS &&
+        blob->head.addr < proc->mem_size && blob->head.data_len > 0 && blob->head.data_len <= g_stream_chunk) {
+        ret = process_stream_read(blob, proc);
+    }
+    /* the reply carries the addr as it was asked for, not what it stood for */
+    blob->head.addr = addr;
+    return ret;
+}
+
+/*
+ *  This is the entry point for writing the next chunk of a stream.
+ */
+int
+omnius_stream_write(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
+
+    /* validate and process*/
+    if (proc && process_translate(proc, &blob->head.addr) == EXIT_SUCCESS &&
+        blob->head.addr < proc->mem_size && blob->head.data_len > 0 && blob->head.data_len <= g_stream_chunk) {
+        ret = process_stream_write(blob, proc);
+    }
+    /* the reply carries the addr as it was asked for, not what it stood for */
+    blob->head.addr = addr;
+    return ret;
+}
+
+/*
+ *  This is the entry point for reading several objects in one message, see VECTOR STRUCTURES in comm.h.
+ */
+int
+omnius_readv(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+    size_t data_size;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+
+    /* validate and process */
+    if (proc && vec_check(blob, &data_size) == EXIT_SUCCESS &&
+        blob->head.data_len == blob->head.op_count * sizeof(vec_entry_t)) {
+        ret = process_vec(blob, proc, READ_CHAR);
+    }
+    return ret;
+}
+
+/*
+ *  This is the entry point for writing several objects in one message, see VECTOR STRUCTURES in comm.h.
+ */
+int
+omnius_writev(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+    size_t data_size;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+
+    /* validate and process */
+    if (proc && vec_check(blob, &data_size) == EXIT_SUCCESS &&
+        blob->head.data_len == blob->head.op_count * sizeof(vec_entry_t) + data_size) {
+        ret = process_vec(blob, proc, WRITE_CHAR);
+    }
+    return ret;
+}
+
+/*
+ *  This is the entry point for leasing a read-only object, see lease.h.
+ */
+int
+omnius_lease(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
+
+    /* validate and process */
+    if (proc && process_translate(proc, &blob->head.addr) == EXIT_SUCCESS &&
+        blob->head.addr < proc->mem_size) {
+        ret = process_lease(blob, proc);
+    }
+    if (ret != EXIT_SUCCESS) {
+        blob->head.addr = addr;
+        blob->head.data_len = 0;
+    }
+    return ret;
+}
+
+/*
+ * The descriptor of the lease file granted by the LEASE reply in BLOB, to be passed with the reply, or -1. Only called
+ * by the thread that ran the LEASE, before anything else can revoke the lease.
+ */
+int
+omnius_lease_fd(blob_t *blob)
+{
+    int fd = -1;
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+    SECMEM_INTERNAL_T addr = blob->head.addr;
+    secmem_obj_t *node;
+
+    if (proc && process_translate(proc, &addr) == EXIT_SUCCESS &&
+        memory_get_obj_containing(addr, &node, &proc->secmem_index) == EXIT_SUCCESS && node->lease_id)
+        fd = node->lease_fd;
+    return fd;
+}
+
+/*
+ *  This is the entry point for growing or shrinking the region of a process, see RESIZE in comm.h.
+ */
+int
+omnius_resize(blob_t *blob) {
+    int ret = EXIT_FAILURE;
+
+    /* find the proc based on pid */
+    secmem_process_t *proc = g_pid_lookup[blob->head.pid];
+
+    /* validate and process */
+    if (proc && blob->head.size > 0) {
+        ret = process_resize(blob, proc);
+    }
     return ret;
 }
 
@@ -172,7 +418,28 @@ omnius_view_internal(blob_t *blob) {
     /* validate */
     if (proc) {
         /* pid, mem_size */
-        printf("PID:\t%d\n\tTotal Size: 0x%lx\n", proc->pid, proc->mem_size);
+        printf("PID:\t%d\n\tTotal Size: 0x%lx\n\tStrategy: %s\n", proc->pid, proc->mem_size, proc->strategy->name);
+        /* backing of this process, and the counters of each mode over all of them */
+        printf("\tBacking: 0x%lx (mapped 0x%zx)\n\tmode\tprocs\tbytes\tfallback\tfailed\n", proc->backing,
+               proc->map_size);
+        if (proc->handles)
+            printf("\tHandles: 0x%lx slots, compact below 0x%lx\n", proc->handle_count, proc->compact_pos);
+        SECMEM_INTERNAL_T arena_size, arena_used, arena_chunks;
+        if (proc->arena && process_arena_stats(&arena_size, &arena_used, &arena_chunks) == EXIT_SUCCESS)
+            printf("\tArena: 0x%lx of 0x%lx used, %lu chunks\n", arena_used, arena_size, arena_chunks);
+        /* what compressing idle objects saves, and what decompressing them costs */
+        if (proc->lz_idle)
+            printf("\tCompress: idle %lu ms, %lu objects 0x%lx -> 0x%lx bytes, %lu compressed, %lu skipped, "
+                   "%lu restored in %lu ns avg, %lu ns max\n", proc->lz_idle, proc->lz.objects, proc->lz.bytes,
+                   proc->lz.stored, proc->lz.compressed, proc->lz.skipped, proc->lz.restored,
+                   proc->lz.restored ? proc->lz.restore_nsec / proc->lz.restored : 0, proc->lz.restore_max_nsec);
+        for (int i = 0; i < LOAD_BACKING_BITS; i++) {
+            const char *name;
+            process_backing_stats_t stats;
+            if (process_backing_stats(i, &name, &stats) == EXIT_SUCCESS)
+                printf("\t%s%c\t%lu\t0x%lx\t%lu\t%lu\n", name, (proc->backing & (1 << i)) ? '*' : ' ', stats.procs,
+                       stats.bytes, stats.fallbacks, stats.failures);
+        }
         for (int i = 0; i < proc->fsm_count; i++)
             printf("\tPolicy: %d\n\t\tRegex: %s\n\t\tRef Count: %zu\n", i, proc->fsm_desc[i].comment, (size_t) proc->fsm_desc[i].ref_count);
         /* memory */
@@ -180,7 +447,12 @@ omnius_view_internal(blob_t *blob) {
         secmem_obj_t *head = proc->secmem_head;
         while(head) {
             printf("\t0x%lx\t0x%lx\t0x%lx\t", head->offset, head->offset + head->size - 1, head->size);
-            printf("%c\t%s\t%zu\n", head->used ? 'X' : ' ', (head->ragasm.fsm_desc && head->ragasm.fsm_desc->comment)? head->ragasm.fsm_desc->comment : "" , (size_t) head->ragasm.curr_state);
+            if (head->slab)
+                /* a slab: the slots in use instead of a state */
+                printf("S\t%s\t%d/%d x 0x%lx\n", head->slab->fsm_desc->comment ? head->slab->fsm_desc->comment : "",
+                       __builtin_popcountll(head->slab->used), head->slab->slot_count, (size_t) head->slab->slot_size);
+            else
+                printf("%c\t%s\t%zu\n", head->scrub ? 'Z' : head->cow_src ? 'C' : head->lz_data ? 'L' : head->used ? 'X' : ' ', (head->ragasm.fsm_desc && head->ragasm.fsm_desc->comment)? head->ragasm.fsm_desc->comment : "" , (size_t) head->ragasm.curr_state);
             head = head->next;
         }
         printf("\n");
@@ -203,68 +475,500 @@ omnius_nil(blob_t *blob)
 
 
 /*
- * Listen for incoming messages on the ipc_in message queue.
- *
+ * Describe this build of omnius, see hello_t. If the client described itself, the wire versions offered are narrowed to
+ * those both sides speak.
+ */
+int
+omnius_hello(blob_t *blob)
+{
+    hello_t hello, peer;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.versions = HELLO_VERSION(1) | HELLO_VERSION(BLOB_V2_VERSION);
+    hello.internal_bit = SECMEM_INTERNAL_BIT;
+    hello.max_data = MAX_BLOB_DATA_SIZE;
+    hello.stream_chunk = (uint32_t) g_stream_chunk;
+    if (blob->head.data_len >= sizeof(hello_t)) {
+        memcpy(&peer, blob->body.data, sizeof(peer));
+        hello.versions &= peer.versions;
+    }
+
+    /* REPLY */
+    memcpy(blob->body.data, &hello, sizeof(hello));
+    blob->head.data_len = sizeof(hello);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Attach a ring pair created by a client (see ring.h).
+ * The reply carries the id of the doorbell segment the client must ring after pushing a request.
+ */
+int
+omnius_attach(blob_t *blob)
+{
+    int ret = EXIT_FAILURE;
+    int bell_shmid;
+
+    pthread_mutex_lock(&g_transports[TRANSPORT_RING].lock);
+    if ((ret = transport_ring_attach((int) blob->head.shmid, blob->head.pid, &bell_shmid,
+                                     &g_transports[TRANSPORT_RING])) == EXIT_SUCCESS)
+        blob->head.shmid = (SECMEM_INTERNAL_T) bell_shmid;
+    pthread_mutex_unlock(&g_transports[TRANSPORT_RING].lock);
+
+    /* REPLY */
+    blob->head.data_len = 0;
+    return ret;
+}
+
+/*
+ * Detach a ring pair by its segment id.
+ */
+int
+omnius_detach(blob_t *blob)
+{
+    int ret;
+
+    pthread_mutex_lock(&g_transports[TRANSPORT_RING].lock);
+    ret = transport_ring_detach((int) blob->head.shmid, blob->head.pid, &g_transports[TRANSPORT_RING]);
+    pthread_mutex_unlock(&g_transports[TRANSPORT_RING].lock);
+
+    /* REPLY */
+    blob->head.data_len = 0;
+    return ret;
+}
+
+/*
+ * Run the sub-requests of a BATCH in order, replacing each entry with its reply (see comm.h).
  *
- * msgbuf_t instances mtext field are of fixed size (MAX_MTEXT_SIZE)
+ * The whole batch is validated before anything is run. Replies are written over the entries in place; a reply is
+ * never larger than its request, so the write offset never overtakes the entry about to be read.
  */
+int
+omnius_batch(blob_t *blob)
+{
+    int ret = EXIT_FAILURE, abort = FALSE, sub_ret;
+    size_t in_off = 0, out_off = 0, n = 0;
+    SECMEM_INTERNAL_T last_addr = 0, in_len;
+    batch_head_t entry;
+    char *data;
+    blob_t sub;
+
+    while (batch_next(blob, &in_off, &entry, &data) == EXIT_SUCCESS)
+        n++;
+
+    if (n == blob->head.op_count && in_off == blob->head.data_len) {
+        in_off = 0;
+        while (batch_next(blob, &in_off, &entry, &data) == EXIT_SUCCESS) {
+            sub_ret = EXIT_FAILURE;
+            in_len = entry.head.data_len;
+            sub.head = entry.head;
+            if (!abort &&
+                entry.mtype < MTYPE_COUNT && g_dispatch[entry.mtype] &&
+                entry.mtype != MTYPE_BATCH && entry.mtype != MTYPE_TERMINATE && entry.mtype != MTYPE_READV &&
+                entry.mtype != MTYPE_LEASE && entry.mtype != MTYPE_ATTACH && entry.mtype != MTYPE_DETACH &&
+                entry.head.pid == blob->head.pid) {
+                if (entry.flags & BATCH_FLAG_LAST_ADDR)
+                    sub.head.addr += last_addr;
+                memcpy(sub.body.data, data, in_len);
+                sub_ret = g_dispatch[entry.mtype](&sub);
+                if (sub_ret == EXIT_SUCCESS && entry.mtype == MTYPE_ALLOC)
+                    last_addr = sub.head.addr;
+            }
+            if (sub_ret != EXIT_SUCCESS || sub.head.data_len > in_len) {
+                sub_ret = EXIT_FAILURE;
+                sub.head.data_len = 0;
+                if (entry.flags & BATCH_FLAG_ABORT)
+                    abort = TRUE;
+            }
+
+            /* REPLY ENTRY */
+            entry.mtype |= sub_ret == EXIT_SUCCESS ? MTYPE_MOD_ACK : MTYPE_MOD_NAK;
+            entry.head = sub.head;
+            memcpy(blob->body.data + out_off, &entry, sizeof(entry));
+            memcpy(blob->body.data + out_off + sizeof(entry), sub.body.data, sub.head.data_len);
+            out_off += SIZEOF_BATCH_ENTRY(&entry);
+        }
+        ret = EXIT_SUCCESS;
+    }
 
+    /* REPLY */
+    blob->head.data_len = ret == EXIT_SUCCESS ? out_off : 0;
+    return ret;
+}
+
+/*
+ * Turn a request into its reply header: the mtype is OR'd with an ACK or NAK depending on RET, and the reply is routed
+ * by the request's token if it has one (see MTYPE_TOKEN_MIN). The request id is left untouched so it is echoed back.
+ */
+void
+omnius_reply(msgbuf_t *msg_buf, int ret)
+{
+    SECMEM_INTERNAL_T token = msg_buf->blob.head.token;
+
+    if (ret != EXIT_SUCCESS)
+        msg_buf->blob.head.data_len = 0;
+
+    /* Change message-type depending on the success of the event. */
+    msg_buf->mtype = msg_buf->mtype | (ret == EXIT_SUCCESS ? MTYPE_MOD_ACK : MTYPE_MOD_NAK);
+
+    if (IS_TOKEN(token)) {
+        msg_buf->blob.head.reply_mtype = (SECMEM_INTERNAL_T) msg_buf->mtype;
+        msg_buf->mtype = (long) token;
+    }
+}
+
+/*
+ * Log and dispatch a single request. The message buffer is turned into the reply in place, see omnius_reply.
+ */
 int
-listen(int ipc_in, int ipc_out)
+omnius_handle(msgbuf_t *msg_buf)
 {
-    msgbuf_t msg_buf;
     char log_buf[MAX_HUMANIZE_LEN];
     int ret = EXIT_FAILURE;
 
-    //msgbuf_t msg_request, msg_reply;
-    //memset(&msg_request, 0, sizeof(msg_request));
-    //memset(&msg_reply, 0, sizeof(msg_reply));
+    humanize_blob(msg_buf, log_buf, sizeof(log_buf));
+    fprintf(g_logfile, "\n<<<REQUEST<<<\n%s\n<<<<<<<<<<<<<\n", log_buf);
 
-    while (1) {
-        /* ZERO out the buffer */
-        memset(&msg_buf, 0, sizeof(msg_buf));
+    /* It is crucial that we bounds check the mtype and the pid because we are using them to index into fixed
+     * sized arrays -- i.e. overflow.
+     */
+    if (msg_buf->mtype >= 0 && msg_buf->mtype < MTYPE_COUNT && g_dispatch[msg_buf->mtype] &&
+        msg_buf->blob.head.pid >= 0 && msg_buf->blob.head.pid < MAX_PID) {
+        /* ACTION */
+        ret = g_dispatch[msg_buf->mtype](&msg_buf->blob);
+    }
+    omnius_reply(msg_buf, ret);
 
-        /* LISTEN */
-        if ((msgrcv(ipc_in, &msg_buf, MAX_MTEXT_SIZE, 0, 0) == -1) && (SIZEOF_BLOB(&msg_buf.blob) <= MAX_MTEXT_SIZE)) {
-            perror("msgrcv");
-            continue;
+    humanize_blob(msg_buf, log_buf, sizeof(log_buf));
+    fprintf(g_logfile, "\n>>>>REPLY>>>>\n%s\n>>>>>>>>>>>>>\n", log_buf);
+    return ret;
+}
+
+/*
+ * Run a request and turn it into the reply to send back, in the wire version the request arrived in. WIRE is scratch
+ * space for a v2 reply (it may be the buffer the request arrived in). If REFUSE is set the request is not run and is
+ * answered with a NAK. Returns the buffer to reply with.
+ */
+msgbuf_t *
+omnius_complete(omnius_job_t *job, msgbuf_t *wire, int refuse)
+{
+    msgbuf_t *reply = job->req;
+    long mtype = job->req->mtype;
+    pid_t peer;
+
+    /*
+     * Rings are only managed over the message queue, since that is what they are bootstrapped from. A lease is only
+     * passed to the process it is for, over a transport that can pass its file descriptor (see lease.h).
+     */
+    job->fd = -1;
+    if (refuse ||
+        (job->t->kind != TRANSPORT_MSGQ && (mtype == MTYPE_ATTACH || mtype == MTYPE_DETACH)) ||
+        (mtype == MTYPE_LEASE && (!job->t->reply_fd || job->t->peer(job->t, job->conn, &peer) != EXIT_SUCCESS ||
+                                  peer != job->req->blob.head.pid)))
+        omnius_reply(job->req, EXIT_FAILURE);
+    else if (omnius_handle(job->req) == EXIT_SUCCESS && mtype == MTYPE_LEASE)
+        job->fd = omnius_lease_fd(&job->req->blob);
+
+    if (job->v2) {
+        msg_v2_encode(job->req, job->status, wire);
+        reply = wire;
+    }
+    return reply;
+}
+
+/*
+ * Send the REPLY to a request that omnius_complete has turned it into, on the connection it arrived on. The transport
+ * must be locked.
+ */
+int
+omnius_send(omnius_job_t *job, msgbuf_t *reply)
+{
+    return job->fd >= 0 ? job->t->reply_fd(job->t, reply, job->fd, job->conn) : job->t->reply(job->t, reply, job->conn);
+}
+
+/*
+ * The worker a request is run on: requests for the same pid always go to the same worker, so every secmem_process_t is
+ * only ever touched by one thread. Returns -1 for requests run on the listener: those that do not touch a process
+ * (NIL, HELLO, ATTACH, DETACH) and those that will be refused anyway.
+ */
+int
+omnius_shard(msgbuf_t *msg_buf)
+{
+    int shard = -1;
+    long mtype = msg_buf->mtype;
+
+    if (g_worker_count &&
+        mtype > MTYPE_NIL && mtype < MTYPE_COUNT && g_dispatch[mtype] &&
+        mtype != MTYPE_HELLO && mtype != MTYPE_ATTACH && mtype != MTYPE_DETACH && mtype != MTYPE_TERMINATE &&
+        msg_buf->blob.head.pid >= 0 && msg_buf->blob.head.pid < MAX_PID)
+        shard = msg_buf->blob.head.pid % g_worker_count;
+    return shard;
+}
+
+/*
+ * The handler for every transport: a request is run, and answered on the connection it arrived on. A v2 request is
+ * decoded into a native message first.
+ *
+ * Requests that touch a process are queued to that process' worker when workers are running (see omnius_shard), or
+ * refused if they cannot be queued; the rest, and everything when there are no workers, are run right here.
+ * TERMINATE gets no reply and stops polling.
+ */
+int
+omnius_serve(transport_t *t, msgbuf_t *msg_buf, void *conn)
+{
+    int ret = EXIT_SUCCESS, shard;
+    pid_t pid;
+    omnius_job_t local, *job = &local;
+
+    local.t = t;
+    local.conn = conn;
+    local.v2 = IS_BLOB_V2(&msg_buf->blob);
+    local.status = BLOB_V2_STATUS_REQUEST;
+    local.req = msg_buf;
+    if (local.v2) {
+        local.req = &local.msg_buf;
+        if (msg_v2_decode(msg_buf, local.req, &local.status) != EXIT_SUCCESS) {
+            local.req->mtype |= MTYPE_MOD_NAK;
+        } else if (IS_NAK(msg_buf->mtype)) {
+            /* the transport could not read it intact (see transport.h) */
+            local.req->mtype |= MTYPE_MOD_NAK;
+            local.status = BLOB_V2_STATUS_MALFORMED;
+        } else {
+            local.status = BLOB_V2_STATUS_REQUEST;
         }
-        humanize_blob(&msg_buf, log_buf, sizeof(log_buf));
-        fprintf(g_logfile, "\n<<<REQUEST<<<\n%s\n<<<<<<<<<<<<<\n", log_buf);
+    }
 
-        /*
-         * Exit upon receipt of the termination message.
+    if (local.req->mtype == MTYPE_TERMINATE) {
+        g_terminate = TRUE;
+        ret = EXIT_FAILURE;
+    } else if ((shard = omnius_shard(local.req)) >= 0 && (local.v2 || blob_wire_size(&msg_buf->blob)) &&
+               (job = (omnius_job_t *) malloc(sizeof(omnius_job_t)))) {
+        /* the job owns a copy of the request, the transport's buffer is reused as soon as we return */
+        *job = local;
+        job->next = NULL;
+        job->req = &job->msg_buf;
+        if (!local.v2)
+            memcpy(&job->msg_buf, msg_buf, sizeof(long) + blob_wire_size(&msg_buf->blob));
+        omnius_worker_push(job, &g_workers[shard]);
+    } else {
+        /* called from within poll, so the transport is already locked. A request that belongs to a worker is refused
+         * if it could not be queued, either for want of memory or because it cannot be copied whole (a v1 header
+         * whose data_len is out of bounds): running it here could race that worker on the same process.
          */
-        if (msg_buf.mtype == MTYPE_TERMINATE) {
-            ret = OMNIUS_RET_SUCCESS;
+        pid = local.req->blob.head.pid;
+        if (shard >= 0)
+            fprintf(g_logfile, "Failed to queue a request for pid %d, refusing it.\n", pid);
+        if (omnius_send(&local, omnius_complete(&local, msg_buf, shard >= 0)) != EXIT_SUCCESS)
+            fprintf(g_logfile, "Failed to reply over %s.\n", t->name);
+        if (!g_worker_count)
+            omnius_compact(pid);
+    }
+    return ret;
+}
+
+/*
+ * Give the process of PID back the objects the scrubber is done with (see scrub.h), and a slice of compaction if it
+ * uses handles (see PROCESS HANDLES in process.h). This is run once a request for it has been answered, by the thread
+ * that runs its requests.
+ */
+void
+omnius_compact(pid_t pid)
+{
+    secmem_process_t *proc;
+
+    if (pid >= 0 && pid < MAX_PID && (proc = g_pid_lookup[pid])) {
+        process_reclaim(proc, FALSE);
+        if (proc->handles)
+            process_compact(proc, PROCESS_COMPACT_SLICE);
+    }
+}
+
+/*
+ * Compress the idle objects (see PROCESS COMPRESSION in process.h) of the processes whose requests are run on SHARD
+ * (see omnius_shard), or of every process for -1, when there are no workers. This is run by the thread that runs their
+ * requests, between requests and when it has none, and sweeps at most every OMNIUS_SWEEP_MSEC; *NEXT_P is when it is
+ * next due.
+ */
+void
+omnius_sweep(int shard, SECMEM_INTERNAL_T *next_p)
+{
+    SECMEM_INTERNAL_T now;
+    secmem_process_t *proc;
+    pid_t pid;
+
+    if (ATOMIC_LOAD(&g_lz_procs) && (now = process_now()) >= *next_p) {
+        *next_p = now + OMNIUS_SWEEP_MSEC;
+        for (pid = shard < 0 ? 0 : shard; pid < MAX_PID; pid += shard < 0 ? 1 : g_worker_count) {
+            if ((proc = g_pid_lookup[pid]) && proc->lz_idle)
+                process_lz_sweep(proc, now);
+        }
+    }
+}
+
+/*
+ * Queue a job on a worker.
+ */
+void
+omnius_worker_push(omnius_job_t *job, omnius_worker_t *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail)
+        worker->tail->next = job;
+    else
+        worker->head = job;
+    worker->tail = job;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/*
+ * A worker thread: run the jobs queued on it in order, until it is told to stop and its queue is empty. While any
+ * process compresses its idle objects, it wakes up every OMNIUS_SWEEP_MSEC to sweep them (see omnius_sweep).
+ */
+void *
+omnius_worker(void *arg)
+{
+    omnius_worker_t *worker = (omnius_worker_t *) arg;
+    omnius_job_t *job;
+    msgbuf_t wire, *reply;
+    pid_t pid;
+    struct timespec until;
+    SECMEM_INTERNAL_T sweep_next = 0;
+    int stop;
+
+    for (;;) {
+        pthread_mutex_lock(&worker->lock);
+        if (!worker->head && !worker->stop) {
+            if (ATOMIC_LOAD(&g_lz_procs)) {
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += OMNIUS_SWEEP_MSEC * 1000000L;
+                until.tv_sec += until.tv_nsec / 1000000000L;
+                until.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&worker->cond, &worker->lock, &until);
+            } else {
+                pthread_cond_wait(&worker->cond, &worker->lock);
+            }
+        }
+        if ((job = worker->head) && !(worker->head = job->next))
+            worker->tail = NULL;
+        stop = worker->stop;
+        pthread_mutex_unlock(&worker->lock);
+        if (!job) {
+            /* woken up for nothing, or to sweep */
+            if (stop)
+                break;
+            omnius_sweep((int) (worker - g_workers), &sweep_next);
+            continue;
+        }
+
+        pid = job->req->blob.head.pid;
+        reply = omnius_complete(job, &wire, FALSE);
+        pthread_mutex_lock(&job->t->lock);
+        if (omnius_send(job, reply) != EXIT_SUCCESS)
+            fprintf(g_logfile, "Failed to reply over %s.\n", job->t->name);
+        pthread_mutex_unlock(&job->t->lock);
+        free(job);
+        omnius_compact(pid);
+        omnius_sweep((int) (worker - g_workers), &sweep_next);
+    }
+    return NULL;
+}
+
+/*
+ * Start COUNT worker threads. With a COUNT of zero every request is run on the listener.
+ */
+int
+omnius_workers_start(int count)
+{
+    int ret = EXIT_SUCCESS;
+
+    for (g_worker_count = 0; g_worker_count < count; g_worker_count++) {
+        omnius_worker_t *worker = &g_workers[g_worker_count];
+        memset(worker, 0, sizeof(*worker));
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        if (pthread_create(&worker->thread, NULL, omnius_worker, worker) != 0) {
+            perror("pthread_create");
+            ret = EXIT_FAILURE;
             break;
         }
+    }
+    return ret;
+}
 
-        /* It is crucial that we bounds check the mtype because we are using it to index into a fixed
-         * sized array -- i.e. overflow.
-         */
-        if (msg_buf.mtype >= 0 && msg_buf.mtype < MTYPE_COUNT && msg_buf.blob.head.pid < MAX_PID) {
+/*
+ * Stop the workers once they have run everything queued on them.
+ */
+void
+omnius_workers_stop(void)
+{
+    int i;
 
-            /* ACTION */
-            ret = g_dispatch[msg_buf.mtype](&msg_buf.blob);
-            if (ret != EXIT_SUCCESS ) {
-                msg_buf.blob.head.data_len = 0;
+    for (i = 0; i < g_worker_count; i++) {
+        pthread_mutex_lock(&g_workers[i].lock);
+        g_workers[i].stop = TRUE;
+        pthread_cond_signal(&g_workers[i].cond);
+        pthread_mutex_unlock(&g_workers[i].lock);
+    }
+    for (i = 0; i < g_worker_count; i++)
+        pthread_join(g_workers[i].thread, NULL);
+    g_worker_count = 0;
+}
+
+/*
+ * Listen for incoming messages on every open transport.
+ *
+ * Each transport is polled in turn until none has anything to do. omnius then parks on the first open transport in
+ * order of preference (rings, then the socket, then the message queue). When others are open too, the wait is bounded
+ * so that they still get polled: by OMNIUS_POLL_USEC after a busy round, backing off to OMNIUS_POLL_MAX_USEC while
+ * nothing arrives. It is also bounded by OMNIUS_SWEEP_MSEC while there are idle objects to sweep here.
+ */
+int
+omnius_listen(void)
+{
+    int ret = EXIT_FAILURE;
+    int i, busy, open;
+    long usec, poll_usec = OMNIUS_POLL_USEC;
+    transport_t *t, *idle;
+    SECMEM_INTERNAL_T sweep_next = 0;
+
+    while (!g_terminate) {
+        busy = FALSE;
+        open = 0;
+        idle = NULL;
+
+        /* LISTEN */
+        for (i = 0; i < TRANSPORT_COUNT && !g_terminate; i++) {
+            t = &g_transports[i];
+            if (t->active) {
+                open++;
+                pthread_mutex_lock(&t->lock);
+                busy |= t->poll(t);
+                pthread_mutex_unlock(&t->lock);
+                if (!idle)
+                    idle = t;
             }
-            /*
-             * Change message-type depending on the success of the event and
-             * calculate the length of the entire message buffer used.
-             */
-            msg_buf.mtype =  msg_buf.mtype | (ret == EXIT_SUCCESS ? MTYPE_MOD_ACK : MTYPE_MOD_NAK);
-
-            if ((SIZEOF_BLOB(&msg_buf.blob) > MAX_MTEXT_SIZE) || ((ret = msgsnd(ipc_out, &msg_buf, SIZEOF_BLOB(&msg_buf.blob), 0)) == -1))
-                perror("msgsnd");
-        } else {
-            msg_buf.mtype |= MTYPE_MOD_NAK; /* set nak-reply type if request was invalid */
         }
-        
-        humanize_blob(&msg_buf, log_buf, sizeof(log_buf));
-	fprintf(g_logfile, "\n>>>>REPLY>>>>\n%s\n>>>>>>>>>>>>>\n", log_buf);
+
+        /* without workers the idle objects are compressed here, and the wait is bounded for it while there are any */
+        if (!g_worker_count)
+            omnius_sweep(-1, &sweep_next);
+        if (busy) {
+            poll_usec = OMNIUS_POLL_USEC;
+        } else if (!g_terminate && idle) {
+            usec = !g_worker_count && ATOMIC_LOAD(&g_lz_procs) ? OMNIUS_SWEEP_MSEC * 1000 : -1;
+            if (open > 1) {
+                if (usec < 0 || poll_usec < usec)
+                    usec = poll_usec;
+                if (poll_usec < OMNIUS_POLL_MAX_USEC)
+                    poll_usec *= 2;
+            }
+            idle->wait(idle, usec);
+        }
     }
+
+    if (g_terminate)
+        ret = OMNIUS_RET_SUCCESS;
     return ret;
 }
 
@@ -303,10 +1007,27 @@ setup_sigint(void)
 
 
 /*
- * Run once on startup.
+ * The chunk size handed out to streams: as much as a blob can carry, but never more than the kernel lets through a
+ * message queue (msgmax includes the blob header, of whichever wire version).
+ */
+SECMEM_INTERNAL_T
+stream_chunk_size(void)
+{
+    SECMEM_INTERNAL_T chunk = MAX_BLOB_DATA_SIZE;
+    struct msginfo info;
+
+    if (msgctl(0, IPC_INFO, (struct msqid_ds *) &info) != -1 &&
+        info.msgmax > (int) MAX_BLOB_HEAD_SIZE &&
+        info.msgmax - MAX_BLOB_HEAD_SIZE < chunk)
+        chunk = info.msgmax - MAX_BLOB_HEAD_SIZE;
+    return chunk;
+}
+
+/*
+ * Run once on startup. ARGS holds the positional arguments (the message queue keys), if any.
  */
 int
-startup(char **argv, int *msg_in, int *msg_out)
+startup(char **args, int *msg_in, int *msg_out)
 {
     key_t msg_in_key, msg_out_key;
     printf("Configuring...");
@@ -334,18 +1055,33 @@ startup(char **argv, int *msg_in, int *msg_out)
     g_dispatch[MTYPE_WRITE] 	= omnius_write;
     g_dispatch[MTYPE_VIEW]	 	= omnius_view_internal; /* omnius_view; */
     g_dispatch[MTYPE_TERMINATE] = omnius_nil;
+    g_dispatch[MTYPE_ATTACH] 	= omnius_attach;
+    g_dispatch[MTYPE_DETACH] 	= omnius_detach;
+    g_dispatch[MTYPE_BATCH] 	= omnius_batch;
+    g_dispatch[MTYPE_STREAM_OPEN] 	= omnius_stream_open;
+    g_dispatch[MTYPE_STREAM_READ] 	= omnius_stream_read;
+    g_dispatch[MTYPE_STREAM_WRITE] 	= omnius_stream_write;
+    g_dispatch[MTYPE_HELLO] 	= omnius_hello;
+    g_dispatch[MTYPE_READV] 	= omnius_readv;
+    g_dispatch[MTYPE_WRITEV] 	= omnius_writev;
+    g_dispatch[MTYPE_LEASE] 	= omnius_lease;
+    g_dispatch[MTYPE_RESIZE] 	= omnius_resize;
+    g_dispatch[MTYPE_REALLOC] 	= omnius_realloc;
+    g_dispatch[MTYPE_CLONE] 	= omnius_clone;
+
+    g_stream_chunk = stream_chunk_size();
 
     printf("Starting OMNIUS in %s...\n", g_bit_mode_str);
     /* Parse command arguments */
     if(*msg_in)
         msg_in_key = *msg_in;
     else
-        msg_in_key = (int) strtol(argv[1], NULL, 16);
+        msg_in_key = (int) strtol(args[0], NULL, 16);
 
     if(*msg_out)
         msg_out_key = *msg_out;
     else
-        msg_out_key = (int) strtol(argv[2], NULL, 16);
+        msg_out_key = (int) strtol(args[1], NULL, 16);
 
     if (msg_out_key == msg_in_key)
         return OMNIUS_RET_ARGS;
@@ -355,6 +1091,17 @@ startup(char **argv, int *msg_in, int *msg_out)
         ((*msg_in = ipc_connect((key_t) msg_in_key)) < 0))
         return OMNIUS_RET_MSG;
 
+    /* open the transports */
+    if (transport_msgq_init(*msg_in, *msg_out, omnius_serve, &g_transports[TRANSPORT_MSGQ]) != EXIT_SUCCESS ||
+        transport_ring_init(omnius_serve, &g_transports[TRANSPORT_RING]) != EXIT_SUCCESS)
+        return OMNIUS_RET_CONFIG;
+    if (g_socket_path && transport_socket_init(g_socket_path, omnius_serve, &g_transports[TRANSPORT_SOCKET]) != EXIT_SUCCESS)
+        return OMNIUS_RET_CONFIG;
+    if (g_arena_size && process_arena_init(g_arena_size) != EXIT_SUCCESS)
+        return OMNIUS_RET_CONFIG;
+    if (scrub_start() != EXIT_SUCCESS)
+        return OMNIUS_RET_CONFIG;
+
     printf("Loaded!\n");
     return EXIT_SUCCESS;
 }
@@ -365,7 +1112,13 @@ startup(char **argv, int *msg_in, int *msg_out)
 void
 shutdown(void)
 {
+    int i;
+
     printf("Terminating....");
+    for (i = 0; i < TRANSPORT_COUNT; i++) {
+        if (g_transports[i].priv)
+            g_transports[i].close(&g_transports[i]);
+    }
     if (g_logfile)
     {
         fflush(g_logfile);
@@ -383,7 +1136,7 @@ shutdown(void)
 void
 show_usage(int ret)
 {
-    fprintf(stderr, "\nERR:%d\nUsage: omnius [msg_in_key] [msg_out_key]\n", ret);
+    fprintf(stderr, "\nERR:%d\nUsage: omnius [-s socket_path] [-w workers] [-a arena_size] [msg_in_key msg_out_key]\n", ret);
     return;
 }
 
@@ -392,20 +1145,44 @@ show_usage(int ret)
  */
 int
 main(int argc, char **argv) {
-    int ret = EXIT_FAILURE, msg_in = 0, msg_out = 0;
+    int ret = EXIT_FAILURE, msg_in = 0, msg_out = 0, opt, workers = 0;
+
+    while ((opt = getopt(argc, argv, "s:w:a:")) != -1) {
+        switch (opt) {
+        case 's':
+            g_socket_path = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 0 || workers > OMNIUS_MAX_WORKERS) {
+                show_usage(OMNIUS_RET_ARGS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'a':
+            g_arena_size = (SECMEM_INTERNAL_T) strtoull(optarg, NULL, 0);
+            break;
+        default:
+            show_usage(OMNIUS_RET_ARGS);
+            return EXIT_FAILURE;
+        }
+    }
 
     /* Parse cmd-args and setup globals */
-    if (argc < 3) {
+    if (argc - optind < 2) {
         /* if these are set, startup() will not try and parse cmd args for in/out msgids */
         msg_in = OMNIUS_DEFAULT_MSG_IN;
         msg_out = OMNIUS_DEFAULT_MSG_OUT;
     }
 
-    if ((ret = startup(argv, &msg_in, &msg_out)) == EXIT_SUCCESS) {
+    if ((ret = startup(argv + optind, &msg_in, &msg_out)) == EXIT_SUCCESS &&
+        (ret = omnius_workers_start(workers)) == EXIT_SUCCESS) {
         /* start listening for messages */
-        ret = listen(msg_in, msg_out);
+        ret = omnius_listen();
 
         /* cleanup and exit */
+        omnius_workers_stop();
+        scrub_stop();
         shutdown();
         ret = EXIT_SUCCESS;
     } else {
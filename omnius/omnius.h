@@ -10,6 +10,7 @@
 #define SECMEM_OMNIUS_H
 
 #include "comm.h"
+#include "transport.h"
 
 #define OMNIUS_RET_SUCCESS 0
 #define OMNIUS_RET_ARGS 1
@@ -21,6 +22,49 @@
 
 #define MAX_PID 32768
 
+/* While more than one transport is open omnius can only park on one of them, so this bounds the latency of a request
+ * on the others right after omnius was busy. The bound doubles with each wait that ends with nothing to do, up to
+ * OMNIUS_POLL_MAX_USEC, so that an idle omnius does not wake a thousand times a second.
+ */
+#define OMNIUS_POLL_USEC 1000
+#define OMNIUS_POLL_MAX_USEC 64000
+
+/* While a process compresses its idle objects, the threads that run requests sweep them at least this often, even if
+ * they have nothing else to do (see omnius_sweep).
+ */
+#define OMNIUS_SWEEP_MSEC 100
+
+#define OMNIUS_MAX_WORKERS 64
+
+/*
+ * A request on its way through omnius: where it came from, the native request (REQ, pointing at MSG_BUF unless the
+ * request is run in place), and the file descriptor to pass with its reply (FD, a lease, -1 for none).
+ */
+typedef struct omnius_job_t
+{
+    struct omnius_job_t *next;
+    transport_t *t;
+    void *conn;
+    int v2;
+    uint8_t status;
+    msgbuf_t *req;
+    int fd;
+    msgbuf_t msg_buf;
+} omnius_job_t;
+
+/*
+ * A worker thread and its queue of jobs.
+ */
+typedef struct omnius_worker_t
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    omnius_job_t *head;
+    omnius_job_t *tail;
+    int stop;
+} omnius_worker_t;
+
 
 int
 omnius_load(blob_t *);
@@ -34,12 +78,42 @@ omnius_alloc(blob_t *);
 int
 omnius_dealloc(blob_t *);
 
+int
+omnius_realloc(blob_t *);
+
+int
+omnius_clone(blob_t *);
+
 int
 omnius_read(blob_t *);
 
 int
 omnius_write(blob_t *);
 
+int
+omnius_stream_open(blob_t *);
+
+int
+omnius_stream_read(blob_t *);
+
+int
+omnius_stream_write(blob_t *);
+
+int
+omnius_readv(blob_t *);
+
+int
+omnius_writev(blob_t *);
+
+int
+omnius_lease(blob_t *);
+
+int
+omnius_lease_fd(blob_t *);
+
+int
+omnius_resize(blob_t *);
+
 int
 omnius_view(blob_t *);
 
@@ -50,7 +124,55 @@ int
 omnius_nil(blob_t *);
 
 int
-listen(int, int);
+omnius_hello(blob_t *);
+
+int
+omnius_attach(blob_t *);
+
+int
+omnius_detach(blob_t *);
+
+int
+omnius_batch(blob_t *);
+
+void
+omnius_reply(msgbuf_t *, int);
+
+int
+omnius_handle(msgbuf_t *);
+
+msgbuf_t *
+omnius_complete(omnius_job_t *, msgbuf_t *, int);
+
+int
+omnius_send(omnius_job_t *, msgbuf_t *);
+
+int
+omnius_shard(msgbuf_t *);
+
+int
+omnius_serve(transport_t *, msgbuf_t *, void *);
+
+void
+omnius_compact(pid_t);
+
+void
+omnius_sweep(int, SECMEM_INTERNAL_T *);
+
+void
+omnius_worker_push(omnius_job_t *, omnius_worker_t *);
+
+void *
+omnius_worker(void *);
+
+int
+omnius_workers_start(int);
+
+void
+omnius_workers_stop(void);
+
+int
+omnius_listen(void);
 
 void
 sigint_handler(int);
@@ -58,6 +180,9 @@ sigint_handler(int);
 int
 setup_sigint(void);
 
+SECMEM_INTERNAL_T
+stream_chunk_size(void);
+
 int
 startup(char **, int *, int *);
 
@@ -10,15 +10,52 @@
  *
  * All of these routines return EXIT_SUCCESS or EXIT_FAILURE.
  *
+ * A process region is an anonymous mapping, so its pages come zeroed, and unless the LOAD asks for them to be populated
+ * or locked (see process_map) they are only committed once they are touched. Free memory in a region is always zero:
+ * objects are zeroed when they are deallocated (see process_zero), not when they are allocated, and an unload just
+ * unmaps the region. A large object is zeroed by the scrubber instead, and only given back to the region once it has
+ * been (see process_reclaim).
+ *
+ * A process that uses the global arena (see arena.h) has no region of its own, every object (or slab) of it is backed by
+ * a chunk of the arena instead, taken when it is allocated and zeroed and given back when it is deallocated or the
+ * process unloads. process_data finds the bytes at an address either way.
+ *
+ * An object that is compressed (see PROCESS COMPRESSION in process.h) has no bytes until it is decompressed: anything
+ * that touches them calls process_touch first.
+ *
  * 2015 - Mike Clark
  */
 
+#define _GNU_SOURCE /* mremap */
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "global.h"
 #include "fsm_descriptor.h"
 #include "process.h"
+#include "lease.h"
+#include "buddy.h"
+#include "arena.h"
+#include "lz.h"
+
+extern FILE *g_logfile;
+
+/* The placement strategies a LOAD can choose, by LOAD_STRATEGY_* */
+memory_strategy_t g_memory_strategy[LOAD_STRATEGY_COUNT] = {
+    { "fit",   memory_load, memory_alloc, memory_dealloc, memory_realloc, memory_resize, TRUE },
+    { "buddy", buddy_load,  buddy_alloc,  buddy_dealloc,  buddy_realloc,  buddy_resize,  FALSE }
+};
+
+/* The backing modes, by LOAD_BACKING_* bit, and their counters */
+const char *g_backing_name[LOAD_BACKING_BITS] = { "thp", "hugetlb", "populate", "lock" };
+process_backing_stats_t g_backing_stats[LOAD_BACKING_BITS];
+
+/* The global arena, if omnius was started with one */
+arena_t g_arena;
 
 /*
  * Allocate space for, and generate FSM descriptors for the policies of a process being loaded.
@@ -92,15 +129,567 @@ process_unload_fsm(secmem_process_t *proc)
     return ret;
 }
 
+/*
+ * Zero SIZE bytes of PROC's memory from DATA (see process_data), see scrub_zero. The pages of a plain region (or the
+ * arena) may be dropped, other regions keep theirs: dropping them would split huge pages or undo the prefault.
+ */
+int
+process_zero(secmem_process_t *proc, char *data, SECMEM_INTERNAL_T size)
+{
+    int ret = EXIT_SUCCESS;
+
+    scrub_zero(data, size, !proc->backing);
+    return ret;
+}
+
+/*
+ * Give the objects of PROC the scrubber is done with back to the region, waiting for all of them if WAIT. This is
+ * done by the thread that runs the process' requests, after each one, and before anything that moves or unmaps
+ * memory the scrubber may still be zeroing.
+ */
+int
+process_reclaim(secmem_process_t *proc, char wait)
+{
+    int ret = EXIT_SUCCESS;
+    scrub_job_t *job, *next;
+
+    scrub_reap(&proc->scrub, wait, &job);
+    for (; job; job = next) {
+        next = job->next;
+        job->node->scrub = FALSE;
+        proc->compact_pos = MIN(proc->compact_pos, job->node->offset);
+        ret |= process_chunk_free(proc, job->node);
+        ret |= proc->strategy->dealloc(job->node, &proc->secmem_index);
+        free(job);
+    }
+    return ret;
+}
+
+/*
+ * The bytes at ADDR of PROC, which falls in NODE: in the node's arena chunk if it has one, in the region otherwise. A
+ * clone's are its source's (see PROCESS CLONES).
+ */
+char *
+process_data(secmem_process_t *proc, secmem_obj_t *node, SECMEM_INTERNAL_T addr)
+{
+    if (node->cow_src) {
+        addr = node->cow_src->offset + (addr - node->offset);
+        node = node->cow_src;
+    }
+    return node->chunk ? g_arena.base + node->chunk->offset + (addr - node->offset) : proc->base + addr;
+}
+
+/* Take the clone NODE out of the chain of its source's clones, it reads its own bytes from now on */
+void
+process_cow_unlink(secmem_obj_t *node)
+{
+    node->cow_prev->cow_next = node->cow_next;
+    if (node->cow_next)
+        node->cow_next->cow_prev = node->cow_prev;
+    node->cow_src = NULL;
+    node->cow_prev = NULL;
+    node->cow_next = NULL;
+}
+
+/*
+ * Give NODE of PROC bytes that are its alone before they change (see PROCESS CLONES): a clone copies its source's, a
+ * source hands its bytes to its first clone, which becomes the source of the others. Either way one copy is made.
+ */
+void
+process_cow_break(secmem_process_t *proc, secmem_obj_t *node)
+{
+    secmem_obj_t *clone;
+    char *src;
+
+    if (node->cow_src) {
+        src = process_data(proc, node, node->offset);
+        process_cow_unlink(node);
+        memcpy(process_data(proc, node, node->offset), src, node->size);
+    } else if ((clone = node->cow_next)) {
+        clone->cow_src = NULL;
+        clone->cow_prev = NULL;
+        node->cow_next = NULL;
+        memcpy(process_data(proc, clone, clone->offset), process_data(proc, node, node->offset), node->size);
+        for (node = clone->cow_next; node; node = node->cow_next)
+            node->cow_src = clone;
+    }
+}
+
+/* The time objects are touched at (see PROCESS COMPRESSION), in msec, from a coarse monotonic clock */
+SECMEM_INTERNAL_T
+process_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (SECMEM_INTERNAL_T) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * NODE of PROC is about to be accessed, SYMBOL as for process_access (0 for neither). In a process that compresses its
+ * idle objects, it is decompressed if it was compressed, and counts as untouched from now on. Fails if it cannot be
+ * decompressed.
+ */
+int
+process_touch(secmem_process_t *proc, secmem_obj_t *node, char symbol)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (proc->lz_idle) {
+        node->atime = process_now();
+        if (symbol == WRITE_CHAR)
+            node->lz_skip = FALSE;
+        if (node->lz_data)
+            ret = process_lz_restore(proc, node);
+    }
+    return ret;
+}
+
+/*
+ * Compress NODE of PROC into a store of its own, and give up its bytes: they are zeroed (see process_zero) and its
+ * arena chunk is given back. An object that would not shrink by 1 / PROCESS_LZ_RATIO is left as it is, and not tried
+ * again until it is written.
+ */
+int
+process_lz_compress(secmem_process_t *proc, secmem_obj_t *node)
+{
+    int ret = EXIT_FAILURE;
+    char *data = process_data(proc, node, node->offset), *buf, *store;
+    size_t cap = node->size - node->size / PROCESS_LZ_RATIO, size;
+
+    if ((buf = (char *) malloc(cap)) != NULL) {
+        if (lz_compress(data, node->size, buf, cap, &size) != EXIT_SUCCESS) {
+            node->lz_skip = TRUE;
+            proc->lz.skipped++;
+        } else if ((store = (char *) malloc(size)) != NULL) {
+            memcpy(store, buf, size);
+            process_zero(proc, data, node->size);
+            process_chunk_free(proc, node);
+            node->lz_data = store;
+            node->lz_size = size;
+            proc->lz.objects++;
+            proc->lz.bytes += node->size;
+            proc->lz.stored += size;
+            proc->lz.compressed++;
+            ret = EXIT_SUCCESS;
+        }
+        /* the buffer holds the object's bytes too */
+        scrub_memzero(buf, cap);
+        free(buf);
+    }
+    return ret;
+}
+
+/*
+ * Decompress the compressed NODE of PROC back into its bytes, with a new arena chunk for them if it uses the arena, and
+ * drop its store. The time it takes is counted in the process' counters. Fails, leaving it compressed, if there is no
+ * chunk for it.
+ */
+int
+process_lz_restore(secmem_process_t *proc, secmem_obj_t *node)
+{
+    int ret = EXIT_FAILURE;
+    struct timespec start, end;
+    SECMEM_INTERNAL_T nsec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (process_chunk_new(proc, node) == EXIT_SUCCESS) {
+        if ((ret = lz_decompress(node->lz_data, node->lz_size, process_data(proc, node, node->offset),
+                                 node->size)) == EXIT_SUCCESS) {
+            process_lz_discard(proc, node);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            nsec = (SECMEM_INTERNAL_T) (end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+            proc->lz.restored++;
+            proc->lz.restore_nsec += nsec;
+            proc->lz.restore_max_nsec = MAX(proc->lz.restore_max_nsec, nsec);
+        } else {
+            /* a store that does not decompress is kept, and the bytes left as they were, zero */
+            process_zero(proc, process_data(proc, node, node->offset), node->size);
+            process_chunk_free(proc, node);
+        }
+    }
+    return ret;
+}
+
+/* Zero and free the store of NODE of PROC, if it is compressed. Its bytes are left zero. */
+void
+process_lz_discard(secmem_process_t *proc, secmem_obj_t *node)
+{
+    if (node->lz_data) {
+        scrub_memzero(node->lz_data, node->lz_size);
+        free(node->lz_data);
+        proc->lz.objects--;
+        proc->lz.bytes -= node->size;
+        proc->lz.stored -= node->lz_size;
+        node->lz_data = NULL;
+        node->lz_size = 0;
+    }
+}
+
+/*
+ * Compress the objects of PROC that have gone untouched for its idle time by NOW (see process_now), if it is time to
+ * sweep them again: at most every quarter of the idle time, so that the region is not walked for nothing.
+ */
+int
+process_lz_sweep(secmem_process_t *proc, SECMEM_INTERNAL_T now)
+{
+    int ret = EXIT_SUCCESS;
+    secmem_obj_t *node;
+
+    if (proc->lz_idle && now >= proc->lz_next) {
+        proc->lz_next = now + MAX(proc->lz_idle / 4, 1);
+        for (node = proc->secmem_head; node; node = node->next) {
+            if (node->used && !node->slab && !node->scrub && !node->lz_data && !node->lz_skip && !node->stream_mode &&
+                !node->cow_src && !node->cow_next && node->size >= PROCESS_LZ_MIN && now - node->atime >= proc->lz_idle)
+                process_lz_compress(proc, node);
+        }
+    }
+    return ret;
+}
+
+/* Give NODE a chunk of the arena to hold its bytes, aligned like the node, if PROC uses the arena and it has none yet */
+int
+process_chunk_new(secmem_process_t *proc, secmem_obj_t *node)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (proc->arena && !node->chunk)
+        ret = arena_alloc(&g_arena, node->size, node->align, &node->chunk);
+    return ret;
+}
+
+/* Give the chunk of NODE, if any, back to the arena. The caller is expected to have zeroed it. */
+int
+process_chunk_free(secmem_process_t *proc, secmem_obj_t *node)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (node->chunk) {
+        ret = arena_free(&g_arena, node->chunk);
+        node->chunk = NULL;
+    }
+    return ret;
+}
+
+/* Map the global arena, SIZE bytes, for processes to load into (see arena.h) */
+int
+process_arena_init(SECMEM_INTERNAL_T size)
+{
+    return arena_init(&g_arena, size);
+}
+
+/* Place the size of the global arena, the bytes in chunks and the number of chunks in SIZE_P, USED_P and CHUNKS_P */
+int
+process_arena_stats(SECMEM_INTERNAL_T *size_p, SECMEM_INTERNAL_T *used_p, SECMEM_INTERNAL_T *chunks_p)
+{
+    int ret = EXIT_FAILURE;
+
+    if (g_arena.base) {
+        pthread_mutex_lock(&g_arena.lock);
+        *size_p = g_arena.size;
+        *used_p = g_arena.used;
+        *chunks_p = g_arena.chunks;
+        pthread_mutex_unlock(&g_arena.lock);
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Map the region of PROC, SIZE bytes backed as BACKING asks (see LOAD OPTIONS), and set its base, backing and map_size.
+ * Explicit huge pages fall back to transparent ones if the hugetlb pool is short; a region that cannot be locked fails.
+ */
+int
+process_map(secmem_process_t *proc, SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T backing)
+{
+    int ret = EXIT_SUCCESS;
+    int bit, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    size_t huge = PROCESS_HUGE_PAGE_SIZE, page = (size_t) sysconf(_SC_PAGESIZE);
+    char *map = MAP_FAILED, *start, *end;
+
+    /* a plain or transparent huge page region is not backed until it is touched, so it needs no swap reserved */
+    if (!(backing & (LOAD_BACKING_HUGETLB | LOAD_BACKING_POPULATE | LOAD_BACKING_LOCK)))
+        flags |= MAP_NORESERVE;
+
+    if (backing & LOAD_BACKING_HUGETLB) {
+        proc->map_size = (size + huge - 1) & ~(huge - 1);
+        if (proc->map_size >= size)
+            map = (char *) mmap(NULL, proc->map_size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (map == MAP_FAILED) {
+            ATOMIC_INC(&g_backing_stats[__builtin_ctz(LOAD_BACKING_HUGETLB)].fallbacks);
+            backing = (backing & ~LOAD_BACKING_HUGETLB) | LOAD_BACKING_THP;
+        }
+    }
+    if (map == MAP_FAILED && (backing & LOAD_BACKING_THP)) {
+        /* map a huge page more than needed and trim it, so the region starts on a huge page boundary */
+        proc->map_size = size;
+        if (size + huge > size &&
+            (map = (char *) mmap(NULL, size + huge, PROT_READ | PROT_WRITE, flags, -1, 0)) != MAP_FAILED) {
+            start = (char *) (((uintptr_t) map + huge - 1) & ~(huge - 1));
+            end = (char *) (((uintptr_t) start + size + page - 1) & ~(page - 1));
+            if (start > map)
+                munmap(map, start - map);
+            if (end < map + size + huge)
+                munmap(end, map + size + huge - end);
+            map = start;
+            if (madvise(map, size, MADV_HUGEPAGE) != 0) {
+                ATOMIC_INC(&g_backing_stats[__builtin_ctz(LOAD_BACKING_THP)].fallbacks);
+                backing &= ~LOAD_BACKING_THP;
+            }
+        }
+    }
+    if (map == MAP_FAILED && !(backing & (LOAD_BACKING_HUGETLB | LOAD_BACKING_THP))) {
+        proc->map_size = size;
+        map = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    }
+
+    if (map == MAP_FAILED) {
+        ret = EXIT_FAILURE;
+    } else if (backing & LOAD_BACKING_LOCK) {
+        /* mlock faults in every page as well */
+        if (mlock(map, proc->map_size) != 0) {
+            ATOMIC_INC(&g_backing_stats[__builtin_ctz(LOAD_BACKING_LOCK)].failures);
+            ret = EXIT_FAILURE;
+        } else {
+            madvise(map, proc->map_size, MADV_DONTDUMP);
+        }
+    } else if (backing & LOAD_BACKING_POPULATE) {
+        /* populate after the madvise above, so transparent huge pages are faulted in as such */
+        process_populate(map, proc->map_size);
+    }
+
+    if (ret == EXIT_SUCCESS) {
+        proc->base = map;
+        proc->backing = backing;
+        for (bit = 0; bit < LOAD_BACKING_BITS; bit++) {
+            if (backing & (1 << bit)) {
+                ATOMIC_INC(&g_backing_stats[bit].procs);
+                ATOMIC_ADD(&g_backing_stats[bit].bytes, proc->map_size);
+            }
+        }
+    } else if (map != MAP_FAILED) {
+        munmap(map, proc->map_size);
+    }
+    return ret;
+}
+
+/* Fault in LEN bytes of mapping from START */
+void
+process_populate(char *start, size_t len)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *p;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, len, MADV_POPULATE_WRITE) != 0)
+#endif /* MADV_POPULATE_WRITE */
+        for (p = (char *) ((uintptr_t) start & ~(page - 1)); p < start + len; p += page)
+            *(volatile char *) p = 0;
+}
+
+/*
+ * Resize the mapping of PROC to hold SIZE bytes. The mapping may move, which is fine as everything in it is addressed
+ * by offset. It keeps its flags as it grows, so added pages are huge, locked (and faulted in) or left out of core dumps
+ * like the rest; only a prefault has to be done here. A region moved off its huge page alignment only gets huge pages
+ * where it happens to line up.
+ */
+int
+process_remap(secmem_process_t *proc, SECMEM_INTERNAL_T size)
+{
+    int ret = EXIT_FAILURE;
+    int bit;
+    size_t huge = PROCESS_HUGE_PAGE_SIZE;
+    size_t map_size = (proc->backing & LOAD_BACKING_HUGETLB) ? (size + huge - 1) & ~(huge - 1) : size;
+    char *map;
+
+    /* a process in the arena has no mapping */
+    if (proc->arena || map_size == proc->map_size) {
+        ret = EXIT_SUCCESS;
+    } else if (map_size >= size &&
+               (map = (char *) mremap(proc->base, proc->map_size, map_size, MREMAP_MAYMOVE)) != MAP_FAILED) {
+        if ((proc->backing & LOAD_BACKING_POPULATE) && map_size > proc->map_size)
+            process_populate(map + proc->map_size, map_size - proc->map_size);
+        for (bit = 0; bit < LOAD_BACKING_BITS; bit++) {
+            if (proc->backing & (1 << bit)) {
+                ATOMIC_SUB(&g_backing_stats[bit].bytes, proc->map_size);
+                ATOMIC_ADD(&g_backing_stats[bit].bytes, map_size);
+            }
+        }
+        proc->base = map;
+        proc->map_size = map_size;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/* Unmap the region of PROC, its pages are zeroed by the system before they are used again */
+int
+process_unmap(secmem_process_t *proc)
+{
+    int ret = EXIT_FAILURE;
+    int bit;
+
+    if (munmap(proc->base, proc->map_size) == 0) {
+        for (bit = 0; bit < LOAD_BACKING_BITS; bit++) {
+            if (proc->backing & (1 << bit)) {
+                ATOMIC_DEC(&g_backing_stats[bit].procs);
+                ATOMIC_SUB(&g_backing_stats[bit].bytes, proc->map_size);
+            }
+        }
+        proc->base = NULL;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/* Copy the counters of backing mode BIT (see process_backing_stats_t) to STATS, and point NAME at its name */
+int
+process_backing_stats(int bit, const char **name, process_backing_stats_t *stats)
+{
+    int ret = EXIT_FAILURE;
+
+    if (bit >= 0 && bit < LOAD_BACKING_BITS) {
+        *name = g_backing_name[bit];
+        stats->procs = ATOMIC_LOAD(&g_backing_stats[bit].procs);
+        stats->bytes = ATOMIC_LOAD(&g_backing_stats[bit].bytes);
+        stats->fallbacks = ATOMIC_LOAD(&g_backing_stats[bit].fallbacks);
+        stats->failures = ATOMIC_LOAD(&g_backing_stats[bit].failures);
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Give NODE a handle (see PROCESS HANDLES), growing the table if it has no free slot.
+ */
+int
+process_handle_new(secmem_process_t *proc, secmem_obj_t *node)
+{
+    int ret = EXIT_FAILURE;
+    SECMEM_INTERNAL_T i, count = proc->handle_count ? proc->handle_count * 2 : PROCESS_HANDLE_MIN;
+    process_handle_t *tbl;
+
+    /* the table doubles, as long as every handle still fits above the offset bits */
+    if (!proc->handle_free && !(count >> (SECMEM_INTERNAL_BIT - LOAD_HANDLE_OFFSET_BITS)) &&
+        (tbl = (process_handle_t *) realloc(proc->handle_tbl, count * sizeof(process_handle_t))) != NULL) {
+        for (i = count; i > proc->handle_count; i--) {
+            tbl[i - 1].node = NULL;
+            tbl[i - 1].next_free = proc->handle_free;
+            proc->handle_free = i;
+        }
+        proc->handle_tbl = tbl;
+        proc->handle_count = count;
+    }
+    if (proc->handle_free) {
+        node->handle = proc->handle_free;
+        proc->handle_free = proc->handle_tbl[node->handle - 1].next_free;
+        proc->handle_tbl[node->handle - 1].node = node;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/* Put the handle of NODE back on the free slots */
+int
+process_handle_free(secmem_process_t *proc, secmem_obj_t *node)
+{
+    int ret = EXIT_FAILURE;
+
+    if (node->handle && node->handle <= proc->handle_count) {
+        proc->handle_tbl[node->handle - 1].node = NULL;
+        proc->handle_tbl[node->handle - 1].next_free = proc->handle_free;
+        proc->handle_free = node->handle;
+        node->handle = 0;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Turn the addr of a request (*ADDR_P) into the offset it stands for now. Offsets stand for themselves, unless the
+ * process uses handles: then it must be a live handle plus an offset inside its object.
+ */
+int
+process_translate(secmem_process_t *proc, SECMEM_INTERNAL_T *addr_p)
+{
+    int ret = EXIT_FAILURE;
+    SECMEM_INTERNAL_T handle = *addr_p >> LOAD_HANDLE_OFFSET_BITS, inner = *addr_p & (PROCESS_HANDLE_MAX_SIZE - 1);
+    secmem_obj_t *node;
+
+    if (!proc->handles) {
+        ret = EXIT_SUCCESS;
+    } else if (handle && handle <= proc->handle_count && (node = proc->handle_tbl[handle - 1].node) &&
+               inner < node->size) {
+        *addr_p = node->offset + inner;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Compact the region of a process that uses handles, by sliding the objects above the lowest free node down over it
+ * (see memory_slide) until BUDGET bytes have been moved (0 for no limit). Everything below compact_pos is already
+ * compact, so each call carries on where the last left off. Objects are moved whole, so a slice may overrun BUDGET by
+ * one object. Returns TRUE once the region is compact (its free space is all in one node at the end).
+ */
+int
+process_compact(secmem_process_t *proc, SECMEM_INTERNAL_T budget)
+{
+    SECMEM_INTERNAL_T moved = 0, from, zero;
+    secmem_obj_t *node = NULL, *free_node;
+
+    if (proc->handles)
+        memory_index_floor(proc->compact_pos, &node, &proc->secmem_index);
+    while (node && (node->used || node->next) && (!budget || moved < budget)) {
+        if (node->used) {
+            node = node->next;
+        } else if (node->next->scrub) {
+            /* the object after it is being zeroed, it cannot move until it is given back */
+            break;
+        } else if (!node->next->chunk && MEMORY_ALIGN_PAD(node->offset, node->next->align)) {
+            /* the object after it would lose its alignment there, it stays where it is */
+            node = node->next;
+        } else {
+            /* the node after an unused one is always used, unused neighbours are merged */
+            free_node = node;
+            node = free_node->next;
+            from = node->offset;
+            memory_slide(free_node, &proc->secmem_head, &proc->secmem_index);
+            /* an object in the arena keeps its chunk, only its place in the region changes; a clone's own bytes are
+             * still zero, as are a compressed object's, and the space they move to */
+            if (!node->chunk && !node->cow_src && !node->lz_data) {
+                memmove(proc->base + node->offset, proc->base + from, node->size);
+                /* zero what is left of the object where it was */
+                zero = MAX(node->offset + node->size, from);
+                process_zero(proc, proc->base + zero, from + node->size - zero);
+            }
+            moved += node->size;
+            node = node->next;
+        }
+    }
+    proc->compact_pos = node ? node->offset : proc->mem_size;
+    return !node || (!node->used && !node->next);
+}
+
 /* Load a process object for a process that will use omnius' services */
 int
 process_load(blob_t *blob, secmem_process_t *proc)
 {
     int ret = EXIT_FAILURE;
+    load_opts_t opts;
 
-    /* allocate the entire region of secure memory for this process */
-    if ((proc->base = (char *) calloc(blob->head.size, sizeof(char))) != NULL) {
-            if (memory_load(blob->head.size, &proc->secmem_head) == EXIT_SUCCESS) {
+    /* map the entire region of secure memory for this process, backed and laid out the way it asks for, unless its
+     * objects come from the arena */
+    if (load_check(blob, &opts) == EXIT_SUCCESS && opts.strategy < LOAD_STRATEGY_COUNT &&
+        !(opts.backing >> LOAD_BACKING_BITS) && (!opts.handles || opts.strategy == LOAD_STRATEGY_FIT) &&
+        (!opts.idle || !opts.backing) &&
+        (opts.arena ? g_arena.base && !opts.backing :
+                      process_map(proc, blob->head.size, opts.backing) == EXIT_SUCCESS)) {
+            proc->strategy = &g_memory_strategy[opts.strategy];
+            proc->handles = opts.handles != 0;
+            proc->arena = opts.arena != 0;
+            proc->lz_idle = opts.idle;
+            if (proc->strategy->load(blob->head.size, &proc->secmem_head, &proc->secmem_index) == EXIT_SUCCESS) {
                 proc->pid = blob->head.pid;
                 proc->mem_size = blob->head.size;
                 proc->fsm_count = blob->head.policy_count;
@@ -115,10 +704,10 @@ process_load(blob_t *blob, secmem_process_t *proc)
      */
     if (ret != EXIT_SUCCESS) {
         if (proc->secmem_head) {
-            memory_unload(proc->secmem_head);
+            memory_unload(proc->secmem_head, &proc->secmem_index);
         }
         if (proc->base)
-            free(proc->base);
+            process_unmap(proc);
     }
 
     /* REPLY */
@@ -127,6 +716,34 @@ process_load(blob_t *blob, secmem_process_t *proc)
     return ret;
 }
 
+/*
+ * Grow or shrink the region of a process, as specified in a blob message (see RESIZE in comm.h). A region grows by
+ * remapping it first and then adding the space at its end to the free space (see memory_strategy_t), and shrinks the
+ * other way round; no object is copied or moves. Whatever happens, the region ends up as large as its nodes.
+ */
+int
+process_resize(blob_t *blob, secmem_process_t *proc)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *tail;
+
+    /* nothing may be left in the scrubber while the mapping moves, and the objects in it may be in the way */
+    process_reclaim(proc, TRUE);
+    if (blob->head.size <= proc->mem_size || process_remap(proc, blob->head.size) == EXIT_SUCCESS)
+        ret = proc->strategy->resize(proc->mem_size, blob->head.size, &proc->secmem_head, &proc->secmem_index);
+    if (memory_index_floor((SECMEM_INTERNAL_T) -1, &tail, &proc->secmem_index) == EXIT_SUCCESS)
+        proc->mem_size = tail->offset + tail->size;
+    proc->compact_pos = MIN(proc->compact_pos, proc->mem_size);
+
+    /* give back the pages past the end, or those mapped for a grow that did not happen */
+    process_remap(proc, proc->mem_size);
+
+    /* REPLY */
+    blob->head.size = proc->mem_size;
+    blob->head.data_len = 0;
+    return ret;
+}
+
 /* Unload a process, as specified in a blob message.
  *
  * This will attempt to completely unload a process object representing a target process using omnius' service.
@@ -137,20 +754,35 @@ process_load(blob_t *blob, secmem_process_t *proc)
 int
 process_unload(blob_t *blob, secmem_process_t *proc)
 {
-    int ret = EXIT_FAILURE;
+    int ret = EXIT_SUCCESS;
     /*
      * We use |= to retain any non-zero (failure) return codes, because we want to continue everything even if
      * one step fails only works because a success is zero and failure is non-zero
-     * Freeing secmem_head is done by the memory_unload function
+     * Freeing secmem_head is done by the memory_unload function, the leases on its nodes are revoked first, and their
+     * arena chunks zeroed and given back.
      */
-    ret = memory_unload(proc->secmem_head);
+    secmem_obj_t *node;
+    ret |= process_reclaim(proc, TRUE);
+    for (node = proc->secmem_head; node; node = node->next) {
+        lease_revoke(node);
+        /* a clone's own bytes are zero, its source's may be gone before it is reached */
+        if (node->cow_src)
+            process_cow_unlink(node);
+        /* a compressed object has no bytes, nor chunk */
+        process_lz_discard(proc, node);
+        if (node->chunk) {
+            process_zero(proc, process_data(proc, node, node->offset), node->size);
+            ret |= process_chunk_free(proc, node);
+        }
+    }
+    ret |= memory_unload(proc->secmem_head, &proc->secmem_index);
     ret |= process_unload_fsm(proc);
+    if (proc->handle_tbl)
+        free(proc->handle_tbl);
 
-    /* Zero out the the entire memory region associated with this process */
-    if (proc->base) {
-        memset(proc->base, 0, proc->mem_size);
-        free(proc->base);
-    }
+    /* Unmap the entire memory region associated with this process, its pages are zeroed before they are used again */
+    if (proc->base)
+        ret |= process_unmap(proc);
 
     /* REPLY */
     blob->head.data_len = 0;
@@ -158,6 +790,86 @@ process_unload(blob_t *blob, secmem_process_t *proc)
     return ret;
 }
 
+/*
+ * Place a new object of SIZE bytes, aligned to ALIGN, in the region of PROC, with its arena chunk if it uses the arena;
+ * placed in NODE_P. A region whose objects can be moved is compacted to make room, if there is none. The object is
+ * zero and has no FSM yet.
+ */
+int
+process_place(secmem_process_t *proc, SECMEM_INTERNAL_T size, SECMEM_INTERNAL_T align, fsm_descriptor_t *fsm_desc,
+              secmem_obj_t **node_p)
+{
+    int ret = EXIT_FAILURE;
+
+    ret = proc->strategy->alloc(size, align, fsm_desc, node_p, &proc->secmem_head, &proc->secmem_index);
+    if (ret != EXIT_SUCCESS) {
+        /* take back whatever the scrubber holds first */
+        process_reclaim(proc, TRUE);
+        if (!proc->handles || process_compact(proc, 0))
+            ret = proc->strategy->alloc(size, align, fsm_desc, node_p, &proc->secmem_head, &proc->secmem_index);
+    }
+    if (ret == EXIT_SUCCESS) {
+        (*node_p)->stream_mode = 0;
+        (*node_p)->stream_pos = 0;
+        (*node_p)->atime = proc->lz_idle ? process_now() : 0;
+        (*node_p)->lz_skip = FALSE;
+        if ((ret = process_chunk_new(proc, *node_p)) != EXIT_SUCCESS) {
+            if (proc->strategy->dealloc(*node_p, &proc->secmem_index) != EXIT_SUCCESS)
+                fprintf(g_logfile, "Failed to give back the object at 0x%lx of pid %d.\n", (*node_p)->offset,
+                        proc->pid);
+            *node_p = NULL;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Allocate a slab slot of SIZE bytes under FSM_DESC in PROC (see memory_slab_t), its address placed in ADDR_P. A new
+ * slab of a process in the arena has no chunk yet, without one the slot goes again.
+ */
+int
+process_slot_new(secmem_process_t *proc, SECMEM_INTERNAL_T size, fsm_descriptor_t *fsm_desc, SECMEM_INTERNAL_T *addr_p)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *node = NULL;
+    int slot;
+
+    if ((ret = memory_slab_alloc(size, fsm_desc, addr_p, &proc->secmem_head, &proc->secmem_index)) == EXIT_SUCCESS &&
+        memory_get_obj_containing(*addr_p, &node, &proc->secmem_index) == EXIT_SUCCESS &&
+        (ret = process_chunk_new(proc, node)) != EXIT_SUCCESS &&
+        memory_slab_slot(*addr_p, node->slab, &slot) == EXIT_SUCCESS)
+        memory_slab_dealloc(node->slab, slot, &proc->secmem_index);
+    assert(ret != EXIT_SUCCESS || proc->base || node->chunk);
+    return ret;
+}
+
+/*
+ * Zero the used NODE of PROC, whose FSM, lease and handle are already gone, and give it back to the region. A large
+ * object is left to the scrubber instead, it is given back once zeroed (see process_reclaim).
+ */
+int
+process_release(secmem_process_t *proc, secmem_obj_t *node)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (!node->lz_data && node->size >= SCRUB_MIN &&
+        scrub_queue(&proc->scrub, node, process_data(proc, node, node->offset), node->size,
+                    !proc->backing) == EXIT_SUCCESS) {
+        node->scrub = TRUE;
+    } else {
+        /* a compressed object's bytes are zero already, and it has no chunk */
+        if (node->lz_data)
+            process_lz_discard(proc, node);
+        else
+            process_zero(proc, process_data(proc, node, node->offset), node->size);
+        ret |= process_chunk_free(proc, node);
+        /* the freed space is compacted next */
+        proc->compact_pos = MIN(proc->compact_pos, node->offset);
+        ret |= proc->strategy->dealloc(node, &proc->secmem_index);
+    }
+    return ret;
+}
+
 /* Allocate a memory object associated with a secmem vm address for a given process, as specified in a blob message */
 int
 process_alloc(blob_t *blob, secmem_process_t *proc) {
@@ -168,27 +880,189 @@ process_alloc(blob_t *blob, secmem_process_t *proc) {
 
     /* secmem address allocated */
     secmem_obj_t *new_node;
+    SECMEM_INTERNAL_T addr = 0;
+    alloc_opts_t opts;
 
+    /* the alignment asked for must be a power of two (see ALLOC OPTIONS) */
+    if (alloc_check(blob, &opts) != EXIT_SUCCESS || opts.align > ALLOC_ALIGN_MAX || (opts.align & (opts.align - 1))) {
+        ret = EXIT_FAILURE;
+    /* small objects go in a slab slot, which keeps its FSM state itself, if the strategy has them (and the objects are
+     * not addressed by handle, a handle needs an object of its own, nor aligned) */
+    } else if (proc->strategy->slabs && !proc->handles && opts.align <= 1 && memory_slab_class(blob->head.size) >= 0 &&
+        (ret = process_slot_new(proc, blob->head.size, fsm_desc, &addr)) == EXIT_SUCCESS) {
+        /* nothing else to set up, the slab keeps the slot's FSM state */
     /* allocate memory object, and then load a ragasm object to manage it with respect to secmem */
-    if (memory_alloc(blob->head.size, fsm_desc, &new_node, &proc->secmem_head) == EXIT_SUCCESS) {
-        /* zero out the memory, just in case the dealloc failed to clear it.
-         * Since you can only read allocated nodes, and allocated nodes are guaranteed to be zero'd out,
-         * you cannot read residual data in memory.
+    } else if ((!proc->handles || blob->head.size <= PROCESS_HANDLE_MAX_SIZE) &&
+               (ret = process_place(proc, blob->head.size, opts.align, fsm_desc, &new_node)) == EXIT_SUCCESS) {
+        /* no need to zero out the memory, free memory is always zero (see above). Since you can only read allocated
+         * nodes, and allocated nodes are guaranteed to be zero'd out, you cannot read residual data in memory.
          */
-        assert(proc->base);
-        memset(proc->base + new_node->offset, 0, new_node->size);
-        if ((ret = ragasm_load(fsm_desc, &new_node->ragasm)) != EXIT_SUCCESS)
-            memory_dealloc(new_node); // TODO raise an alarm if this fails.
+        if ((ret = ragasm_load(fsm_desc, &new_node->ragasm)) == EXIT_SUCCESS && proc->handles &&
+            (ret = process_handle_new(proc, new_node)) != EXIT_SUCCESS)
+            ragasm_unload(&new_node->ragasm);
+        assert(ret != EXIT_SUCCESS || proc->base || new_node->chunk);
+        if (ret == EXIT_SUCCESS) {
+            addr = proc->handles ? PROCESS_HANDLE_ADDR(new_node->handle) : new_node->offset;
+        } else {
+            process_chunk_free(proc, new_node);
+            proc->strategy->dealloc(new_node, &proc->secmem_index); // TODO raise an alarm if this fails.
+        }
     }
 
     /* REPLY */
     /*set the address field of the reply blob if the allocation was successful */
-    blob->head.addr = ret == EXIT_SUCCESS ? new_node->offset : 0;
+    blob->head.addr = ret == EXIT_SUCCESS ? addr : 0;
     blob->head.data_len = 0;
 
     return ret;
 }
 
+/*
+ * Reallocate the object at a secmem vm address of a process to a new size, keeping its bytes (up to the smaller of the
+ * two sizes) and its FSM state, as specified in the blob's addr and new_size fields (see REALLOC in comm.h). The object is
+ * grown or shrunk where it is if the strategy can (see memory_strategy_t), and its arena chunk too; otherwise it is
+ * moved to a new object, which takes over its FSM (see ragasm_clone), handle and alignment, and the old one is released
+ * as on DEALLOC. A slab slot stays put while the size fits it, and moves to an object of its own otherwise, its state
+ * becoming that object's. Any lease is revoked and any stream closed. The reply carries the address of the object.
+ */
+int
+process_realloc(blob_t *blob, secmem_process_t *proc)
+{
+    int ret = EXIT_FAILURE;
+    SECMEM_INTERNAL_T size = blob->head.new_size, old_size, addr = 0;
+    secmem_obj_t *node, *new_node = NULL;
+    memory_slab_t *slab;
+    char *data;
+    int slot;
+
+    if ((memory_get_obj_containing(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS && node->slab) {
+        /* a slab slot, which must be given by its start too */
+        slab = node->slab;
+        if (memory_slab_slot(blob->head.addr, slab, &slot) != EXIT_SUCCESS ||
+            blob->head.addr != node->offset + slot * slab->slot_size) {
+            ret = EXIT_FAILURE;
+        } else if (size <= slab->slot_size) {
+            addr = blob->head.addr;
+            ret = EXIT_SUCCESS;
+        } else if ((ret = process_place(proc, size, 1, slab->fsm_desc, &new_node)) == EXIT_SUCCESS &&
+                   (ret = ragasm_load(slab->fsm_desc, &new_node->ragasm)) == EXIT_SUCCESS) {
+            new_node->ragasm.curr_state = slab->state[slot];
+            data = process_data(proc, node, blob->head.addr);
+            memcpy(process_data(proc, new_node, new_node->offset), data, slab->slot_size);
+            process_zero(proc, data, slab->slot_size);
+            /* the last slot takes the slab with it, and its chunk */
+            if (!(slab->used & ~((uint64_t) 1 << slot)))
+                process_chunk_free(proc, node);
+            memory_slab_dealloc(slab, slot, &proc->secmem_index);
+            addr = new_node->offset;
+        }
+    } else if ((memory_get_obj_by_addr(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS && node->used &&
+               !node->scrub && process_touch(proc, node, WRITE_CHAR) == EXIT_SUCCESS) {
+        lease_revoke(node);
+        process_cow_break(proc, node);
+        node->stream_mode = 0;
+        old_size = node->size;
+        /* in place: the chunk grows first, it may be left larger than the object, as long as the rest of it is zero */
+        if ((!node->chunk || node->chunk->size >= size || arena_realloc(&g_arena, node->chunk, size) == EXIT_SUCCESS) &&
+            proc->strategy->realloc(node, size, &proc->secmem_index) == EXIT_SUCCESS) {
+            if (size < old_size) {
+                /* the bytes past SIZE are zeroed, whether they were given up or are still in the (buddy) block */
+                process_zero(proc, process_data(proc, node, node->offset + size), old_size - size);
+                if (node->chunk && node->chunk->size > node->size)
+                    arena_realloc(&g_arena, node->chunk, node->size);
+                /* the freed space is compacted next */
+                proc->compact_pos = MIN(proc->compact_pos, node->offset + node->size);
+            }
+            ret = EXIT_SUCCESS;
+        } else if ((!proc->handles || size <= PROCESS_HANDLE_MAX_SIZE) &&
+                   (ret = process_place(proc, size, node->align, node->ragasm.fsm_desc, &new_node)) == EXIT_SUCCESS) {
+            /* the region may have been compacted to make room, NODE is looked at only now */
+            if ((ret = ragasm_clone(&new_node->ragasm, &node->ragasm)) == EXIT_SUCCESS) {
+                memcpy(process_data(proc, new_node, new_node->offset), process_data(proc, node, node->offset),
+                       MIN(size, node->size));
+                if ((new_node->handle = node->handle)) {
+                    proc->handle_tbl[node->handle - 1].node = new_node;
+                    node->handle = 0;
+                }
+                ret = ragasm_unload(&node->ragasm);
+                ret |= process_release(proc, node);
+                node = new_node;
+            } else {
+                process_chunk_free(proc, new_node);
+                if (proc->strategy->dealloc(new_node, &proc->secmem_index) != EXIT_SUCCESS)
+                    fprintf(g_logfile, "Failed to give back the object at 0x%lx of pid %d.\n", new_node->offset,
+                            proc->pid);
+            }
+        }
+        if (ret == EXIT_SUCCESS)
+            addr = proc->handles ? PROCESS_HANDLE_ADDR(node->handle) : node->offset;
+    }
+
+    /* REPLY */
+    if (ret == EXIT_SUCCESS)
+        blob->head.addr = addr;
+    blob->head.data_len = 0;
+    return ret;
+}
+
+/*
+ * Clone the object at the secmem vm address in the blob's addr field (see CLONE in comm.h): a new object of the same
+ * size, alignment and policy, whose FSM is in the same state (see ragasm_clone), that shares the bytes of its source
+ * until either is written (see PROCESS CLONES). A slab slot is copied into a new slot instead, a slot is only a few
+ * words. The reply carries the address of the clone.
+ */
+int
+process_clone(blob_t *blob, secmem_process_t *proc)
+{
+    int ret = EXIT_FAILURE;
+    SECMEM_INTERNAL_T addr = 0;
+    secmem_obj_t *node, *new_node, *src;
+    memory_slab_t *slab;
+    int slot, new_slot;
+
+    if ((memory_get_obj_containing(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS && node->slab) {
+        /* a slab slot, which must be given by its start too */
+        slab = node->slab;
+        if (memory_slab_slot(blob->head.addr, slab, &slot) == EXIT_SUCCESS &&
+            blob->head.addr == node->offset + slot * slab->slot_size &&
+            (ret = process_slot_new(proc, slab->slot_size, slab->fsm_desc, &addr)) == EXIT_SUCCESS &&
+            (ret = memory_get_obj_containing(addr, &new_node, &proc->secmem_index)) == EXIT_SUCCESS &&
+            (ret = memory_slab_slot(addr, new_node->slab, &new_slot)) == EXIT_SUCCESS) {
+            new_node->slab->state[new_slot] = slab->state[slot];
+            memcpy(process_data(proc, new_node, addr), process_data(proc, node, blob->head.addr), slab->slot_size);
+        }
+    } else if ((memory_get_obj_by_addr(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS && node->used &&
+               !node->scrub && process_touch(proc, node, 0) == EXIT_SUCCESS &&
+               (ret = process_place(proc, node->size, node->align, node->ragasm.fsm_desc, &new_node)) == EXIT_SUCCESS) {
+        /* the region may have been compacted to make room, NODE is looked at only now */
+        if ((ret = ragasm_clone(&new_node->ragasm, &node->ragasm)) == EXIT_SUCCESS && proc->handles &&
+            (ret = process_handle_new(proc, new_node)) != EXIT_SUCCESS)
+            ragasm_unload(&new_node->ragasm);
+        if (ret == EXIT_SUCCESS) {
+            /* a clone of a clone shares the bytes of the same source */
+            src = node->cow_src ? node->cow_src : node;
+            new_node->cow_src = src;
+            new_node->cow_prev = src;
+            new_node->cow_next = src->cow_next;
+            if (src->cow_next)
+                src->cow_next->cow_prev = new_node;
+            src->cow_next = new_node;
+            addr = proc->handles ? PROCESS_HANDLE_ADDR(new_node->handle) : new_node->offset;
+        } else {
+            process_chunk_free(proc, new_node);
+            if (proc->strategy->dealloc(new_node, &proc->secmem_index) != EXIT_SUCCESS)
+                fprintf(g_logfile, "Failed to give back the object at 0x%lx of pid %d.\n", new_node->offset,
+                        proc->pid);
+        }
+    }
+
+    /* REPLY */
+    if (ret == EXIT_SUCCESS)
+        blob->head.addr = addr;
+    blob->head.data_len = 0;
+    return ret;
+}
+
 /* Deallocate and zero out the value associated with a memory object associated with a secmem vm address for a given
  * process, as specified in a blob message
  */
@@ -201,16 +1075,34 @@ process_dealloc(blob_t *blob, secmem_process_t *proc)
      * coninuing deallocation
      */
     secmem_obj_t *node;
-    if ((memory_get_obj_by_addr(blob->head.addr, &node, proc->secmem_head)) == EXIT_SUCCESS && node->used) {
+    int slot;
+    if ((memory_get_obj_containing(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS && node->slab) {
+        /* a slab slot, which must be given by its start too */
+        if (memory_slab_slot(blob->head.addr, node->slab, &slot) == EXIT_SUCCESS &&
+            blob->head.addr == node->offset + slot * node->slab->slot_size) {
+            process_zero(proc, process_data(proc, node, blob->head.addr), node->slab->slot_size);
+            /* the last slot takes the slab with it, and its chunk */
+            if (!(node->slab->used & ~((uint64_t) 1 << slot)))
+                process_chunk_free(proc, node);
+            ret = memory_slab_dealloc(node->slab, slot, &proc->secmem_index);
+        }
+    } else if ((memory_get_obj_by_addr(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS && node->used &&
+               !node->scrub) {
         /*
-         * Zero out the memory, then deallocate the ragasm, before the memory object. If either fails, the other action should still be
-         * attempted while preserving any non-zero return values (error) by logical OR'ing.
+         * Revoke any lease and deallocate the ragasm, then zero out the memory before the memory object is deallocated.
+         * If either fails, the other action should still be attempted while preserving any non-zero return values (error)
+         * by logical OR'ing. A large object is left to the scrubber, it is deallocated once zeroed (see process_release).
          */
-        if (proc->base)
-            memset(proc->base + node->offset, 0, node->size);
+        lease_revoke(node);
+        if (node->handle)
+            process_handle_free(proc, node);
+        /* a clone just leaves its source, a source hands its bytes to its clones (see PROCESS CLONES) */
+        if (node->cow_src)
+            process_cow_unlink(node);
+        else
+            process_cow_break(proc, node);
         ret = ragasm_unload(&node->ragasm);
-        ret |= memory_dealloc(node);
-
+        ret |= process_release(proc, node);
     }
 
     /* REPLY */
@@ -218,32 +1110,60 @@ process_dealloc(blob_t *blob, secmem_process_t *proc)
     return ret;
 }
 
-/* Read N bytes beginning from a process (PROC) secmem vm address as specified in the blob's data_len and addr field,
- * respectively. The data is read into the data field of the blob which is the reply.
+/* Access LEN bytes at a process (PROC) secmem vm address ADDR, which may be anywhere inside an allocated object (or
+ * slab slot) as long as the range does not run past its end. The FSM of the containing object steps once with SYMBOL (READ_CHAR or
+ * WRITE_CHAR) and, if the policy allows the access, only the requested range is copied between the object and DATA.
  */
 int
-process_read(blob_t *blob, secmem_process_t *proc )
+process_access(secmem_process_t *proc, SECMEM_INTERNAL_T addr, SECMEM_INTERNAL_T len, char symbol, char *data)
 {
     int ret = EXIT_FAILURE;
 
     /*  get a reference to the memory object */
     secmem_obj_t *node;
+    memory_slab_t *slab;
+    int slot;
     /* only allow access to memory that has already been allocated */
-    if (((memory_get_obj_by_addr(blob->head.addr, &node, proc->secmem_head)) == EXIT_SUCCESS && node->used) &&
-            node->used &&
-            node->ragasm.is_loaded) {
-        /* check that the size requested is within the bounds of the memory object @ addr */
-        if (blob->head.data_len <= node->size) {
-            ragasm_step(node->ragasm.fsm_desc->alpha_map[READ_CHAR], &node->ragasm);
-            ret = ragasm_validate(&node->ragasm);
-            if (ret == EXIT_SUCCESS) {
-                /* copy data out to reply blob */
-                void *src = (void *) (proc->base + node->offset);
-                void *dst = blob->body.data;
-                memmove(dst, src, blob->head.data_len);
+    if ((memory_get_obj_containing(addr, &node, &proc->secmem_index)) == EXIT_SUCCESS) {
+        if ((slab = node->slab)) {
+            /* a slab slot, whose FSM state is kept by the slab. The range must be within the slot. */
+            if (memory_slab_slot(addr, slab, &slot) == EXIT_SUCCESS &&
+                len <= slab->slot_size - (addr - node->offset - slot * slab->slot_size)) {
+                slab->state[slot] = ragasm_next_state(slab->fsm_desc, slab->state[slot],
+                                                      slab->fsm_desc->alpha_map[(SYMBOL_T) symbol]);
+                ret = slab->state[slot] == FSM_NULL_STATE ? EXIT_FAILURE : EXIT_SUCCESS;
             }
+        } else if (node->used && node->ragasm.is_loaded &&
+                   /* check that the range requested is within the bounds of the memory object */
+                   len <= node->size - (addr - node->offset) &&
+                   /* a compressed object is decompressed before its FSM sees the access */
+                   process_touch(proc, node, symbol) == EXIT_SUCCESS) {
+            node->stream_mode = 0;
+            ragasm_step(node->ragasm.fsm_desc->alpha_map[(SYMBOL_T) symbol], &node->ragasm);
+            lease_check(node);
+            ret = ragasm_validate(&node->ragasm);
         }
     }
+    if (ret == EXIT_SUCCESS) {
+        if (symbol == READ_CHAR) {
+            memmove(data, (void *) process_data(proc, node, addr), len);
+        } else {
+            /* a clone, or an object with clones, gets bytes of its own first (see PROCESS CLONES) */
+            process_cow_break(proc, node);
+            memmove((void *) process_data(proc, node, addr), data, len);
+        }
+    }
+    return ret;
+}
+
+/* Read N bytes beginning from a process (PROC) secmem vm address as specified in the blob's data_len and addr field,
+ * respectively. The address may point inside an object, see process_access. The data is read into the data field of
+ * the blob which is the reply.
+ */
+int
+process_read(blob_t *blob, secmem_process_t *proc )
+{
+    int ret = process_access(proc, blob->head.addr, blob->head.data_len, READ_CHAR, blob->body.data);
 
     if (ret != EXIT_SUCCESS)
         blob->head.data_len = 0;
@@ -251,32 +1171,156 @@ process_read(blob_t *blob, secmem_process_t *proc )
 }
 
 /*  Write N bytes beginning at a process (PROC) secmem vm address as specified in the blob's data_len and addr field,
- * respectively. The data is written from the data field of the incoming request blob.
+ * respectively. The address may point inside an object, see process_access. The data is written from the data field
+ * of the incoming request blob.
  */
 int
 process_write(blob_t *blob, secmem_process_t *proc)
+{
+    int ret = process_access(proc, blob->head.addr, blob->head.data_len, WRITE_CHAR, blob->body.data);
+
+    blob->head.data_len = 0; /* reply shall have no data */
+    return ret;
+}
+
+/* Read or write (SYMBOL) each object of a READV or WRITEV blob that vec_check has passed, see VECTOR STRUCTURES in
+ * comm.h. Every entry gets its own status; the blob is turned into the reply in place. A READV writes the data it reads
+ * after the array, where a WRITEV reads its data from.
+ */
+int
+process_vec(blob_t *blob, secmem_process_t *proc, char symbol)
+{
+    size_t i, array_size = blob->head.op_count * sizeof(vec_entry_t), offset = array_size;
+    SECMEM_INTERNAL_T addr;
+    vec_entry_t entry;
+
+    for (i = 0; i < blob->head.op_count; i++) {
+        memcpy(&entry, blob->body.data + i * sizeof(vec_entry_t), sizeof(entry));
+        entry.status = EXIT_FAILURE;
+        addr = entry.addr;
+        if (entry.len > 0 && process_translate(proc, &addr) == EXIT_SUCCESS)
+            entry.status = process_access(proc, addr, entry.len, symbol, blob->body.data + offset);
+        /* a failed read takes no room in the reply */
+        if (symbol == READ_CHAR && entry.status != EXIT_SUCCESS)
+            entry.len = 0;
+        offset += entry.len;
+        memcpy(blob->body.data + i * sizeof(vec_entry_t), &entry, sizeof(entry));
+    }
+
+    /* REPLY */
+    blob->head.data_len = symbol == READ_CHAR ? offset : array_size;
+    return EXIT_SUCCESS;
+}
+
+/* Open a stream over a memory object, as specified in the blob's addr and mode fields. This is the one point at which
+ * the FSM sees the streamed access; the chunks that follow are checked against the stream instead.
+ * Opening a stream on an object that already has one open starts a new access.
+ */
+int
+process_stream_open(blob_t *blob, secmem_process_t *proc)
 {
     int ret = EXIT_FAILURE;
 
     /*  get a reference to the memory object */
     secmem_obj_t *node;
     /* only allow access to memory that has already been allocated */
-    if (((memory_get_obj_by_addr(blob->head.addr, &node, proc->secmem_head)) == EXIT_SUCCESS && node->used) &&
+    if ((memory_get_obj_by_addr(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS &&
         node->used &&
-        node->ragasm.is_loaded) {
-        /* check that the size requested is within the bounds of the memory object @ addr */
-        if (blob->head.data_len <= node->size) {
-            ragasm_step(node->ragasm.fsm_desc->alpha_map[WRITE_CHAR], &node->ragasm);
-            ret = ragasm_validate(&node->ragasm);
-            if (ret == EXIT_SUCCESS) {
-                /* copy data out to reply blob */
-                void *src = (void *) blob->body.data;
-                void *dst = (void *) (proc->base + node->offset);
-                memmove(dst, src, blob->head.data_len);
-            }
+        node->ragasm.is_loaded &&
+        (blob->head.mode == READ_CHAR || blob->head.mode == WRITE_CHAR) &&
+        process_touch(proc, node, (char) blob->head.mode) == EXIT_SUCCESS) {
+        node->stream_mode = 0;
+        ragasm_step(node->ragasm.fsm_desc->alpha_map[(SYMBOL_T) blob->head.mode], &node->ragasm);
+        lease_check(node);
+        if ((ret = ragasm_validate(&node->ragasm)) == EXIT_SUCCESS) {
+            node->stream_mode = (char) blob->head.mode;
+            node->stream_pos = 0;
         }
     }
 
     blob->head.data_len = 0; /* reply shall have no data */
     return ret;
-}
\ No newline at end of file
+}
+
+/*
+ * Look up the object a stream chunk refers to, and check that the chunk is the next one of an open stream of MODE.
+ * Closes the stream once this chunk reaches the end of the object.
+ */
+int
+process_stream_chunk(blob_t *blob, secmem_process_t *proc, char mode, secmem_obj_t **node_p)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *node;
+
+    if ((memory_get_obj_by_addr(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS &&
+        node->used &&
+        node->ragasm.is_loaded &&
+        node->stream_mode == mode &&
+        blob->head.offset == node->stream_pos &&
+        blob->head.data_len <= node->size - node->stream_pos &&
+        process_touch(proc, node, mode) == EXIT_SUCCESS) {
+        node->stream_pos += blob->head.data_len;
+        if (node->stream_pos == node->size)
+            node->stream_mode = 0;
+        *node_p = node;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/* Read the next chunk of an open read stream into the data field of the blob, which is the reply. */
+int
+process_stream_read(blob_t *blob, secmem_process_t *proc)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *node;
+
+    if ((ret = process_stream_chunk(blob, proc, READ_CHAR, &node)) == EXIT_SUCCESS)
+        memmove(blob->body.data, process_data(proc, node, node->offset + blob->head.offset), blob->head.data_len);
+    else
+        blob->head.data_len = 0;
+    return ret;
+}
+
+/* Write the next chunk of an open write stream from the data field of the incoming request blob. */
+int
+process_stream_write(blob_t *blob, secmem_process_t *proc)
+{
+    int ret = EXIT_FAILURE;
+    secmem_obj_t *node;
+
+    if ((ret = process_stream_chunk(blob, proc, WRITE_CHAR, &node)) == EXIT_SUCCESS) {
+        process_cow_break(proc, node);
+        memmove(process_data(proc, node, node->offset + blob->head.offset), blob->body.data, blob->head.data_len);
+    }
+
+    blob->head.data_len = 0; /* reply shall have no data */
+    return ret;
+}
+
+/*
+ * Lease the object containing the secmem vm address in the blob's addr field, see lease.h. The object must be in a
+ * read-only state of its policy; taking the lease does not step its FSM. The reply carries the address and size of the
+ * object, the lease file is passed along with it (see omnius_lease_fd).
+ */
+int
+process_lease(blob_t *blob, secmem_process_t *proc)
+{
+    int ret = EXIT_FAILURE;
+
+    /*  get a reference to the memory object */
+    secmem_obj_t *node;
+    blob->head.data_len = 0;
+    if ((memory_get_obj_containing(blob->head.addr, &node, &proc->secmem_index)) == EXIT_SUCCESS &&
+        node->used &&
+        node->ragasm.is_loaded &&
+        FSM_IS_READ_ONLY(node->ragasm.fsm_desc, node->ragasm.curr_state) &&
+        process_touch(proc, node, 0) == EXIT_SUCCESS) {
+        node->stream_mode = 0;
+        if ((ret = lease_grant(node, process_data(proc, node, node->offset))) == EXIT_SUCCESS) {
+            blob->head.addr = proc->handles ? PROCESS_HANDLE_ADDR(node->handle) : node->offset;
+            blob->head.lease_size = node->size;
+        }
+    }
+    return ret;
+}
@@ -14,7 +14,75 @@
 #include "memory.h"
 #include "fsm_descriptor.h"
 #include "comm.h"
+#include "scrub.h"
 
+/*
+ * PROCESS HANDLES
+ *
+ * A process that loads with handles (see LOAD OPTIONS in comm.h) addresses its objects through a table of handles,
+ * the handle of an object being its slot in the table plus one, shifted up by LOAD_HANDLE_OFFSET_BITS. The slot points
+ * at the object's node, so an object can be moved by changing its offset alone. Free slots are chained by NEXT_FREE.
+ *
+ * Such a region is compacted incrementally: after each request for the process, the objects above the lowest free
+ * node are slid down over it (see process_compact) until PROCESS_COMPACT_SLICE bytes have been moved, and the next
+ * slice carries on from there. An object is always moved whole, with its FSM state. An ALLOC that finds no room
+ * compacts the whole region before it gives up.
+ */
+#define PROCESS_HANDLE_MIN 64
+#define PROCESS_HANDLE_MAX_SIZE ((SECMEM_INTERNAL_T) 1 << LOAD_HANDLE_OFFSET_BITS)
+#define PROCESS_HANDLE_ADDR(_handle) ((SECMEM_INTERNAL_T) (_handle) << LOAD_HANDLE_OFFSET_BITS)
+#define PROCESS_COMPACT_SLICE (64 * 1024)
+
+typedef struct process_handle_t
+{
+    secmem_obj_t *node;
+    SECMEM_INTERNAL_T next_free;    /* slot + 1 of the next free slot, 0 for none */
+} process_handle_t;
+
+/*
+ * PROCESS CLONES
+ *
+ * A CLONE (see comm.h) is a new object that shares the bytes of its source copy-on-write: it has space of its own in
+ * the region, which is left untouched (so zero, and not committed), and it is read from its source instead (see
+ * process_data). Clones of a clone share the bytes of the same source, the clones of a source are chained through
+ * cow_next. A clone gets bytes of its own when it is about to be written (or reallocated), by copying its source's; a
+ * source that is about to be written, reallocated or deallocated hands its bytes to its first clone instead, which
+ * becomes the source of the rest (see process_cow_break). A deallocated clone just leaves the chain.
+ */
+
+/*
+ * PROCESS COMPRESSION
+ *
+ * A process that loads with an idle time (see LOAD OPTIONS in comm.h) has its objects compressed (see lz.h) once they
+ * have gone untouched for that long. The compressed bytes go to a store of the object's own, and the object gives up
+ * its space: its bytes are zeroed, dropping their whole pages, and its arena chunk is given back. The object keeps its
+ * address (and its FSM, handle and lease); the next request that touches its bytes decompresses it first (see
+ * process_touch), which only fails if the arena has no room for it left.
+ *
+ * The objects of such a process are swept by the thread that runs its requests (see omnius_sweep), at most every
+ * quarter of its idle time. Slab slots, clones and their sources, objects in an open stream or the scrubber, and objects
+ * smaller than PROCESS_LZ_MIN are left alone, as is an object that would not shrink by 1 / PROCESS_LZ_RATIO, until it is
+ * next written. A store is zeroed before it is freed, like any other bytes of an object.
+ *
+ * What it saves, and how long decompressing takes, is counted per process (process_lz_stats_t) and shown by VIEW.
+ */
+#define PROCESS_LZ_MIN 4096     /* a smaller object has no page of its own to give up */
+#define PROCESS_LZ_RATIO 8
+
+typedef struct process_lz_stats_t
+{
+    SECMEM_INTERNAL_T objects;          /* objects compressed now */
+    SECMEM_INTERNAL_T bytes;            /* their size */
+    SECMEM_INTERNAL_T stored;           /* the size of their stores */
+    SECMEM_INTERNAL_T compressed;       /* compressions so far */
+    SECMEM_INTERNAL_T skipped;          /* objects found not to compress so far */
+    SECMEM_INTERNAL_T restored;         /* decompressions so far, and the nanoseconds they took */
+    SECMEM_INTERNAL_T restore_nsec;
+    SECMEM_INTERNAL_T restore_max_nsec;
+} process_lz_stats_t;
+
+/* The huge page size regions are aligned (THP) or rounded up (hugetlb) to, the default one on x86-64 */
+#define PROCESS_HUGE_PAGE_SIZE ((size_t) 1 << 21)
 
 /*
  * This is used to describe a process that has been registered with omnius (via LOAD message).
@@ -24,13 +92,38 @@ typedef struct secmem_process_t
 {
     pid_t pid;
     /* VM address (with respect to the omnius program) that maps to the beginning of the inferior processes secure
-     * memory (secmem) region. This is used to access the actual memory backing the secmem vm.
+     * memory (secmem) region. This is used to access the actual memory backing the secmem vm. NULL for a process that
+     * uses the arena, whose objects are each backed by a chunk of their own (see process_data).
      */
     char *base;
-    /* Total amount of secmem memory for the process. This is fixed when the process registers with omnius via load */
+    /* Total amount of secmem memory for the process. This is fixed when the process registers with omnius via load (or
+     * RESIZE), and is its quota in the arena if it uses it.
+     */
     SECMEM_INTERNAL_T mem_size;
     /* Pointer to the first node in a list of memory object nodes that together form the entire secmem area */
     secmem_obj_t *secmem_head;
+    /* Index over the same nodes, used to look them up by address */
+    memory_index_t secmem_index;
+    /* How objects are placed in the region, chosen by the LOAD (see LOAD OPTIONS) */
+    memory_strategy_t *strategy;
+    /* How the region is backed (LOAD_BACKING_*), as it turned out, and the size of its mapping */
+    SECMEM_INTERNAL_T backing;
+    size_t map_size;
+    /* Handles (see PROCESS HANDLES): the table, its size, the first free slot + 1, and where compaction carries on */
+    char handles;
+    process_handle_t *handle_tbl;
+    SECMEM_INTERNAL_T handle_count;
+    SECMEM_INTERNAL_T handle_free;
+    SECMEM_INTERNAL_T compact_pos;
+    /* TRUE if the objects are taken from the global arena (see arena.h) */
+    char arena;
+    /* Compression of idle objects (see PROCESS COMPRESSION): the idle time in msec (0 for none), when the objects are
+     * next swept, and the counters */
+    SECMEM_INTERNAL_T lz_idle;
+    SECMEM_INTERNAL_T lz_next;
+    process_lz_stats_t lz;
+    /* The objects deallocated but still in the scrubber (see scrub.h) */
+    scrub_list_t scrub;
     /* number of policies loaded for this process */
     SECMEM_INTERNAL_T fsm_count;
     /* pointer to an array of fsm_descriptors. One for each policy the process has access to. The ordering of the aray
@@ -39,12 +132,60 @@ typedef struct secmem_process_t
     fsm_descriptor_t *fsm_desc;
 } secmem_process_t;
 
+/*
+ * Counters for each backing mode (LOAD_BACKING_* bit), over all processes. A fallback is a LOAD that asked for the
+ * mode and got another one instead, a failure is one that failed because the mode could not be set up.
+ */
+typedef struct process_backing_stats_t
+{
+    SECMEM_INTERNAL_T procs;    /* loaded processes using the mode */
+    SECMEM_INTERNAL_T bytes;    /* bytes mapped for them */
+    SECMEM_INTERNAL_T fallbacks;
+    SECMEM_INTERNAL_T failures;
+} process_backing_stats_t;
+
 int process_load     (blob_t *, secmem_process_t *);
 int process_unload   (blob_t *, secmem_process_t *);
 int process_alloc    (blob_t *, secmem_process_t *);
 int process_dealloc  (blob_t *, secmem_process_t *);
+int process_realloc  (blob_t *, secmem_process_t *);
+int process_place    (secmem_process_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, fsm_descriptor_t *, secmem_obj_t **);
+int process_release  (secmem_process_t *, secmem_obj_t *);
+int process_clone    (blob_t *, secmem_process_t *);
+int process_slot_new (secmem_process_t *, SECMEM_INTERNAL_T, fsm_descriptor_t *, SECMEM_INTERNAL_T *);
+void process_cow_unlink (secmem_obj_t *);
+void process_cow_break  (secmem_process_t *, secmem_obj_t *);
+SECMEM_INTERNAL_T process_now (void);
+int process_touch        (secmem_process_t *, secmem_obj_t *, char);
+int process_lz_compress  (secmem_process_t *, secmem_obj_t *);
+int process_lz_restore   (secmem_process_t *, secmem_obj_t *);
+void process_lz_discard  (secmem_process_t *, secmem_obj_t *);
+int process_lz_sweep     (secmem_process_t *, SECMEM_INTERNAL_T);
+int process_access   (secmem_process_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T, char, char *);
 int process_read     (blob_t *, secmem_process_t *);
 int process_write    (blob_t *, secmem_process_t *);
+int process_vec      (blob_t *, secmem_process_t *, char);
+int process_stream_open  (blob_t *, secmem_process_t *);
+int process_stream_read  (blob_t *, secmem_process_t *);
+int process_stream_write (blob_t *, secmem_process_t *);
+int process_lease    (blob_t *, secmem_process_t *);
+int process_resize   (blob_t *, secmem_process_t *);
+int process_zero     (secmem_process_t *, char *, SECMEM_INTERNAL_T);
+char *process_data   (secmem_process_t *, secmem_obj_t *, SECMEM_INTERNAL_T);
+int process_map      (secmem_process_t *, SECMEM_INTERNAL_T, SECMEM_INTERNAL_T);
+int process_unmap    (secmem_process_t *);
+int process_remap    (secmem_process_t *, SECMEM_INTERNAL_T);
+void process_populate (char *, size_t);
+int process_backing_stats (int, const char **, process_backing_stats_t *);
+int process_handle_new    (secmem_process_t *, secmem_obj_t *);
+int process_handle_free   (secmem_process_t *, secmem_obj_t *);
+int process_translate     (secmem_process_t *, SECMEM_INTERNAL_T *);
+int process_compact       (secmem_process_t *, SECMEM_INTERNAL_T);
+int process_reclaim       (secmem_process_t *, char);
+int process_chunk_new     (secmem_process_t *, secmem_obj_t *);
+int process_chunk_free    (secmem_process_t *, secmem_obj_t *);
+int process_arena_init    (SECMEM_INTERNAL_T);
+int process_arena_stats   (SECMEM_INTERNAL_T *, SECMEM_INTERNAL_T *, SECMEM_INTERNAL_T *);
 
 
 #endif /* SECMEM_PROCESS_H */
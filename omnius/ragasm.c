@@ -12,7 +12,8 @@
  *      ragasm_validate,
  *      ragasm_clone_comment, and
  *      ragasm_clone,
- * which return EXIT_SUCCESS or EXIT_FAILURE depending upon their success.
+ * which return EXIT_SUCCESS or EXIT_FAILURE depending upon their success, and ragasm_next_state, which works on a bare
+ * state for objects that do not keep a whole ragasm (see memory_slab_t).
  *
  *
  * 2015 - Mike Clark
@@ -32,7 +33,7 @@
 int
 ragasm_load(fsm_descriptor_t *fsm_desc, ragasm_t *ragasm)
 {
-    fsm_desc->ref_count++;
+    ATOMIC_INC(&fsm_desc->ref_count);
     ragasm->fsm_desc = fsm_desc;
     /* the start state is always 1. Zero'th state is the invalid sink. */
     ragasm->curr_state = FSM_START_STATE;
@@ -49,8 +50,11 @@ int
 ragasm_unload(ragasm_t *ragasm)
 {
     /* The FSM descriptor will not be able to unload successfully if it has outstanding references */
-    ragasm->fsm_desc->ref_count--;
+    ATOMIC_DEC(&ragasm->fsm_desc->ref_count);
     ragasm->fsm_desc = NULL;
+    /* a clone's comment is its own copy */
+    free(ragasm->comment);
+    ragasm->comment = NULL;
 
     /* the start state is always 1. Zero'th state is the invalid sink. */
     ragasm->curr_state = FSM_NULL_STATE;
@@ -90,11 +94,18 @@ int
 ragasm_step(SYMBOL_T symbol, ragasm_t *ragasm)
 {
     ragasm->prev_state = ragasm->curr_state;
-    ragasm->curr_state = *(ragasm->curr_state * ragasm->fsm_desc->symbol_count + symbol + ragasm->fsm_desc->jmp_tbl);
+    ragasm->curr_state = ragasm_next_state(ragasm->fsm_desc, ragasm->curr_state, symbol);
     
     return EXIT_SUCCESS;
 }
 
+/* The state an FSM described by FSM_DESC goes to from STATE on input symbol */
+STATE_T
+ragasm_next_state(fsm_descriptor_t *fsm_desc, STATE_T state, SYMBOL_T symbol)
+{
+    return *(state * fsm_desc->symbol_count + symbol + fsm_desc->jmp_tbl);
+}
+
 /* FSM goto invalid sink without consuming an input.
  * Set prev_node to NULL making this irreversable (i.e. no step_back)
  */
@@ -132,10 +143,10 @@ ragasm_clone_comment(char **dst_p, char *src) {
 
     /* allocate one more space to append a clone marker */
     len = strlen(src);
-    if (len > 0 && (duplicate = (char *) calloc((len + 1), sizeof(char)))) {
+    if (len > 0 && (duplicate = (char *) calloc((len + 2), sizeof(char)))) {
         memcpy(duplicate, src, len);
-        duplicate[len - 1] = COMMENT_CLONE_MARK;
-        duplicate[len] = '\0';
+        duplicate[len] = COMMENT_CLONE_MARK;
+        duplicate[len + 1] = '\0';
         *dst_p = duplicate;
         ret = EXIT_SUCCESS;
     }
@@ -143,7 +154,8 @@ ragasm_clone_comment(char **dst_p, char *src) {
 }
 
 /* Clone a ragasm - NOTE: this does not clone the data that ragasm is supervising, just allocates new memory with the
- * same policy, and it puts the FSM in the same state.
+ * same policy, and it puts the FSM in the same state. The clone takes a reference on the FSM descriptor of its own, as
+ * ragasm_load does, so it is unloaded like any other.
  */
 int
 ragasm_clone(ragasm_t *duplicate, ragasm_t *ragasm) {
@@ -152,11 +164,14 @@ ragasm_clone(ragasm_t *duplicate, ragasm_t *ragasm) {
     duplicate->fsm_desc = ragasm->fsm_desc;
     duplicate->curr_state = ragasm->curr_state;
     duplicate->prev_state = ragasm->prev_state;
+    duplicate->comment = NULL;
     if (ragasm->comment) {
         ret = ragasm_clone_comment(&duplicate->comment, ragasm->comment);
     } else {
         ret = EXIT_SUCCESS;
     }
+    if (ret == EXIT_SUCCESS)
+        ATOMIC_INC(&duplicate->fsm_desc->ref_count);
     /*  Make sure _is_loaded is set within the locks */
     duplicate->is_loaded = ret == EXIT_SUCCESS ? TRUE : FALSE;
     return ret;
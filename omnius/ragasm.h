@@ -41,6 +41,9 @@ ragasm_step_back(ragasm_t *);
 int
 ragasm_step(SYMBOL_T, ragasm_t *);
 
+STATE_T
+ragasm_next_state(fsm_descriptor_t *, STATE_T, SYMBOL_T);
+
 int
 ragasm_invalidate(ragasm_t *);
 
@@ -57,8 +57,9 @@ public:
      * Our jmp table uses state zero for a sink and state 1 for entry, so we need to fix that. This is a side 
      * thing for a POC so it's easier to hack this together here, but not as pretty.
      * 
-     * If there is not an existing sink state (invalid state) in the DFA, construct_jmptbl will have
-     * undefined behaviour. ENSURE THAT YOUR REGEX DOES NOT ACCEPT EVERYTHING!
+     * The sink is a state that every symbol leads back to and that is not final; an accepting loop such as the one of
+     * "R*" is not a sink. If the DFA has no sink (the regex accepts everything over its own alphabet, e.g. "R*"), one
+     * is added after the last state, which only the symbols outside of the alphabet lead to.
      *
      * The trans_table effectively has two keys, current_state and input_symbol. will be first ordered by state
      * (ascending), then by input (ascending: A-Za-Z).
@@ -124,7 +125,7 @@ public:
      *
      * This routine is not responsible for freeing the jmp_tbl after this routine succeeds.
      */
-    SYMBOL_T construct_jmptbl(SYMBOL_T *alpha_map, STATE_T **jmp_tbl_p) {
+    SYMBOL_T construct_jmptbl(SYMBOL_T *alpha_map, STATE_T **jmp_tbl_p, STATE_T *state_count_p) {
         const int null_state = 0;
         const int entry_state = 1;
         STATE_T trans_table_sink_state = 0;
@@ -136,9 +137,11 @@ public:
         size_t jmp_tbl_symbol_count = trans_table_symbol_count + 1;
         //assert ((trans_table.size() % trans_table_state_count) == 0);
 
-        /* add space for one null sym per state set */
+        /* add space for one null sym per state set, and for a sink state in case there is none */
         size_t jmp_tbl_size = trans_table.size() + (trans_table_state_count * sizeof(STATE_T));
-        *jmp_tbl_p = (STATE_T *) calloc(jmp_tbl_size, sizeof(STATE_T));
+        if (trans_table_state_count >= MAX_STATE)
+            return 0; /* Error */
+        *jmp_tbl_p = (STATE_T *) calloc(jmp_tbl_size + jmp_tbl_symbol_count, sizeof(STATE_T));
         STATE_T *jmp_tbl = *jmp_tbl_p;
         if ( !jmp_tbl) {
             return 0; /* Error */
@@ -156,7 +159,7 @@ public:
 
         /* identify sink state and copy out the trans_table to the jmp table buffer */
         size_t j = 0;
-        STATE_T k = 0;
+        size_t k = 0;
         for (map<transition, state>::const_iterator i = trans_table.begin(); i != trans_table.end(); ++i, ++k) {
             if (!(k / trans_table_symbol_count)) {
                 /* run during first set of states (=0) to map the input symbols to an internal, packed enumeration */
@@ -172,7 +175,7 @@ public:
 
             /* test if this is the last element of the same src state */
             if (((k + 1) % trans_table_symbol_count) == 0 ) {
-                if (j == trans_table_symbol_count) {
+                if (j == trans_table_symbol_count && !sink_found && final.find((i->first).first) == final.end()) {
                     /* found a sink state since every transition points back to itself */
                     trans_table_sink_state = (STATE_T) (k / trans_table_symbol_count);
                     sink_found = TRUE;
@@ -189,8 +192,11 @@ public:
 #pragma GCC diagnostic pop
         }
         if (!sink_found) {
-            free(jmp_tbl_p);
-            return 0; /* Error */
+            /* add a sink, every symbol leads back to it */
+            trans_table_sink_state = (STATE_T) trans_table_state_count++;
+            for (k = 0; k < jmp_tbl_symbol_count; ++k)
+                jmp_tbl[jmp_tbl_size + k] = trans_table_sink_state;
+            jmp_tbl_size += jmp_tbl_symbol_count;
         }
 
         /* fill in the null symbol dst states with the existing sink state found */
@@ -215,9 +221,10 @@ public:
         }
 
         /* XOR swap entry state (now in the original sink state) and existing state #1, for each input symbol
-         * entry
+         * entry. If the sink already was state #1 the entry is in place (and XOR swapping a row with itself would
+         * zero it).
          */
-        for (k=0; k < jmp_tbl_symbol_count; ++k) {
+        for (k=0; trans_table_sink_state != entry_state && k < jmp_tbl_symbol_count; ++k) {
 
             jmp_tbl[(trans_table_sink_state * jmp_tbl_symbol_count) + k]   ^= jmp_tbl[(entry_state * jmp_tbl_symbol_count) + k];
             jmp_tbl[(entry_state * jmp_tbl_symbol_count) + k]           ^= jmp_tbl[(trans_table_sink_state * jmp_tbl_symbol_count) + k];
@@ -238,10 +245,13 @@ public:
          * 1            -> sink
          * sink         -> 0
          *
-         * Now update all of the index values to match the state label changes made.
+         * Now update all of the index values to match the state label changes made. If the sink was state #1 the
+         * entry and the sink have simply traded places.
          */
         for (k = 0; k < jmp_tbl_size; ++k) {
-            if (jmp_tbl[k] ==  null_state)
+            if (trans_table_sink_state == entry_state)
+                jmp_tbl[k] = jmp_tbl[k] == null_state ? entry_state : jmp_tbl[k] == entry_state ? null_state : jmp_tbl[k];
+            else if (jmp_tbl[k] ==  null_state)
                 jmp_tbl[k] = entry_state;
             else if (jmp_tbl[k] == entry_state)
                 jmp_tbl[k] = trans_table_sink_state;
@@ -258,6 +268,7 @@ public:
         }
 #endif
 
+        *state_count_p = (STATE_T) trans_table_state_count;
         return jmp_tbl_symbol_count;
     }
 
@@ -327,7 +327,7 @@ order_symbols(SYMBOL_T *sym, size_t len)
  *  The caller is responsible for deallocating the jmp table and alphamap, however if this routine is failing, it is
  *  responsible for freeing those.
  */
-extern "C" int compile_regex(char *regex, SYMBOL_T *symbol_count, SYMBOL_T **alpha_map_p, STATE_T **jmp_tbl_p)
+extern "C" int compile_regex(char *regex, SYMBOL_T *symbol_count, STATE_T *state_count, SYMBOL_T **alpha_map_p, STATE_T **jmp_tbl_p)
 {
     my_scanner().init(regex);
     parse_node* n = expr();
@@ -339,7 +339,7 @@ extern "C" int compile_regex(char *regex, SYMBOL_T *symbol_count, SYMBOL_T **alp
     if ((*alpha_map_p = (SYMBOL_T *) calloc(MAX_SYMBOL, sizeof(SYMBOL_T)))) {
         SYMBOL_T *alpha_map = *alpha_map_p;
         memset(alpha_map, FSM_NULL_STATE, MAX_SYMBOL * sizeof(SYMBOL_T)); /* default map to null state */
-        count = dfa.construct_jmptbl(alpha_map, jmp_tbl_p);
+        count = dfa.construct_jmptbl(alpha_map, jmp_tbl_p, state_count);
         *symbol_count = count;
     }
     return count > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
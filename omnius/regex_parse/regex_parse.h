@@ -9,5 +9,5 @@
 #include "../fsm_descriptor.h"
 
 void order_symbols(SYMBOL_T *, size_t);
-int compile_regex(char *, SYMBOL_T *, SYMBOL_T **, STATE_T **);
+int compile_regex(char *, SYMBOL_T *, STATE_T *, SYMBOL_T **, STATE_T **);
 #endif //SECMEM_REGEX_PARSE_H
@@ -0,0 +1,261 @@
+/* omnius/ring.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Shared-memory ring transport primitives, used by both omnius and its clients.
+ *
+ * The rings are only ever touched by one producer and one consumer, so the only synchronization needed is ordering the
+ * slot contents against the HEAD/TAIL publication (full barriers, it is not worth being clever here) and the doorbell
+ * handshake, see ring_bell_arm.
+ *
+ * Unless stated otherwise these routines return EXIT_SUCCESS or EXIT_FAILURE.
+ *
+ * 2015 - Mike Clark
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "ring.h"
+
+/* Futexes live in shared memory, so the (slower) shared variants must be used - no FUTEX_PRIVATE_FLAG */
+static long
+ring_futex(volatile uint32_t *uaddr, int op, uint32_t val, struct timespec *timeout)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+/* Polling an empty ring only makes sense when the peer can run at the same time, i.e. not on a uniprocessor. */
+static int
+ring_spin_count(void)
+{
+    static long spin = -1;
+    if (spin < 0)
+        spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN_COUNT : 0;
+    return (int) spin;
+}
+
+/* Non-zero when there is nothing to consume */
+int
+ring_is_empty(ring_t *ring)
+{
+    return ring->head == ring->tail;
+}
+
+/* Non-zero when there is no room to produce */
+int
+ring_is_full(ring_t *ring)
+{
+    return (uint32_t) (ring->head - ring->tail) >= RING_SLOT_COUNT;
+}
+
+/*
+ * Copy a message into the next free slot. Only the used part of the message (see blob_wire_size) is copied.
+ * Fails if the ring is full or the message is malformed.
+ */
+int
+ring_push(msgbuf_t *msg_buf, ring_t *ring)
+{
+    int ret = EXIT_FAILURE;
+    uint32_t head = ring->head;
+    size_t len = blob_wire_size(&msg_buf->blob);
+
+    if (!ring_is_full(ring) && len) {
+        msgbuf_t *slot = &ring->slot[head & RING_SLOT_MASK];
+        slot->mtype = msg_buf->mtype;
+        memcpy(&slot->blob, &msg_buf->blob, len);
+        /* the slot contents must be visible before the new head is */
+        __sync_synchronize();
+        ring->head = head + 1;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Copy the oldest message out of the ring and release its slot.
+ *
+ * The slot remains writable by the peer while we read it, so the header is copied out exactly once and the length is
+ * taken from the private copy. A message with an out-of-bounds length is still consumed (so the ring does not wedge),
+ * but only its header is copied and EXIT_FAILURE is returned so that the caller can reject it.
+ */
+int
+ring_pop(msgbuf_t *msg_buf, ring_t *ring)
+{
+    int ret = EXIT_FAILURE;
+    uint32_t tail = ring->tail;
+
+    if (!ring_is_empty(ring)) {
+        /* the head was read before the slot contents */
+        __sync_synchronize();
+        msgbuf_t *slot = &ring->slot[tail & RING_SLOT_MASK];
+        size_t len;
+        msg_buf->mtype = slot->mtype;
+        /* the header of either wire version fits in a v1 header */
+        memcpy(&msg_buf->blob.head, &slot->blob.head, sizeof(blob_header_t));
+        if ((len = blob_wire_size(&msg_buf->blob))) {
+            if (len > sizeof(blob_header_t))
+                memcpy(msg_buf->blob.body.data, slot->blob.body.data, len - sizeof(blob_header_t));
+            ret = EXIT_SUCCESS;
+        } else if (!IS_BLOB_V2(&msg_buf->blob)) {
+            msg_buf->blob.head.data_len = 0;
+        }
+        /* we are done reading the slot before it is handed back to the producer */
+        __sync_synchronize();
+        ring->tail = tail + 1;
+    }
+    return ret;
+}
+
+/* Ring a doorbell, waking the consumer only if it announced that it is parked */
+void
+ring_bell_ring(ring_bell_t *bell)
+{
+    __sync_fetch_and_add(&bell->bell, 1);
+    if (bell->sleeping)
+        ring_futex(&bell->bell, FUTEX_WAKE, INT32_MAX, NULL);
+}
+
+/*
+ * Announce that the consumer is about to park on a doorbell and return the bell value to wait against.
+ * The caller must check for work once more after arming and before calling ring_bell_wait; a producer that pushes in
+ * between will have changed the bell value and the wait returns immediately, so no wakeup is lost.
+ */
+uint32_t
+ring_bell_arm(ring_bell_t *bell)
+{
+    bell->sleeping = TRUE;
+    __sync_synchronize();
+    return bell->bell;
+}
+
+/*
+ * Park on an armed doorbell until it is rung or USEC microseconds pass (a negative USEC waits indefinitely).
+ * Returns EXIT_SUCCESS when woken, EXIT_FAILURE on timeout.
+ */
+int
+ring_bell_wait(ring_bell_t *bell, uint32_t seen, long usec)
+{
+    int ret = EXIT_SUCCESS;
+    struct timespec timeout;
+
+    timeout.tv_sec = usec / 1000000;
+    timeout.tv_nsec = (usec % 1000000) * 1000;
+    if (ring_futex(&bell->bell, FUTEX_WAIT, seen, usec < 0 ? NULL : &timeout) == -1 && errno == ETIMEDOUT)
+        ret = EXIT_FAILURE;
+    bell->sleeping = FALSE;
+    return ret;
+}
+
+/*
+ * Create a ring pair and attach it to omnius. IPC_IN and IPC_OUT are the message queue ids used to bootstrap the
+ * connection.
+ *
+ * The segment is marked for removal as soon as omnius has attached it, so it disappears once both ends detach (or die).
+ */
+int
+ring_client_attach(int ipc_in, int ipc_out, ring_client_t *client)
+{
+    int ret = EXIT_FAILURE;
+    msgbuf_t msg_buf;
+
+    memset(client, 0, sizeof(*client));
+    if ((client->shmid = shmget(IPC_PRIVATE, sizeof(ring_pair_t), 0600 | IPC_CREAT)) == -1) {
+        perror("shmget");
+        return ret;
+    }
+    if ((client->pair = (ring_pair_t *) shmat(client->shmid, NULL, 0)) == (void *) -1) {
+        perror("shmat");
+        shmctl(client->shmid, IPC_RMID, NULL);
+        return ret;
+    }
+    memset(client->pair, 0, sizeof(ring_pair_t));
+    client->pair->magic = RING_MAGIC;
+    client->pair->slot_count = RING_SLOT_COUNT;
+    client->pair->owner = getpid();
+
+    /* bootstrap over the message queue */
+    memset(&msg_buf, 0, sizeof(msg_buf));
+    msg_buf.mtype = MTYPE_ATTACH;
+    msg_buf.blob.head.pid = getpid();
+    msg_buf.blob.head.token = MTYPE_TOKEN(getpid());
+    msg_buf.blob.head.shmid = (SECMEM_INTERNAL_T) client->shmid;
+    if (msgsnd(ipc_in, &msg_buf, SIZEOF_BLOB(&msg_buf.blob), 0) != -1 &&
+        msgrcv(ipc_out, &msg_buf, MAX_MTEXT_SIZE, MTYPE_TOKEN(getpid()), 0) != -1 &&
+        IS_ACK(msg_buf.blob.head.reply_mtype)) {
+        /* the reply carries the id of omnius' doorbell segment */
+        client->server_bell = (ring_bell_t *) shmat((int) msg_buf.blob.head.shmid, NULL, 0);
+        if (client->server_bell != (void *) -1)
+            ret = EXIT_SUCCESS;
+    }
+
+    shmctl(client->shmid, IPC_RMID, NULL);
+    if (ret != EXIT_SUCCESS) {
+        shmdt(client->pair);
+        client->pair = NULL;
+        client->server_bell = NULL;
+    }
+    return ret;
+}
+
+/*
+ * Send a request over the ring and wait for its reply, which is written back into MSG_BUF.
+ * Only one request is ever outstanding, so the next reply is always ours.
+ */
+int
+ring_client_call(msgbuf_t *msg_buf, ring_client_t *client)
+{
+    int spin, spin_count = ring_spin_count();
+    ring_t *rep = &client->pair->rep;
+
+    while (ring_push(msg_buf, &client->pair->req) != EXIT_SUCCESS) {
+        if (!blob_wire_size(&msg_buf->blob))
+            return EXIT_FAILURE;
+        sched_yield();
+    }
+    ring_bell_ring(client->server_bell);
+
+    for (spin = 0; ring_is_empty(rep); spin++) {
+        if (spin >= spin_count) {
+            uint32_t seen = ring_bell_arm(&rep->doorbell);
+            if (ring_is_empty(rep))
+                ring_bell_wait(&rep->doorbell, seen, -1);
+            else
+                rep->doorbell.sleeping = FALSE;
+        }
+    }
+    return ring_pop(msg_buf, rep);
+}
+
+/* Detach a ring pair from omnius (over the message queue) and unmap it locally. */
+int
+ring_client_detach(int ipc_in, int ipc_out, ring_client_t *client)
+{
+    int ret = EXIT_FAILURE;
+    msgbuf_t msg_buf;
+
+    memset(&msg_buf, 0, sizeof(msg_buf));
+    msg_buf.mtype = MTYPE_DETACH;
+    msg_buf.blob.head.pid = getpid();
+    msg_buf.blob.head.token = MTYPE_TOKEN(getpid());
+    msg_buf.blob.head.shmid = (SECMEM_INTERNAL_T) client->shmid;
+    if (msgsnd(ipc_in, &msg_buf, SIZEOF_BLOB(&msg_buf.blob), 0) != -1 &&
+        msgrcv(ipc_out, &msg_buf, MAX_MTEXT_SIZE, MTYPE_TOKEN(getpid()), 0) != -1 &&
+        IS_ACK(msg_buf.blob.head.reply_mtype))
+        ret = EXIT_SUCCESS;
+
+    if (client->server_bell)
+        shmdt(client->server_bell);
+    if (client->pair)
+        shmdt(client->pair);
+    client->pair = NULL;
+    client->server_bell = NULL;
+    return ret;
+}
@@ -0,0 +1,116 @@
+/* omnius/ring.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Shared-memory ring transport.
+ *
+ * A client that talks to omnius often can skip the SysV message queue on the hot path by attaching a ring pair: one
+ * single-producer/single-consumer ring carrying requests into omnius and one carrying replies back out. Both rings live
+ * in a SysV shared memory segment created by the client. The segment id is handed to omnius with an ATTACH message over
+ * the regular message queue, which therefore remains the bootstrap (and fallback) path.
+ *
+ * Each ring slot holds a msgbuf_t, so the framing is identical to the message queue: mtype tags the request and the
+ * reply is the same mtype OR'd with ACK/NAK.
+ *
+ * Doorbells are futex words. A consumer that runs out of work parks on the producer's doorbell, and a producer only
+ * issues the wake syscall when the consumer has announced that it is parked. While both sides are busy no syscalls are
+ * made at all. omnius owns one shared doorbell (ring_bell_t) that every client rings after pushing a request, so a single
+ * futex wait covers all attached rings.
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef SECMEM_RING_H
+#define SECMEM_RING_H
+
+#include "global.h"
+#include "comm.h"
+
+#define RING_MAGIC 0x6f6d6e72 /* "omnr" */
+/* Must be a power of two */
+#define RING_SLOT_COUNT 16
+#define RING_SLOT_MASK (RING_SLOT_COUNT - 1)
+/* Number of times a consumer polls an empty ring before parking on its doorbell */
+#define RING_SPIN_COUNT 1024
+#define RING_CACHE_LINE 64
+
+/*
+ * A doorbell. BELL is bumped by the producer after every push; SLEEPING is set by a consumer about to wait on BELL.
+ */
+typedef struct ring_bell_t
+{
+    volatile uint32_t bell;
+    volatile uint32_t sleeping;
+} ring_bell_t;
+
+/*
+ * A single-producer/single-consumer ring of message buffers.
+ * HEAD is only written by the producer and TAIL is only written by the consumer, they are kept on separate cache lines.
+ */
+typedef struct ring_t
+{
+    volatile uint32_t head;
+    char pad0[RING_CACHE_LINE - sizeof(uint32_t)];
+    volatile uint32_t tail;
+    char pad1[RING_CACHE_LINE - sizeof(uint32_t)];
+    ring_bell_t doorbell;
+    char pad2[RING_CACHE_LINE - sizeof(ring_bell_t)];
+    msgbuf_t slot[RING_SLOT_COUNT];
+} ring_t;
+
+/*
+ * The layout of the shared memory segment a client attaches.
+ * The client produces into REQ and consumes from REP, omnius does the opposite.
+ */
+typedef struct ring_pair_t
+{
+    uint32_t magic;
+    uint32_t slot_count;
+    /* the pid that created the pair, omnius only attaches it for that pid */
+    pid_t owner;
+    ring_t req;
+    ring_t rep;
+} ring_pair_t;
+
+/*
+ * Client side handle of an attached ring pair.
+ */
+typedef struct ring_client_t
+{
+    int shmid;
+    ring_pair_t *pair;
+    ring_bell_t *server_bell;
+} ring_client_t;
+
+
+int
+ring_is_empty(ring_t *);
+
+int
+ring_is_full(ring_t *);
+
+int
+ring_push(msgbuf_t *, ring_t *);
+
+int
+ring_pop(msgbuf_t *, ring_t *);
+
+void
+ring_bell_ring(ring_bell_t *);
+
+uint32_t
+ring_bell_arm(ring_bell_t *);
+
+int
+ring_bell_wait(ring_bell_t *, uint32_t, long);
+
+int
+ring_client_attach(int, int, ring_client_t *);
+
+int
+ring_client_call(msgbuf_t *, ring_client_t *);
+
+int
+ring_client_detach(int, int, ring_client_t *);
+
+#endif /* SECMEM_RING_H */
@@ -0,0 +1,181 @@
+/* omnius/scrub.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * See scrub.h. The queue and the lists of the owners are all guarded by one lock; the scrubber only holds it to take
+ * a job and to hand it back.
+ *
+ * Unless said otherwise, the routines return EXIT_SUCCESS or EXIT_FAILURE.
+ *
+ * 2015 - Mike Clark
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#include "scrub.h"
+
+pthread_t g_scrub_thread;
+pthread_mutex_t g_scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_scrub_cond = PTHREAD_COND_INITIALIZER;        /* a job was queued, or stop */
+pthread_cond_t g_scrub_done_cond = PTHREAD_COND_INITIALIZER;   /* a job was done */
+scrub_job_t *g_scrub_head;
+scrub_job_t *g_scrub_tail;
+char g_scrub_running;
+char g_scrub_stop;
+
+/* Start the scrubber thread */
+int
+scrub_start(void)
+{
+    int ret = EXIT_FAILURE;
+
+    g_scrub_stop = FALSE;
+    if (pthread_create(&g_scrub_thread, NULL, scrub_thread, NULL) == 0) {
+        g_scrub_running = TRUE;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/* Stop the scrubber once it has zeroed everything queued */
+int
+scrub_stop(void)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (g_scrub_running) {
+        pthread_mutex_lock(&g_scrub_lock);
+        g_scrub_stop = TRUE;
+        pthread_cond_signal(&g_scrub_cond);
+        pthread_mutex_unlock(&g_scrub_lock);
+        ret = pthread_join(g_scrub_thread, NULL) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        g_scrub_running = FALSE;
+    }
+    return ret;
+}
+
+/*
+ * Queue NODE of the owner of LIST, whose bytes are the SIZE from DATA, to be zeroed (DROP as for scrub_zero). Fails,
+ * and the caller has to zero it itself, if the scrubber is not running.
+ */
+int
+scrub_queue(scrub_list_t *list, secmem_obj_t *node, char *data, size_t size, char drop)
+{
+    int ret = EXIT_FAILURE;
+    scrub_job_t *job;
+
+    if (g_scrub_running && (job = (scrub_job_t *) calloc(1, sizeof(scrub_job_t))) != NULL) {
+        job->list = list;
+        job->node = node;
+        job->data = data;
+        job->size = size;
+        job->drop = drop;
+        pthread_mutex_lock(&g_scrub_lock);
+        if (g_scrub_tail)
+            g_scrub_tail->next = job;
+        else
+            g_scrub_head = job;
+        g_scrub_tail = job;
+        list->pending++;
+        pthread_cond_signal(&g_scrub_cond);
+        pthread_mutex_unlock(&g_scrub_lock);
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Take the jobs of LIST that are done, placed in JOBS_P (NULL for none), which the caller frees. With WAIT, the
+ * pending ones are waited for first, so none are left in the scrubber.
+ */
+int
+scrub_reap(scrub_list_t *list, char wait, scrub_job_t **jobs_p)
+{
+    int ret = EXIT_SUCCESS;
+
+    pthread_mutex_lock(&g_scrub_lock);
+    while (wait && list->pending)
+        pthread_cond_wait(&g_scrub_done_cond, &g_scrub_lock);
+    *jobs_p = list->done;
+    list->done = NULL;
+    pthread_mutex_unlock(&g_scrub_lock);
+    return ret;
+}
+
+/*
+ * Zero SIZE bytes from DATA. If DROP, the whole pages in the range are dropped (MADV_DONTNEED gives them back zeroed
+ * on their next touch), if there are at least SCRUB_DROP_PAGES of them; the rest is stored.
+ */
+void
+scrub_zero(char *data, size_t size, char drop)
+{
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) data, end = start + size;
+    uintptr_t first = (start + page - 1) & ~(page - 1), last = end & ~(page - 1);
+
+    if (drop && first < last && (last - first) / page >= SCRUB_DROP_PAGES &&
+        madvise((void *) first, last - first, MADV_DONTNEED) == 0) {
+        scrub_memzero((char *) start, first - start);
+        scrub_memzero((char *) last, end - last);
+    } else {
+        scrub_memzero(data, size);
+    }
+}
+
+/* Store zero to SIZE bytes from DATA, bypassing the cache for a range of SCRUB_MIN bytes or more */
+void
+scrub_memzero(char *data, size_t size)
+{
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    char *p = (char *) (((uintptr_t) data + 15) & ~(uintptr_t) 15), *end = data + size;
+
+    if (size >= SCRUB_MIN) {
+        memset(data, 0, p - data);
+        for (; p + 64 <= end; p += 64) {
+            _mm_stream_si128((__m128i *) p, zero);
+            _mm_stream_si128((__m128i *) (p + 16), zero);
+            _mm_stream_si128((__m128i *) (p + 32), zero);
+            _mm_stream_si128((__m128i *) (p + 48), zero);
+        }
+        memset(p, 0, end - p);
+        /* the streamed stores are weakly ordered, make them visible before the range is reused */
+        _mm_sfence();
+    } else
+#endif /* __SSE2__ */
+        memset(data, 0, size);
+}
+
+/* The scrubber: zero the queued jobs in order, until it is told to stop and the queue is empty */
+void *
+scrub_thread(void *arg)
+{
+    scrub_job_t *job;
+
+    for (;;) {
+        pthread_mutex_lock(&g_scrub_lock);
+        while (!g_scrub_head && !g_scrub_stop)
+            pthread_cond_wait(&g_scrub_cond, &g_scrub_lock);
+        if ((job = g_scrub_head) && !(g_scrub_head = job->next))
+            g_scrub_tail = NULL;
+        pthread_mutex_unlock(&g_scrub_lock);
+        if (!job)
+            break;
+
+        scrub_zero(job->data, job->size, job->drop);
+
+        pthread_mutex_lock(&g_scrub_lock);
+        job->next = job->list->done;
+        job->list->done = job;
+        job->list->pending--;
+        pthread_cond_broadcast(&g_scrub_done_cond);
+        pthread_mutex_unlock(&g_scrub_lock);
+    }
+    return NULL;
+}
@@ -0,0 +1,72 @@
+/* omnius/scrub.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * The scrubber.
+ *
+ * Free memory is always zero, so a deallocated object has to be zeroed before its space can be allocated again. For
+ * a large object that takes long enough to hold up every other request of the thread that runs it, so an object of
+ * SCRUB_MIN bytes or more is handed to the scrubber instead: a thread of its own that zeroes the queued objects in
+ * order. Until then the object stays allocated as far as its region is concerned, but is cut off from everything (it
+ * has no FSM, lease or handle), so nothing can read it. Once zeroed it is put on the done list of its owner, and the
+ * thread that runs the owner's requests gives it back to the region (scrub_reap), from where it is clean.
+ *
+ * Ranges of SCRUB_MIN bytes or more are zeroed with non-temporal stores, so they do not push everything else out of
+ * the cache; in a range whose pages may be dropped, the whole pages are dropped instead (if there are at least
+ * SCRUB_DROP_PAGES of them), the system gives them back zeroed on their next touch.
+ *
+ * Without the scrubber (scrub_start) objects are zeroed when they are deallocated, as the small ones always are.
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef SECMEM_SCRUB_H
+#define SECMEM_SCRUB_H
+
+#include <pthread.h>
+#include "global.h"
+#include "memory.h"
+
+#define SCRUB_MIN ((size_t) 256 * 1024)
+#define SCRUB_DROP_PAGES 4
+
+/* A queued object: the node of its owner, and the bytes to zero */
+typedef struct scrub_job_t
+{
+    struct scrub_job_t *next;
+    struct scrub_list_t *list;
+    secmem_obj_t *node;
+    char *data;
+    size_t size;
+    char drop;
+} scrub_job_t;
+
+/* The objects of one owner (a process) in the scrubber, the ones not yet zeroed and the ones done */
+typedef struct scrub_list_t
+{
+    SECMEM_INTERNAL_T pending;
+    scrub_job_t *done;
+} scrub_list_t;
+
+int
+scrub_start(void);
+
+int
+scrub_stop(void);
+
+int
+scrub_queue(scrub_list_t *, secmem_obj_t *, char *, size_t, char);
+
+int
+scrub_reap(scrub_list_t *, char, scrub_job_t **);
+
+void
+scrub_zero(char *, size_t, char);
+
+void
+scrub_memzero(char *, size_t);
+
+void *
+scrub_thread(void *);
+
+#endif /* SECMEM_SCRUB_H */
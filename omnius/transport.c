@@ -0,0 +1,763 @@
+/* omnius/transport.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * The message queue, ring and unix socket transports (see transport.h).
+ *
+ * 2015 - Mike Clark
+ */
+#define _GNU_SOURCE /* accept4, struct ucred */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "global.h"
+#include "transport.h"
+#include "unixsock.h"
+
+
+/*
+ * MESSAGE QUEUE
+ */
+
+/*
+ * Set up the message queue transport over the (already connected) queues IPC_IN and IPC_OUT.
+ */
+int
+transport_msgq_init(int ipc_in, int ipc_out, transport_handler_t handler, transport_t *t)
+{
+    int ret = EXIT_FAILURE;
+    transport_msgq_t *q;
+
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+    if ((q = (transport_msgq_t *) calloc(1, sizeof(transport_msgq_t)))) {
+        q->ipc_in = ipc_in;
+        q->ipc_out = ipc_out;
+        t->kind = TRANSPORT_MSGQ;
+        t->name = "msgq";
+        t->active = TRUE;
+        t->handler = handler;
+        t->poll = transport_msgq_poll;
+        t->wait = transport_msgq_wait;
+        t->reply = transport_msgq_reply;
+        t->close = transport_msgq_close;
+        t->priv = q;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Hand over a request stashed by wait, then whatever else is queued (up to the poll budget).
+ */
+int
+transport_msgq_poll(transport_t *t)
+{
+    transport_msgq_t *q = (transport_msgq_t *) t->priv;
+    msgbuf_t msg_buf;
+    ssize_t len;
+    int n, busy = FALSE;
+
+    if (q->stashed) {
+        q->stashed = FALSE;
+        busy = TRUE;
+        if (t->handler(t, &q->stash, NULL) != EXIT_SUCCESS)
+            return busy;
+    }
+
+    for (n = 0; n < TRANSPORT_POLL_BUDGET; n++) {
+        /* ZERO out the buffer */
+        memset(&msg_buf, 0, sizeof(msg_buf));
+        if ((len = msgrcv(q->ipc_in, &msg_buf, MAX_MTEXT_SIZE, 0, IPC_NOWAIT)) == -1) {
+            if (errno != ENOMSG)
+                perror("msgrcv");
+            break;
+        }
+        busy = TRUE;
+        transport_msgq_check(&msg_buf, (size_t) len);
+        if (t->handler(t, &msg_buf, NULL) != EXIT_SUCCESS)
+            break;
+    }
+    return busy;
+}
+
+/*
+ * A message queue cannot be waited on with a timeout, so a bounded wait is a plain sleep. An unbounded wait blocks in
+ * msgrcv and stashes the request for the next poll.
+ */
+void
+transport_msgq_wait(transport_t *t, long usec)
+{
+    transport_msgq_t *q = (transport_msgq_t *) t->priv;
+    ssize_t len;
+
+    if (q->stashed)
+        return;
+    if (usec >= 0) {
+        usleep(usec);
+    } else {
+        memset(&q->stash, 0, sizeof(q->stash));
+        if ((len = msgrcv(q->ipc_in, &q->stash, MAX_MTEXT_SIZE, 0, 0)) != -1) {
+            transport_msgq_check(&q->stash, (size_t) len);
+            q->stashed = TRUE;
+        } else if (errno != EINTR)
+            perror("msgrcv");
+    }
+}
+
+/*
+ * Check that a request of LEN bytes (as msgrcv counts them, without the mtype) agrees with the blob header it carries.
+ * A request that does not has its data dropped and MTYPE_MOD_NAK set, see transport.h.
+ */
+void
+transport_msgq_check(msgbuf_t *msg_buf, size_t len)
+{
+    if (!blob_wire_size(&msg_buf->blob) || blob_wire_size(&msg_buf->blob) != len) {
+        msg_buf->mtype |= MTYPE_MOD_NAK;
+        if (!IS_BLOB_V2(&msg_buf->blob))
+            msg_buf->blob.head.data_len = 0;
+    }
+}
+
+int
+transport_msgq_reply(transport_t *t, msgbuf_t *msg_buf, void *conn)
+{
+    int ret = EXIT_FAILURE;
+    transport_msgq_t *q = (transport_msgq_t *) t->priv;
+    size_t len = blob_wire_size(&msg_buf->blob);
+
+    if (!len || (msgsnd(q->ipc_out, msg_buf, len, 0) == -1))
+        perror("msgsnd");
+    else
+        ret = EXIT_SUCCESS;
+    return ret;
+}
+
+void
+transport_msgq_close(transport_t *t)
+{
+    free(t->priv);
+    t->priv = NULL;
+    t->active = FALSE;
+}
+
+
+/*
+ * RING
+ *
+ * The transport is only active while at least one ring pair is attached. Rings are attached and detached by requests
+ * arriving over the message queue, see transport_ring_attach.
+ */
+
+int
+transport_ring_init(transport_handler_t handler, transport_t *t)
+{
+    int ret = EXIT_FAILURE;
+    transport_ring_t *r;
+
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+    if ((r = (transport_ring_t *) calloc(1, sizeof(transport_ring_t)))) {
+        r->bell_shmid = -1;
+        t->kind = TRANSPORT_RING;
+        t->name = "ring";
+        t->handler = handler;
+        t->poll = transport_ring_poll;
+        t->wait = transport_ring_wait;
+        t->reply = transport_ring_reply;
+        t->close = transport_ring_close;
+        t->priv = r;
+        ret = EXIT_SUCCESS;
+    }
+    return ret;
+}
+
+/*
+ * Attach a ring pair created by a client (see ring.h). The id of the doorbell segment the client must ring after
+ * pushing a request is returned through BELL_SHMID. The doorbell is created on the first attach.
+ *
+ * The pair must have been created by PID, the pid of the ATTACH, and name it as its owner; a pair that is already
+ * attached is refused, so one client cannot take over another's ring.
+ */
+int
+transport_ring_attach(int shmid, pid_t pid, int *bell_shmid, transport_t *t)
+{
+    int i, ret = EXIT_FAILURE;
+    transport_ring_t *r = (transport_ring_t *) t->priv;
+    transport_ring_conn_t *conn;
+    struct shmid_ds shm_stat;
+    ring_pair_t *pair;
+
+    for (i = 0; i < r->count; i++) {
+        if (r->conn[i]->shmid == shmid)
+            return ret;
+    }
+    if (r->count < TRANSPORT_MAX_RINGS &&
+        shmctl(shmid, IPC_STAT, &shm_stat) != -1 &&
+        shm_stat.shm_segsz >= sizeof(ring_pair_t) && shm_stat.shm_cpid == pid) {
+        if (r->bell_shmid == -1 && (r->bell_shmid = shmget(IPC_PRIVATE, sizeof(ring_bell_t), 0600 | IPC_CREAT)) != -1) {
+            if ((r->bell = (ring_bell_t *) shmat(r->bell_shmid, NULL, 0)) == (void *) -1) {
+                shmctl(r->bell_shmid, IPC_RMID, NULL);
+                r->bell_shmid = -1;
+                r->bell = NULL;
+            }
+        }
+        if (r->bell && (pair = (ring_pair_t *) shmat(shmid, NULL, 0)) != (void *) -1) {
+            if (pair->magic == RING_MAGIC && pair->slot_count == RING_SLOT_COUNT && pair->owner == pid &&
+                (conn = (transport_ring_conn_t *) calloc(1, sizeof(transport_ring_conn_t)))) {
+                conn->shmid = shmid;
+                conn->pid = pid;
+                conn->pair = pair;
+                r->conn[r->count++] = conn;
+                t->active = TRUE;
+                *bell_shmid = r->bell_shmid;
+                ret = EXIT_SUCCESS;
+            } else {
+                shmdt(pair);
+            }
+        }
+    }
+    return ret;
+}
+
+/*
+ * Detach a ring pair by its segment id, if it was attached by PID.
+ */
+int
+transport_ring_detach(int shmid, pid_t pid, transport_t *t)
+{
+    int i, ret = EXIT_FAILURE;
+    transport_ring_t *r = (transport_ring_t *) t->priv;
+
+    for (i = 0; i < r->count; i++) {
+        if (r->conn[i]->shmid == shmid && r->conn[i]->pid == pid) {
+            r->conn[i]->dead = TRUE;
+            transport_ring_release(r->conn[i]);
+            r->conn[i] = r->conn[--r->count];
+            ret = EXIT_SUCCESS;
+            break;
+        }
+    }
+    t->active = r->count > 0;
+    return ret;
+}
+
+/*
+ * Unmap and free a detached ring pair, unless replies are still owed on it.
+ */
+void
+transport_ring_release(transport_ring_conn_t *conn)
+{
+    if (conn->dead && !conn->inflight) {
+        shmdt(conn->pair);
+        free(conn);
+    }
+}
+
+/*
+ * Detach rings whose client has gone away (the segment is no longer attached by anyone else).
+ */
+void
+transport_ring_reap(transport_t *t)
+{
+    int i;
+    transport_ring_t *r = (transport_ring_t *) t->priv;
+    struct shmid_ds shm_stat;
+
+    r->reap = FALSE;
+    for (i = 0; i < r->count; i++) {
+        if (shmctl(r->conn[i]->shmid, IPC_STAT, &shm_stat) == -1 || shm_stat.shm_nattch < 2) {
+            r->conn[i]->dead = TRUE;
+            transport_ring_release(r->conn[i]);
+            r->conn[i--] = r->conn[--r->count];
+        }
+    }
+    t->active = r->count > 0;
+}
+
+/*
+ * Service every attached ring pair. At most a poll budget of requests is taken from each ring per call, and a request
+ * is only taken when there is room for its reply (counting the replies still owed).
+ */
+int
+transport_ring_poll(transport_t *t)
+{
+    transport_ring_t *r = (transport_ring_t *) t->priv;
+    transport_ring_conn_t *conn;
+    msgbuf_t msg_buf;
+    int i, n, busy = FALSE;
+
+    if (r->reap)
+        transport_ring_reap(t);
+
+    for (i = 0; i < r->count; i++) {
+        conn = r->conn[i];
+        for (n = 0; n < TRANSPORT_POLL_BUDGET && !ring_is_empty(&conn->pair->req) &&
+                    conn->inflight + (uint32_t) (conn->pair->rep.head - conn->pair->rep.tail) < RING_SLOT_COUNT; n++) {
+            busy = TRUE;
+            if (ring_pop(&msg_buf, &conn->pair->req) != EXIT_SUCCESS)
+                msg_buf.mtype |= MTYPE_MOD_NAK;
+            conn->inflight++;
+            if (t->handler(t, &msg_buf, conn) != EXIT_SUCCESS)
+                return busy;
+        }
+    }
+    return busy;
+}
+
+/*
+ * Park until a client rings the doorbell, or until USEC microseconds pass. When the wait times out, the next poll looks
+ * for rings whose client has gone away.
+ */
+void
+transport_ring_wait(transport_t *t, long usec)
+{
+    int i;
+    transport_ring_t *r = (transport_ring_t *) t->priv;
+    uint32_t seen = ring_bell_arm(r->bell);
+
+    for (i = 0; i < r->count; i++) {
+        if (!ring_is_empty(&r->conn[i]->pair->req)) {
+            r->bell->sleeping = FALSE;
+            return;
+        }
+    }
+
+    if (ring_bell_wait(r->bell, seen, usec) != EXIT_SUCCESS)
+        r->reap = TRUE;
+}
+
+/*
+ * CONN is the ring the request was taken from.
+ */
+int
+transport_ring_reply(transport_t *t, msgbuf_t *msg_buf, void *conn_p)
+{
+    int ret = EXIT_FAILURE;
+    transport_ring_conn_t *conn = (transport_ring_conn_t *) conn_p;
+
+    conn->inflight--;
+    if (conn->dead) {
+        transport_ring_release(conn);
+    } else if ((ret = ring_push(msg_buf, &conn->pair->rep)) == EXIT_SUCCESS) {
+        ring_bell_ring(&conn->pair->rep.doorbell);
+    }
+    return ret;
+}
+
+void
+transport_ring_close(transport_t *t)
+{
+    transport_ring_t *r = (transport_ring_t *) t->priv;
+
+    while (r->count) {
+        r->conn[--r->count]->dead = TRUE;
+        r->conn[r->count]->inflight = 0;
+        transport_ring_release(r->conn[r->count]);
+    }
+    if (r->bell_shmid != -1) {
+        shmdt(r->bell);
+        shmctl(r->bell_shmid, IPC_RMID, NULL);
+    }
+    free(r);
+    t->priv = NULL;
+    t->active = FALSE;
+}
+
+
+/*
+ * UNIX SOCKET
+ *
+ * Everything is non-blocking and level-triggered. Replies that a connection's socket buffer will not take are queued on
+ * the connection and flushed when epoll reports it writable. Once TRANSPORT_SOCKET_MAX_PENDING replies are queued, no
+ * more requests are read from that connection until its client catches up; the kernel then pushes back on the client
+ * (its sends block or fail with EAGAIN) without affecting anyone else.
+ */
+
+/*
+ * Create, bind and listen on the socket at PATH (replacing a stale one).
+ */
+int
+transport_socket_init(char *path, transport_handler_t handler, transport_t *t)
+{
+    int ret = EXIT_FAILURE;
+    transport_socket_t *s;
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return ret;
+    strcpy(addr.sun_path, path);
+
+    if (!(s = (transport_socket_t *) calloc(1, sizeof(transport_socket_t))))
+        return ret;
+    s->path = path;
+    s->epoll_fd = -1;
+    unlink(path);
+
+    if ((s->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+    } else if (bind(s->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("bind");
+    } else if (listen(s->listen_fd, TRANSPORT_SOCKET_BACKLOG) == -1) {
+        perror("listen");
+    } else if ((s->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+    } else {
+        /* the listening socket is tagged with a NULL connection */
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) == -1)
+            perror("epoll_ctl");
+        else
+            ret = EXIT_SUCCESS;
+    }
+
+    t->kind = TRANSPORT_SOCKET;
+    t->name = "socket";
+    t->handler = handler;
+    t->poll = transport_socket_poll;
+    t->wait = transport_socket_wait;
+    t->reply = transport_socket_reply;
+    t->reply_fd = transport_socket_reply_fd;
+    t->peer = transport_socket_peer;
+    t->close = transport_socket_close;
+    t->priv = s;
+    if (ret == EXIT_SUCCESS)
+        t->active = TRUE;
+    else
+        transport_socket_close(t);
+    return ret;
+}
+
+/*
+ * Accept pending connections (up to the poll budget). Returns TRUE if any were accepted.
+ */
+int
+transport_socket_accept(transport_t *t)
+{
+    transport_socket_t *s = (transport_socket_t *) t->priv;
+    transport_socket_conn_t *conn;
+    struct epoll_event ev;
+    struct ucred cred;
+    socklen_t cred_len;
+    int n, fd, busy = FALSE;
+
+    for (n = 0; n < TRANSPORT_POLL_BUDGET; n++) {
+        if ((fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                perror("accept4");
+            break;
+        }
+        busy = TRUE;
+        if (!(conn = (transport_socket_conn_t *) calloc(1, sizeof(transport_socket_conn_t)))) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        cred_len = sizeof(cred);
+        conn->pid = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0 ? cred.pid : -1;
+        conn->events = EPOLLIN;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        if ((conn->next = s->conns))
+            conn->next->prev = conn;
+        s->conns = conn;
+        s->conn_count++;
+    }
+    return busy;
+}
+
+/*
+ * Close a connection, dropping any replies still queued on it. The connection itself is freed once no replies are
+ * owed on it.
+ */
+void
+transport_socket_drop(transport_t *t, transport_socket_conn_t *conn)
+{
+    transport_socket_t *s = (transport_socket_t *) t->priv;
+    transport_socket_pending_t *pending;
+    int i;
+
+    /* forget any events still to be handled for this connection */
+    for (i = 0; i < s->event_count; i++) {
+        if (s->events[i].data.ptr == conn)
+            s->events[i].events = 0;
+    }
+
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    while ((pending = conn->pending_head)) {
+        conn->pending_head = pending->next;
+        if (pending->fd >= 0)
+            close(pending->fd);
+        free(pending);
+    }
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        s->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    s->conn_count--;
+    conn->pending = 0;
+    conn->dead = TRUE;
+    transport_socket_free(conn);
+}
+
+void
+transport_socket_free(transport_socket_conn_t *conn)
+{
+    if (conn->dead && !conn->inflight)
+        free(conn);
+}
+
+/*
+ * Bring the events a connection is registered for in line with its reply queue: EPOLLOUT while replies are queued,
+ * and EPOLLIN only while it has room for more requests.
+ */
+void
+transport_socket_rearm(transport_t *t, transport_socket_conn_t *conn)
+{
+    transport_socket_t *s = (transport_socket_t *) t->priv;
+    struct epoll_event ev;
+    uint32_t events = 0;
+
+    if (conn->pending + conn->inflight < TRANSPORT_SOCKET_MAX_PENDING)
+        events |= EPOLLIN;
+    if (conn->pending)
+        events |= EPOLLOUT;
+
+    if (events != conn->events) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) != -1)
+            conn->events = events;
+    }
+}
+
+/*
+ * Send as many queued replies as the socket will take.
+ */
+void
+transport_socket_flush(transport_t *t, transport_socket_conn_t *conn)
+{
+    transport_socket_pending_t *pending;
+
+    while ((pending = conn->pending_head)) {
+        if (unixsock_send_fd(conn->fd, &pending->msg_buf, pending->fd) != EXIT_SUCCESS &&
+            (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        /* sent, or it never will be (a dead connection is reaped by the HUP that follows) */
+        if (!(conn->pending_head = pending->next))
+            conn->pending_tail = NULL;
+        conn->pending--;
+        if (pending->fd >= 0)
+            close(pending->fd);
+        free(pending);
+    }
+    transport_socket_rearm(t, conn);
+}
+
+/*
+ * Read requests from a connection (up to the poll budget, and only while it has room for more).
+ * Returns EXIT_FAILURE if the connection was dropped or the handler asked to stop.
+ */
+int
+transport_socket_read(transport_t *t, transport_socket_conn_t *conn)
+{
+    msgbuf_t msg_buf;
+    int n;
+
+    for (n = 0; n < TRANSPORT_POLL_BUDGET && conn->pending + conn->inflight < TRANSPORT_SOCKET_MAX_PENDING; n++) {
+        /* ZERO out the buffer */
+        memset(&msg_buf, 0, sizeof(msg_buf));
+        if (unixsock_recv(conn->fd, &msg_buf) != EXIT_SUCCESS) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno != EBADMSG) {
+                transport_socket_drop(t, conn);
+                return EXIT_FAILURE;
+            }
+            msg_buf.mtype |= MTYPE_MOD_NAK;
+            if (!IS_BLOB_V2(&msg_buf.blob))
+                msg_buf.blob.head.data_len = 0;
+        }
+        conn->inflight++;
+        if (t->handler(t, &msg_buf, conn) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Handle the events stashed by wait, or whatever is ready right now.
+ */
+int
+transport_socket_poll(transport_t *t)
+{
+    transport_socket_t *s = (transport_socket_t *) t->priv;
+    transport_socket_conn_t *conn;
+    uint32_t events;
+    int i, busy = FALSE;
+
+    if (!s->event_count && (s->event_count = epoll_wait(s->epoll_fd, s->events, TRANSPORT_SOCKET_EVENTS, 0)) == -1) {
+        if (errno != EINTR)
+            perror("epoll_wait");
+        s->event_count = 0;
+    }
+
+    for (i = 0; i < s->event_count; i++) {
+        conn = (transport_socket_conn_t *) s->events[i].data.ptr;
+        events = s->events[i].events;
+        if (!events)
+            continue;
+        busy = TRUE;
+        if (!conn) {
+            transport_socket_accept(t);
+            continue;
+        }
+        if (events & EPOLLOUT)
+            transport_socket_flush(t, conn);
+        if (events & EPOLLIN) {
+            if (transport_socket_read(t, conn) != EXIT_SUCCESS) {
+                /* a handler that stops the poll leaves the remaining events for next time */
+                if (s->events[i].events)
+                    break;
+                continue;
+            }
+        } else if (events & (EPOLLHUP | EPOLLERR)) {
+            transport_socket_drop(t, conn);
+        }
+    }
+    if (i < s->event_count) {
+        memmove(s->events, s->events + i + 1, (s->event_count - i - 1) * sizeof(struct epoll_event));
+        s->event_count -= i + 1;
+    } else {
+        s->event_count = 0;
+    }
+    return busy;
+}
+
+/*
+ * Wait on epoll; the events are handled by the next poll.
+ */
+void
+transport_socket_wait(transport_t *t, long usec)
+{
+    transport_socket_t *s = (transport_socket_t *) t->priv;
+
+    if (s->event_count)
+        return;
+    if ((s->event_count = epoll_wait(s->epoll_fd, s->events, TRANSPORT_SOCKET_EVENTS, usec < 0 ? -1 : (int) ((usec + 999) / 1000))) == -1) {
+        if (errno != EINTR)
+            perror("epoll_wait");
+        s->event_count = 0;
+    }
+}
+
+/*
+ * CONN is the connection the request was read from. A reply the socket will not take right now is queued on the
+ * connection.
+ */
+int
+transport_socket_reply(transport_t *t, msgbuf_t *msg_buf, void *conn_p)
+{
+    return transport_socket_reply_fd(t, msg_buf, -1, conn_p);
+}
+
+/*
+ * As transport_socket_reply, passing FD (unless it is -1) with the reply. A queued reply holds a dup of FD.
+ */
+int
+transport_socket_reply_fd(transport_t *t, msgbuf_t *msg_buf, int fd, void *conn_p)
+{
+    int ret = EXIT_FAILURE;
+    transport_socket_conn_t *conn = (transport_socket_conn_t *) conn_p;
+    transport_socket_pending_t *pending;
+
+    conn->inflight--;
+    if (conn->dead) {
+        transport_socket_free(conn);
+        return ret;
+    }
+
+    if (!conn->pending && unixsock_send_fd(conn->fd, msg_buf, fd) == EXIT_SUCCESS) {
+        ret = EXIT_SUCCESS;
+    } else if ((conn->pending || errno == EAGAIN || errno == EWOULDBLOCK) &&
+               blob_wire_size(&msg_buf->blob) &&
+               (pending = (transport_socket_pending_t *) malloc(sizeof(transport_socket_pending_t)))) {
+        if (fd >= 0 && (pending->fd = dup(fd)) == -1) {
+            free(pending);
+        } else {
+            if (fd < 0)
+                pending->fd = -1;
+            pending->next = NULL;
+            pending->len = SIZEOF_UNIXSOCK_MSG(msg_buf);
+            memcpy(&pending->msg_buf, msg_buf, pending->len);
+            if (conn->pending_tail)
+                conn->pending_tail->next = pending;
+            else
+                conn->pending_head = pending;
+            conn->pending_tail = pending;
+            conn->pending++;
+            ret = EXIT_SUCCESS;
+        }
+    }
+    transport_socket_rearm(t, conn);
+    return ret;
+}
+
+/*
+ * The pid of the client on CONN.
+ */
+int
+transport_socket_peer(transport_t *t, void *conn_p, pid_t *pid_p)
+{
+    transport_socket_conn_t *conn = (transport_socket_conn_t *) conn_p;
+
+    *pid_p = conn->pid;
+    return conn->pid > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void
+transport_socket_close(transport_t *t)
+{
+    transport_socket_t *s = (transport_socket_t *) t->priv;
+
+    if (!s)
+        return;
+    while (s->conns) {
+        s->conns->inflight = 0;
+        transport_socket_drop(t, s->conns);
+    }
+    if (s->epoll_fd != -1)
+        close(s->epoll_fd);
+    if (s->listen_fd != -1) {
+        close(s->listen_fd);
+        unlink(s->path);
+    }
+    free(s);
+    t->priv = NULL;
+    t->active = FALSE;
+}
@@ -0,0 +1,244 @@
+/* omnius/transport.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Transports move requests into omnius and replies back out. Every transport frames messages as a msgbuf_t, so the
+ * dispatch path does not care where a request came from.
+ *
+ * A transport is driven by listen() through three operations:
+ *  poll  - take the requests that are ready (without blocking) and hand each one to the handler, together with an
+ *          opaque connection reference. Returns TRUE if any request was taken. Polling stops early when the handler
+ *          returns anything other than EXIT_SUCCESS.
+ *  wait  - park until a request may be ready, or until USEC microseconds pass (a negative USEC waits indefinitely).
+ *  reply - send a reply on the connection its request arrived on.
+ *
+ * A transport that can pass a file descriptor with a reply (see LEASE in comm.h) also has:
+ *  reply_fd - reply, passing a file descriptor along. The descriptor stays the caller's, the transport dups it if the
+ *             reply has to wait.
+ *  peer     - the pid of the process at the other end of a connection, as vouched for by the kernel.
+ * The others leave them NULL.
+ *
+ * Whoever completes a request calls reply, so the handler may reply straight away or later on (e.g. from a worker
+ * thread). Every request handed to the handler must be replied to exactly once, since that is what releases its
+ * connection: a connection that closes while requests are in flight is only freed once the last of them is replied to
+ * (the reply itself is dropped).
+ *
+ * Transports are not thread safe. Whoever calls poll or reply holds LOCK; the handler is called with it held. wait is
+ * only ever called by the thread that polls, and must not be called with LOCK held.
+ *
+ * A request that could not be read intact (e.g. a truncated packet) is still handed to the handler, with its data
+ * dropped and MTYPE_MOD_NAK already set in its mtype, so that it fails validation and is answered with a NAK.
+ *
+ * Transports:
+ *  msgq   - the SysV message queue pair omnius has always used. It is the bootstrap for the ring transport.
+ *  ring   - shared-memory ring pairs attached by clients (see ring.h).
+ *  socket - a SOCK_SEQPACKET unix domain socket driven by epoll, one connection per client (see unixsock.h).
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef SECMEM_TRANSPORT_H
+#define SECMEM_TRANSPORT_H
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "comm.h"
+#include "ring.h"
+
+/* Transport kinds, in the order listen() prefers to park on them when idle */
+#define TRANSPORT_RING   0
+#define TRANSPORT_SOCKET 1
+#define TRANSPORT_MSGQ   2
+#define TRANSPORT_COUNT  3
+
+/* Maximum number of ring pairs attached at once */
+#define TRANSPORT_MAX_RINGS 64
+/* Maximum number of requests taken from one ring or connection per poll, so that none can starve the others */
+#define TRANSPORT_POLL_BUDGET 16
+/* Number of requests in flight or replies queued on a socket connection before omnius stops reading its requests */
+#define TRANSPORT_SOCKET_MAX_PENDING 64
+#define TRANSPORT_SOCKET_BACKLOG 128
+#define TRANSPORT_SOCKET_EVENTS 64
+
+struct transport_t;
+
+/* Called for every request taken off a transport */
+typedef int (*transport_handler_t)(struct transport_t *, msgbuf_t *, void *);
+
+typedef struct transport_t
+{
+    int kind;
+    const char *name;
+    /* TRUE while the transport has anything to listen to */
+    int active;
+    transport_handler_t handler;
+    int  (*poll)  (struct transport_t *);
+    void (*wait)  (struct transport_t *, long);
+    int  (*reply) (struct transport_t *, msgbuf_t *, void *);
+    int  (*reply_fd) (struct transport_t *, msgbuf_t *, int, void *);
+    int  (*peer)  (struct transport_t *, void *, pid_t *);
+    void (*close) (struct transport_t *);
+    void *priv;
+    pthread_mutex_t lock;
+} transport_t;
+
+/*
+ * Transport specific state.
+ */
+typedef struct transport_msgq_t
+{
+    int ipc_in;
+    int ipc_out;
+    /* a request received while blocked in wait, handed out by the next poll */
+    int stashed;
+    msgbuf_t stash;
+} transport_msgq_t;
+
+typedef struct transport_ring_conn_t
+{
+    int shmid;
+    /* the pid that attached it */
+    pid_t pid;
+    ring_pair_t *pair;
+    /* requests taken but not replied to yet */
+    int inflight;
+    /* detached, freed by the last reply */
+    int dead;
+} transport_ring_conn_t;
+
+typedef struct transport_ring_t
+{
+    transport_ring_conn_t *conn[TRANSPORT_MAX_RINGS];
+    int count;
+    ring_bell_t *bell;
+    int bell_shmid;
+    /* set by a wait that timed out, the next poll detaches rings whose client has gone away */
+    int reap;
+} transport_ring_t;
+
+typedef struct transport_socket_conn_t
+{
+    struct transport_socket_conn_t *next;
+    struct transport_socket_conn_t *prev;
+    int fd;
+    /* the pid of the client, from SO_PEERCRED when it connected */
+    pid_t pid;
+    /* replies the socket would not take yet, oldest first */
+    struct transport_socket_pending_t *pending_head;
+    struct transport_socket_pending_t *pending_tail;
+    int pending;
+    /* requests read but not replied to yet */
+    int inflight;
+    /* closed, freed by the last reply */
+    int dead;
+    /* the events currently registered with epoll */
+    uint32_t events;
+} transport_socket_conn_t;
+
+typedef struct transport_socket_pending_t
+{
+    struct transport_socket_pending_t *next;
+    /* the file descriptor passed with the reply, -1 for none */
+    int fd;
+    size_t len;
+    msgbuf_t msg_buf;
+} transport_socket_pending_t;
+
+typedef struct transport_socket_t
+{
+    int listen_fd;
+    int epoll_fd;
+    char *path;
+    transport_socket_conn_t *conns;
+    int conn_count;
+    /* events returned by wait, handled by the next poll */
+    struct epoll_event events[TRANSPORT_SOCKET_EVENTS];
+    int event_count;
+} transport_socket_t;
+
+
+int
+transport_msgq_init(int, int, transport_handler_t, transport_t *);
+
+int
+transport_msgq_poll(transport_t *);
+
+void
+transport_msgq_wait(transport_t *, long);
+
+void
+transport_msgq_check(msgbuf_t *, size_t);
+
+int
+transport_msgq_reply(transport_t *, msgbuf_t *, void *);
+
+void
+transport_msgq_close(transport_t *);
+
+int
+transport_ring_init(transport_handler_t, transport_t *);
+
+int
+transport_ring_attach(int, pid_t, int *, transport_t *);
+
+int
+transport_ring_detach(int, pid_t, transport_t *);
+
+void
+transport_ring_release(transport_ring_conn_t *);
+
+void
+transport_ring_reap(transport_t *);
+
+int
+transport_ring_poll(transport_t *);
+
+void
+transport_ring_wait(transport_t *, long);
+
+int
+transport_ring_reply(transport_t *, msgbuf_t *, void *);
+
+void
+transport_ring_close(transport_t *);
+
+int
+transport_socket_init(char *, transport_handler_t, transport_t *);
+
+int
+transport_socket_accept(transport_t *);
+
+void
+transport_socket_drop(transport_t *, transport_socket_conn_t *);
+
+void
+transport_socket_free(transport_socket_conn_t *);
+
+void
+transport_socket_rearm(transport_t *, transport_socket_conn_t *);
+
+void
+transport_socket_flush(transport_t *, transport_socket_conn_t *);
+
+int
+transport_socket_read(transport_t *, transport_socket_conn_t *);
+
+int
+transport_socket_poll(transport_t *);
+
+void
+transport_socket_wait(transport_t *, long);
+
+int
+transport_socket_reply(transport_t *, msgbuf_t *, void *);
+
+int
+transport_socket_reply_fd(transport_t *, msgbuf_t *, int, void *);
+
+int
+transport_socket_peer(transport_t *, void *, pid_t *);
+
+void
+transport_socket_close(transport_t *);
+
+#endif /* SECMEM_TRANSPORT_H */
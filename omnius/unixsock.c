@@ -0,0 +1,167 @@
+/* omnius/unixsock.c
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Unix domain socket framing helpers.
+ *
+ * The send and receive routines return EXIT_SUCCESS or EXIT_FAILURE. On failure errno tells why:
+ *  EAGAIN      - (non-blocking sockets) nothing could be sent or received right now,
+ *  ECONNRESET  - the peer has gone away,
+ *  EBADMSG     - a malformed packet was received (and discarded).
+ *
+ * A reply may carry a file descriptor (a LEASE, see lease.h), passed with SCM_RIGHTS alongside the packet.
+ *
+ * 2015 - Mike Clark
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "unixsock.h"
+
+/* Send one message as a single packet */
+int
+unixsock_send(int fd, msgbuf_t *msg_buf)
+{
+    return unixsock_send_fd(fd, msg_buf, -1);
+}
+
+/* Send one message as a single packet, passing PASS_FD along with it unless it is -1 */
+int
+unixsock_send_fd(int fd, msgbuf_t *msg_buf, int pass_fd)
+{
+    int ret = EXIT_FAILURE;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t len;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = msg_buf;
+    iov.iov_len = SIZEOF_UNIXSOCK_MSG(msg_buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (pass_fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+
+    if (!blob_wire_size(&msg_buf->blob)) {
+        errno = EBADMSG;
+    } else if ((len = sendmsg(fd, &msg, MSG_NOSIGNAL)) == (ssize_t) SIZEOF_UNIXSOCK_MSG(msg_buf)) {
+        ret = EXIT_SUCCESS;
+    } else if (len == -1 && errno == EPIPE) {
+        errno = ECONNRESET;
+    }
+    return ret;
+}
+
+/*
+ * The file descriptor passed with a message received into MSG (whose control buffer has room for UNIXSOCK_CONTROL_LEN
+ * bytes), or -1 if there is none. Any other descriptors that came with it are closed.
+ */
+int
+unixsock_passed_fd(struct msghdr *msg)
+{
+    int fd = -1, extra;
+    struct cmsghdr *cmsg;
+    size_t i;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        for (i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+            memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (fd < 0)
+                fd = extra;
+            else
+                close(extra);
+        }
+    }
+    return fd;
+}
+
+/*
+ * Receive one packet, and check that its length agrees with the blob header it carries. Any part of the header the
+ * packet is too short to hold is zeroed, so the check never reads stale data.
+ */
+int
+unixsock_recv(int fd, msgbuf_t *msg_buf)
+{
+    int ret = EXIT_FAILURE;
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t len;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(msg_buf, 0, sizeof(long) + sizeof(blob_header_t));
+    iov.iov_base = msg_buf;
+    iov.iov_len = sizeof(msgbuf_t);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if ((len = recvmsg(fd, &msg, 0)) == 0) {
+        errno = ECONNRESET;
+    } else if (len > 0) {
+        if ((msg.msg_flags & MSG_TRUNC) ||
+            !blob_wire_size(&msg_buf->blob) ||
+            (size_t) len != SIZEOF_UNIXSOCK_MSG(msg_buf)) {
+            errno = EBADMSG;
+        } else {
+            ret = EXIT_SUCCESS;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Connect to omnius' socket. Returns the socket, or -1 on error.
+ */
+int
+unixsock_connect(char *path)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Send a request and wait for the next reply on a blocking socket, which is written back into MSG_BUF.
+ */
+int
+unixsock_call(int fd, msgbuf_t *msg_buf)
+{
+    int ret = EXIT_FAILURE;
+    if (unixsock_send(fd, msg_buf) == EXIT_SUCCESS)
+        ret = unixsock_recv(fd, msg_buf);
+    return ret;
+}
@@ -0,0 +1,43 @@
+/* omnius/unixsock.h
+ * Copyright 2015 Mike Clark
+ * Distributed under the GNU General Public License V.2
+ *
+ *
+ * Unix domain socket framing, used by omnius' socket transport and by its clients.
+ *
+ * The socket is SOCK_SEQPACKET, so message boundaries are kept by the kernel. Each packet is a msgbuf_t cut down to
+ * the part in use: the mtype followed by the blob, in either wire version (see blob_wire_size). Replies are framed the
+ * same way.
+ *
+ * 2015 - Mike Clark
+ */
+#ifndef SECMEM_UNIXSOCK_H
+#define SECMEM_UNIXSOCK_H
+
+#include <sys/socket.h>
+#include "comm.h"
+
+#define UNIXSOCK_DEFAULT_PATH "/tmp/omnius.sock"
+#define SIZEOF_UNIXSOCK_MSG(_pmsg) (sizeof(long) + blob_wire_size(&(_pmsg)->blob))
+/* Room for the control data of a message that passes a file descriptor */
+#define UNIXSOCK_CONTROL_LEN CMSG_SPACE(sizeof(int))
+
+int
+unixsock_send(int, msgbuf_t *);
+
+int
+unixsock_send_fd(int, msgbuf_t *, int);
+
+int
+unixsock_passed_fd(struct msghdr *);
+
+int
+unixsock_recv(int, msgbuf_t *);
+
+int
+unixsock_connect(char *);
+
+int
+unixsock_call(int, msgbuf_t *);
+
+#endif /* SECMEM_UNIXSOCK_H */